@@ -97,7 +97,7 @@ int main (int argc, char *argv[]) {
   else {
     cout << setprecision(8);
     if (conversion.compare("lambda2x") == 0) 
-      cout << inst.lambda2x(xslit, yslit, lambda) << endl;
+      cout << setprecision(12) << inst.lambda2x(xslit, yslit, lambda) << endl;
     if (conversion.compare("x2lambda") == 0)
       cout << inst.x2lambda(xslit, yslit, xpos) << endl;
   }
@@ -186,7 +186,7 @@ void read_slittable(const string filename, instrument &inst)
       if (result >= lambdamin && result <= lambdamax) { 
 	output << conversionmode << " " << xslit << " " << yslit << " " << a 
 	       << " " << result / 10. << " " << dimx << " " << dimy << " " << xshift 
-	       << " " << yshift << " " << slittilt << " " << objid << " " << label << endl;
+	       << " " << yshift << " " << slittilt << " " << objid << " " << label << "\n";
       }
     }
 
@@ -205,7 +205,7 @@ void read_slittable(const string filename, instrument &inst)
 	    output << conversionmode << " " << xslit << " " << yslit 
 		   << " " << sign*lambda / 10. << " " << result << " " << dimx 
 		   << " " << dimy << " " << xshift << " " << yshift 
-		   << " " << slittilt << " " << objid << " " << label << endl;
+		   << " " << slittilt << " " << objid << " " << label << "\n";
 	  }
 	}
       }
@@ -217,7 +217,7 @@ void read_slittable(const string filename, instrument &inst)
       if (result > 0.) {
 	output << conversionmode << " " << xslit << " " << yslit << " " << a/10. 
 	       << " " << result << " " << dimx << " " << dimy << " " << xshift 
-	       << " " << yshift << " " << slittilt << " " << objid << " " << label << endl;
+	       << " " << yshift << " " << slittilt << " " << objid << " " << label << "\n";
       }
     }
 
@@ -227,7 +227,7 @@ void read_slittable(const string filename, instrument &inst)
       if (a>=lambdamin && a<=lambdamax && result > 0) {
 	output << conversionmode << " " << xslit << " " << yslit << " " << a/10. 
 	       << " " << result << " " << dimx << " " << dimy << " " << xshift 
-	       << " " << yshift << " " << slittilt << " " << objid << " " << label << endl;
+	       << " " << yshift << " " << slittilt << " " << objid << " " << label << "\n";
       }
     }
 
@@ -243,7 +243,7 @@ void read_slittable(const string filename, instrument &inst)
       double result2 = inst.lambda2x(xslit, yslit, lambdamax, linearmode);
       output << conversionmode << " " << xslit << " " << yslit << " " << a/10. 
 	     << " " << result1 << " " << dimx << " " << dimy << " " << result1 
-	     << " " << result2 << " " << slittilt << " " << objid << " " << label << endl;
+	     << " " << result2 << " " << slittilt << " " << objid << " " << label << "\n";
     }
 
     // do 2nd-order box
@@ -264,7 +264,7 @@ void read_slittable(const string filename, instrument &inst)
 	result2 = inst.lambda2x(xslit, yslit, (order+1.)*lambdamax, "linear");
 	output << conversionmode << " " << xslit << " " << yslit << " " << a/10. 
 	       << " " << result1 << " " << dimx << " " << dimy << " " << result1 
-	       << " " << result2 << " " << slittilt << " " << objid << " " << label << endl;
+	       << " " << result2 << " " << slittilt << " " << objid << " " << label << "\n";
 	// Use a -20 to +20A interval to make zero order box visible
 	// Only for R150. For other gratings the zero order is never visible,
 	// and the wavelength inversions become nonsensical anyway.
@@ -275,7 +275,7 @@ void read_slittable(const string filename, instrument &inst)
 	  result2 = inst.lambda2x(xslit, yslit, 20., "linear");
 	  output << conversionmode << " " << xslit << " " << yslit << " " << a/10. 
 		 << " " << result1 << " " << dimx << " " << dimy << " " << result1 
-		 << " " << result2 << " " << slittilt << " " << objid << " " << label << endl;
+		 << " " << result2 << " " << slittilt << " " << objid << " " << label << "\n";
 	}
 	*/
       }
@@ -286,7 +286,7 @@ void read_slittable(const string filename, instrument &inst)
 	result2 = inst.lambda2x(xslit, yslit, lambdamax/order);
 	output << conversionmode << " " << xslit << " " << yslit << " " << a/10. 
 	       << " " << result1 << " " << dimx << " " << dimy << " " << result1 
-	       << " " << result2 << " " << slittilt << " " << objid << " " << label << endl;
+	       << " " << result2 << " " << slittilt << " " << objid << " " << label << "\n";
       }
     }
   }
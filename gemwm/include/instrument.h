@@ -10,7 +10,16 @@ using namespace std;
 class instrument {
 
  private:
-  // nothing yet
+  // Caches of wavecal_coeffs(), [0] for the full model and [1] in linear
+  // mode: the CWL polynomials at pCwl, and the wcc of the last slit
+  double p[2][4][6];
+  double pCwl[2];
+  bool pValid[2];
+  double slitWcc[2][4];
+  double slitX[2], slitY[2];
+  bool slitValid[2];
+
+  void wavecal_coeffs(const double, const double, const bool, double *);
 
  public:
   string name;
@@ -21,6 +30,8 @@ class instrument {
   double cwl;
   double coeff[4][6][3];  // This will hold the wavecal coefficients
                           // Not all slots in this array will be filled;
+                          // Read before the first conversion, which
+                          // caches polynomials of them
 
   // constructor
   instrument (string instname, string instdisperser, string instmode="", 
@@ -29,6 +40,8 @@ class instrument {
     disperser = instdisperser;
     mode = instmode;
     cwl = instcwl;
+    pValid[0] = pValid[1] = false;
+    slitValid[0] = slitValid[1] = false;
   }
   
   // destructor;
@@ -95,6 +95,21 @@ void instrument::check_param(const string param,
 // ************************************************************************
 void instrument::calc_wavecal_coeffs(const double xslit, const double yslit, 
 				     vector<double> &wcc, const string linearmode)
+{
+  double c[4];
+
+  wavecal_coeffs(xslit, yslit, linearmode.compare("linear") == 0, c);
+  wcc.assign(c, c+4);
+}
+
+
+// ************************************************************************
+// The wavelength calibration coefficients of the slit at (xslit, yslit).
+// The CWL polynomials are evaluated once per cwl, the coefficients once
+// per slit (per run of calls for the same slit, as in gemwm's grids).
+// ************************************************************************
+void instrument::wavecal_coeffs(const double xslit, const double yslit,
+				const bool linear, double *c)
 {
   /* 
      The wavelength is parametrised as a cubic function,
@@ -107,14 +122,10 @@ void instrument::calc_wavecal_coeffs(const double xslit, const double yslit,
      GMOS implementation was adopted
   */
 
-  // If linearmode == "linear", then only the coefficients for a linear
-  // model are considered
+  // If linear, then only the coefficients for a linear model are considered
   
   // MODEL UNITS: Wavelength in Angstrom, 1x1 binning
 
-  int i, j, k;
-  double p[6] = {0., 0., 0., 0., 0., 0.};
-
   // lambda   = sum( wcc[i] * pow(xpos,i) )                                // cubic
   // wcc[0-1] = sum( p[i] * pow(xslit, i) ) + sum( p[j] * pow(yslit, j))   // cubic in x, quadratic in y
   // wcc[2-3] = sum( p[i] * pow(xslit, i) )                                // cubic
@@ -122,55 +133,40 @@ void instrument::calc_wavecal_coeffs(const double xslit, const double yslit,
 
   // wcc = wavelength calibration coefficients
 
-  // wcc[0-1]
-  for (k=0; k<=1; k++) {
-    for (j=0; j<=5; j++) {
-      p[j] = 0.;
-      if (linearmode.compare("linear") == 0) {
-	for (i=0; i<=1; i++) {
-	  p[j] += coeff[k][j][i]*pow(cwl,i);
-	}
-      } else {
-	for (i=0; i<=2; i++) {
-	  p[j] += coeff[k][j][i]*pow(cwl,i);
-	}
+  int m = linear ? 1 : 0;
+  int j, k;
+
+  // p[] depend on the CWL only
+  if (!pValid[m] || pCwl[m] != cwl) {
+    for (k=0; k<=3; k++) {
+      for (j=0; j<=(k<=1 ? 5 : 3); j++) {
+	if (linear) p[m][k][j] = coeff[k][j][0] + cwl*coeff[k][j][1];
+	else p[m][k][j] = coeff[k][j][0] + cwl*(coeff[k][j][1] + cwl*coeff[k][j][2]);
       }
-    }
-    // Overwrite calculations if in linear mode
-    if (linearmode.compare("linear") == 0) {
-      p[2] = 0.;
-      p[3] = 0.;
-      p[5] = 0.;
-    }
-    wcc.push_back(p[0] + p[1]*xslit + p[2]*pow(xslit,2) + p[3]*pow(xslit,3)
-		  + p[4]*yslit + p[5]*pow(yslit,2));
-  }
-  
-  // cout << "pi: " << p[0] << " " << p[1] << " " << p[2] << " " << p[3] << " " << p[4] << endl;
-  // cout << "c0: " << wcc[0] << endl;
-
-  // wcc[2-3]
-  for (k=2; k<=3; k++) {
-    for (j=0; j<=3; j++) {
-      p[j] = 0.;
-      if (linearmode.compare("linear") == 0) {
-	for (i=0; i<=1; i++) {
-	  p[j] += coeff[k][j][i]*pow(cwl,i);
-	}
-      } else {
-	for (i=0; i<=2; i++) {
-	  p[j] += coeff[k][j][i]*pow(cwl,i);
-	}
+      // Overwrite calculations if in linear mode
+      if (linear) {
+	p[m][k][2] = 0.;
+	p[m][k][3] = 0.;
+	if (k<=1) p[m][k][5] = 0.;
       }
     }
-    // Overwrite calculations if in linear mode
-    if (linearmode.compare("linear") == 0) {
-      p[2] = 0.;
-      p[3] = 0.;
+    pCwl[m] = cwl;
+    pValid[m] = true;
+    slitValid[m] = false;
+  }
+
+  if (!slitValid[m] || slitX[m] != xslit || slitY[m] != yslit) {
+    for (k=0; k<=3; k++) {
+      const double *pk = p[m][k];
+      slitWcc[m][k] = pk[0] + xslit*(pk[1] + xslit*(pk[2] + xslit*pk[3]));
+      if (k<=1) slitWcc[m][k] += yslit*(pk[4] + yslit*pk[5]);
     }
-    wcc.push_back(p[0] + p[1]*xslit + p[2]*xslit*xslit + p[3]*pow(xslit,3) );
+    slitX[m] = xslit;
+    slitY[m] = yslit;
+    slitValid[m] = true;
   }
-  //  cout << wcc[0] << " " << wcc[1] << " " << wcc[2] << " " << wcc[3] << endl; 
+
+  for (k=0; k<=3; k++) c[k] = slitWcc[m][k];
 }
 
 
@@ -180,14 +176,10 @@ void instrument::calc_wavecal_coeffs(const double xslit, const double yslit,
 double instrument::x2lambda(const double xslit, const double yslit, 
 			    const double xpos)
 {
-  double lambda = 0.0;
-  vector<double> wcc;
-  calc_wavecal_coeffs(xslit, yslit, wcc);
+  double c[4];
+  wavecal_coeffs(xslit, yslit, false, c);
 
-  for (size_t k=0; k<wcc.size(); k++) {
-    lambda += wcc[k]*pow(xpos,static_cast<int>(k));
-  }
-  return lambda;
+  return c[0] + xpos*(c[1] + xpos*(c[2] + xpos*c[3]));
 }
 
 
@@ -197,10 +189,8 @@ double instrument::x2lambda(const double xslit, const double yslit,
 double instrument::lambda2x(const double xslit, const double yslit, 
 			    const double lambda, const string linearmode)
 {
-  vector<double> wcc;
-  calc_wavecal_coeffs(xslit, yslit, wcc, linearmode);
-
-  cout.precision(12);
+  double c[4];
+  wavecal_coeffs(xslit, yslit, linearmode.compare("linear") == 0, c);
 
   // Invert the wavelength calibration (cubic equation) using Newton's method.
   // The polynomial is in general very well behaved over the range of interest,
@@ -208,15 +198,15 @@ double instrument::lambda2x(const double xslit, const double yslit,
   // The iteration terminates when the last step is less than 0.1 pixel, or if 
   // more than 15 steps were done (usually, it converges after 3-5 steps)
 
-  double x0 = (lambda - wcc[0]) / wcc[1]; // use linear solution as starting value
-  // cout << lambda << " " <<  wcc[0] << " " << wcc[1] << endl;
+  double x0 = (lambda - c[0]) / c[1]; // use linear solution as starting value
+  // cout << lambda << " " <<  c[0] << " " << c[1] << endl;
   double eps = 1000;
   double convergence = 0.1;
   int iter = 0;
   double x1;
   while (eps > convergence && iter <= 15) {
-    double f0  = wcc[0] + wcc[1]*x0 + wcc[2]*pow(x0,2) + wcc[3]*pow(x0,3) - lambda;
-    double df0 = wcc[1] + 2.*wcc[2]*x0 + 3.*wcc[3]*pow(x0,2);
+    double f0  = c[0] + x0*(c[1] + x0*(c[2] + x0*c[3])) - lambda;
+    double df0 = c[1] + x0*(2.*c[2] + 3.*c[3]*x0);
     x1  =  x0 - f0 / df0;
     // Reset the iterators
     eps = fabs(x1 - x0);
@@ -224,7 +214,7 @@ double instrument::lambda2x(const double xslit, const double yslit,
     iter++;
   }
   if (iter >= 15) {
-    double x_linear = (lambda - wcc[0]) / wcc[1];
+    double x_linear = (lambda - c[0]) / c[1];
     //    cerr << "Inversion of the nonlinear wavelength model did not converge for " << lambda << "Angstrom. Using the linear position instead." << endl;
     return x_linear;
   }
@@ -0,0 +1,340 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+// The SIMD kernels need SSE2 without a run time test: x86-64 only.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FOV_SIMD
+#endif
+
+#include "fovslabs.h"
+
+using namespace std;
+
+// *************************************************
+// Builds the slabs of the polygon with vertices (u[i], v[i]), in order
+// *************************************************
+FovSlabs::FovSlabs(const vector<float> &u, const vector<float> &v)
+{
+  vector< pair<float, int> > edges;
+  float mid, vmid;
+  int n = u.size();
+  int i, j, k, e;
+
+  vertU = u;
+  vertV = v;
+  bounds = u;
+  sort(bounds.begin(), bounds.end());
+  bounds.erase(unique(bounds.begin(), bounds.end()), bounds.end());
+
+  first.push_back(0);
+  for (k = 0; k + 1 < int(bounds.size()); k++) {
+    // The edges spanning the slab, ordered by their v in its middle.
+    // Edges along v span no slab.
+    mid = (bounds[k] + bounds[k+1]) / 2.;
+    edges.clear();
+    for (i = 0, j = n - 1; i < n; j = i++) {
+      if (min(u[i], u[j]) > bounds[k] || max(u[i], u[j]) < bounds[k+1]) continue;
+      vmid = v[j] + (v[i] - v[j]) * (mid - u[j]) / (u[i] - u[j]);
+      edges.push_back(pair<float, int>(vmid, j));
+    }
+    sort(edges.begin(), edges.end());
+
+    for (e = 0; e < int(edges.size()); e++) {
+      j = edges[e].second;
+      i = (j + 1) % n;
+      u0.push_back(u[j]);
+      v0.push_back(v[j]);
+      slope.push_back((v[i] - v[j]) / (u[i] - u[j]));
+    }
+    first.push_back(u0.size());
+  }
+
+  for (i = 0, j = n - 1; i < n; j = i++) {
+    if (u[i] == u[j]) continue;
+    edgeMin.push_back(min(u[i], u[j]));
+    edgeMax.push_back(max(u[i], u[j]));
+    edgeU0.push_back(u[j]);
+    edgeV0.push_back(v[j]);
+    edgeSlope.push_back((v[i] - v[j]) / (u[i] - u[j]));
+  }
+}
+
+// *************************************************
+// The slab holding u, or -1 if u is outside the polygon
+// *************************************************
+int FovSlabs::slab(float u) const
+{
+  if (bounds.size() < 2 || u < bounds.front() || u >= bounds.back()) return -1;
+
+  return upper_bound(bounds.begin(), bounds.end(), u) - bounds.begin() - 1;
+}
+
+// *************************************************
+// True if (u, v) is inside the polygon. Counts the edges above the point
+// (the even-odd rule of pnpoly, along v).
+// *************************************************
+bool FovSlabs::inside(float u, float v) const
+{
+  int k = slab(u);
+  bool in = false;
+  int i;
+
+  if (k < 0) return false;
+
+  for (i = first[k]; i < first[k+1]; i++) {
+    if (v < v0[i] + slope[i] * (u - u0[i])) in = !in;
+  }
+
+  return in;
+}
+
+// *************************************************
+// The lowest and highest v of the polygon at u. False if u is outside.
+// *************************************************
+bool FovSlabs::extent(float u, float *vmin, float *vmax) const
+{
+  int k = slab(u);
+
+  if (k < 0 || first[k] == first[k+1]) return false;
+
+  *vmin = v0[first[k]] + slope[first[k]] * (u - u0[first[k]]);
+  *vmax = v0[first[k+1]-1] + slope[first[k+1]-1] * (u - u0[first[k+1]-1]);
+
+  return true;
+}
+
+// *************************************************
+// The boundary of the polygon closest to v at u, below and above it. 
+// 'below' and 'above' are left alone if there is none.
+// *************************************************
+void FovSlabs::limits(float u, float v, float *below, float *above) const
+{
+  int k = slab(u);
+  float cut;
+  int i;
+
+  if (k < 0) return;
+
+  for (i = first[k]; i < first[k+1]; i++) {
+    cut = v0[i] + slope[i] * (u - u0[i]);
+    if (cut < v) *below = cut;
+    if (cut > v) {
+      *above = cut;
+      break;
+    }
+  }
+}
+
+// *************************************************
+// True if the box umin <= u <= umax, vmin <= v <= vmax lies within the
+// polygon: in each slab it overlaps, the box must fit between an edge
+// below it and the next edge above it (the polygon is inside between
+// edges 0 and 1, 2 and 3, ... of a slab).
+// *************************************************
+bool FovSlabs::contains(float umin, float umax, float vmin, float vmax) const
+{
+  int k, kmax, i;
+  float ua, ub;
+
+  k = slab(umin);
+  kmax = slab(umax);
+  if (k < 0 || kmax < 0) return false;
+
+  for (; k <= kmax; k++) {
+    ua = max(umin, bounds[k]);
+    ub = min(umax, bounds[k+1]);
+    for (i = first[k]; i + 1 < first[k+1]; i += 2) {
+      if (v0[i] + slope[i] * (ua - u0[i]) <= vmin &&
+	  v0[i] + slope[i] * (ub - u0[i]) <= vmin &&
+	  v0[i+1] + slope[i+1] * (ua - u0[i+1]) >= vmax &&
+	  v0[i+1] + slope[i+1] * (ub - u0[i+1]) >= vmax) break;
+    }
+    if (i + 1 >= first[k+1]) return false;
+  }
+
+  return true;
+}
+
+// *************************************************
+// The area of the polygon within the convex polygon (cu[j], cv[j]), 
+// j = 0 ... m-1, in either orientation. The polygon is clipped against 
+// each edge in turn (Sutherland-Hodgman); clipping to a convex window 
+// keeps the area right for a concave polygon.
+// *************************************************
+double FovSlabs::clippedArea(const double *cu, const double *cv, int m) const
+{
+  vector<double> pu(vertU.begin(), vertU.end()), pv(vertV.begin(), vertV.end());
+  vector<double> qu, qv;
+  double orient, si, sk, t, area;
+  int i, j, k, n;
+
+  // The sign of the window's area: its inside is left of its edges if > 0
+  orient = 0.;
+  for (j = 0, k = m - 1; j < m; k = j++) {
+    orient += cu[k] * cv[j] - cu[j] * cv[k];
+  }
+  if (orient == 0.) return 0.;
+
+  for (j = 0; j < m && !pu.empty(); j++) {
+    k = (j + 1) % m;
+    n = pu.size();
+    qu.clear();
+    qv.clear();
+    for (i = 0; i < n; i++) {
+      // > 0 for vertices inside the window edge j -> k
+      si = (cu[k] - cu[j]) * (pv[i] - cv[j]) - (cv[k] - cv[j]) * (pu[i] - cu[j]);
+      sk = (cu[k] - cu[j]) * (pv[(i+1)%n] - cv[j]) - (cv[k] - cv[j]) * (pu[(i+1)%n] - cu[j]);
+      if (orient < 0.) {
+	si = -si;
+	sk = -sk;
+      }
+      if (si >= 0.) {
+	qu.push_back(pu[i]);
+	qv.push_back(pv[i]);
+      }
+      if ((si >= 0.) != (sk >= 0.)) {
+	t = si / (si - sk);
+	qu.push_back(pu[i] + t * (pu[(i+1)%n] - pu[i]));
+	qv.push_back(pv[i] + t * (pv[(i+1)%n] - pv[i]));
+      }
+    }
+    pu.swap(qu);
+    pv.swap(qv);
+  }
+
+  area = 0.;
+  n = pu.size();
+  for (i = 0, k = n - 1; i < n; k = i++) {
+    area += pu[k] * pv[i] - pu[i] * pv[k];
+  }
+
+  return fabs(area) / 2.;
+}
+
+// *************************************************
+// inside() for the n points (u[k], v[k]): in[k] is 1 for the points 
+// inside the polygon, 0 for the others. The points are tested against
+// all edges at once, 8 or 4 at a time where the cpu can. The result is
+// the same as inside() for each point.
+// *************************************************
+void FovSlabs::inside(const float *u, const float *v, int n, unsigned char *in) const
+{
+#ifdef FOV_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    insideAvx2(u, v, n, in);
+  }
+  else {
+    insideSse(u, v, n, in);
+  }
+#else
+  insideScalar(u, v, n, in);
+#endif
+}
+
+// *************************************************
+// The kernel inside() uses on this cpu: avx2, sse2 or scalar
+// *************************************************
+string FovSlabs::kernelName()
+{
+#ifdef FOV_SIMD
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+// *************************************************
+// The batch test without SIMD, also for the points left over by the 
+// SIMD kernels
+// *************************************************
+void FovSlabs::insideScalar(const float *u, const float *v, int n, unsigned char *in) const
+{
+  int k, i, m = edgeMin.size();
+  bool c;
+
+  for (k = 0; k < n; k++) {
+    c = false;
+    for (i = 0; i < m; i++) {
+      if (edgeMin[i] <= u[k] && u[k] < edgeMax[i] && 
+	  v[k] < edgeV0[i] + edgeSlope[i] * (u[k] - edgeU0[i])) c = !c;
+    }
+    in[k] = c;
+  }
+}
+
+#ifdef FOV_SIMD
+// *************************************************
+// The batch test with SSE2, which x86-64 always has, 4 points at a time
+// *************************************************
+void FovSlabs::insideSse(const float *u, const float *v, int n, unsigned char *in) const
+{
+  __m128 pu, pv, cross, c;
+  int k, i, j, bits, m = edgeMin.size();
+
+  for (k = 0; k + 4 <= n; k += 4) {
+    pu = _mm_loadu_ps(u + k);
+    pv = _mm_loadu_ps(v + k);
+    c = _mm_setzero_ps();
+    for (i = 0; i < m; i++) {
+      cross = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(_mm_set1_ps(edgeMin[i]), pu),
+				    _mm_cmplt_ps(pu, _mm_set1_ps(edgeMax[i]))),
+			 _mm_cmplt_ps(pv, _mm_add_ps(_mm_set1_ps(edgeV0[i]), 
+						     _mm_mul_ps(_mm_set1_ps(edgeSlope[i]),
+								_mm_sub_ps(pu, _mm_set1_ps(edgeU0[i]))))));
+      c = _mm_xor_ps(c, cross);
+    }
+    bits = _mm_movemask_ps(c);
+    for (j = 0; j < 4; j++) in[k + j] = (bits >> j) & 1;
+  }
+
+  insideScalar(u + k, v + k, n - k, in + k);
+}
+
+// *************************************************
+// The batch test with AVX2, 8 points at a time. Only called when the cpu
+// supports AVX2 (see inside()).
+// *************************************************
+__attribute__((target("avx2")))
+void FovSlabs::insideAvx2(const float *u, const float *v, int n, unsigned char *in) const
+{
+  __m256 pu, pv, cross, c;
+  int k, i, j, bits, m = edgeMin.size();
+
+  for (k = 0; k + 8 <= n; k += 8) {
+    pu = _mm256_loadu_ps(u + k);
+    pv = _mm256_loadu_ps(v + k);
+    c = _mm256_setzero_ps();
+    for (i = 0; i < m; i++) {
+      cross = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(edgeMin[i]), pu, _CMP_LE_OQ),
+					  _mm256_cmp_ps(pu, _mm256_set1_ps(edgeMax[i]), _CMP_LT_OQ)),
+			    _mm256_cmp_ps(pv, _mm256_add_ps(_mm256_set1_ps(edgeV0[i]), 
+							    _mm256_mul_ps(_mm256_set1_ps(edgeSlope[i]),
+									  _mm256_sub_ps(pu, _mm256_set1_ps(edgeU0[i])))),
+					  _CMP_LT_OQ));
+      c = _mm256_xor_ps(c, cross);
+    }
+    bits = _mm256_movemask_ps(c);
+    for (j = 0; j < 8; j++) in[k + j] = (bits >> j) & 1;
+  }
+
+  // The caller is SSE code: leave no dirty upper halves behind
+  _mm256_zeroupper();
+
+  insideScalar(u + k, v + k, n - k, in + k);
+}
+#else
+void FovSlabs::insideSse(const float *u, const float *v, int n, unsigned char *in) const
+{
+  insideScalar(u, v, n, in);
+}
+
+void FovSlabs::insideAvx2(const float *u, const float *v, int n, unsigned char *in) const
+{
+  insideScalar(u, v, n, in);
+}
+#endif
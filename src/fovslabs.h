@@ -0,0 +1,52 @@
+#ifndef __FOVSLABS_H
+#define __FOVSLABS_H
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+//************************************************************************
+// The field of view polygon, cut into slabs along its first axis (u) at
+// the u of its vertices. The same edges bound the polygon across a slab,
+// in the same order, so the boundary at any u is a binary search for the
+// slab and one interpolation per edge of the slab, without allocation.
+// gmMakeMasks uses u = spectral and v = spatial, gmmps_fov u = x, v = y.
+//************************************************************************
+class FovSlabs {
+
+ public:
+  // The vertices, in order
+  vector<float> vertU, vertV;
+  // Slab k spans bounds[k] <= u < bounds[k+1]
+  vector<float> bounds;
+  // The edges crossing slab k are first[k] ... first[k+1]-1, by
+  // increasing v
+  vector<int> first;
+  // Edge i: v = v0[i] + slope[i] * (u - u0[i])
+  vector<float> u0, v0, slope;
+  // All edges not along v, for the batch test: edge i spans 
+  // edgeMin[i] <= u < edgeMax[i]
+  vector<float> edgeMin, edgeMax, edgeU0, edgeV0, edgeSlope;
+
+  // constructors
+  FovSlabs() {}
+  FovSlabs(const vector<float>&, const vector<float>&);
+
+  int slab(float) const;
+  bool inside(float, float) const;
+  void inside(const float*, const float*, int, unsigned char*) const;
+  bool extent(float, float*, float*) const;
+  void limits(float, float, float*, float*) const;
+  bool contains(float, float, float, float) const;
+  double clippedArea(const double*, const double*, int) const;
+
+  static string kernelName();
+
+ private:
+  void insideScalar(const float*, const float*, int, unsigned char*) const;
+  void insideSse(const float*, const float*, int, unsigned char*) const;
+  void insideAvx2(const float*, const float*, int, unsigned char*) const;
+};
+
+#endif
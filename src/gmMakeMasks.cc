@@ -38,6 +38,10 @@
   process is repeated until all slits in the priority level have been placed
   or excluded from placement, at which point the next priority level is
   processed.
+  Before that, the graph of each priority level is split into its connected
+  sub-graphs. Sub-graphs of up to EXACT_MAX_NODES slits are solved exactly
+  (branch and bound); where that finds more slits than the greedy selection,
+  the slits left out of the exact selection are removed before placing.
 
   POSSIBLE FUTURE OPTIMIZATIONS:
   There are several places where this program can be optimized, both in
@@ -105,16 +109,125 @@
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <utility>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <csignal>
+#include <random>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+// The SIMD kernels need SSE2 without a run time test: x86-64 only.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CONFLICT_SIMD
+#endif
+
+#include "instrument.h"
+#include "fovslabs.h"
 
 using namespace std;
 
-// The minimum distance between two spectra (in arcsec, 4 old unbinned GMOS pixels)
-float MIN_SPEC_DIST = 0.300;
+// Dispersion direction of the spectra, from the 'horizontal' or 'vertical'
+// command line argument
+enum DispDirection { DISP_HORIZONTAL, DISP_VERTICAL };
+
+// The minimum distance between two spectra (in arcsec, 4 old unbinned GMOS pixels).
+// Per thread, as the parameter sets of a sweep differ in it; runParallel()
+// hands it on to its threads.
+thread_local float MIN_SPEC_DIST = 0.300;
 string instType;
+
+// The largest laser padding (in pixels) used by conflicts(), and the safety
+// margin (in pixels) added by the slit index so that float rounding in
+// conflicts() can never reject a pair the index has skipped.
+const float MAX_LASER_PAD = 2.7;
+const float INDEX_MARGIN  = 1.0;
+
+// Conflict graphs up to this many nodes also keep an adjacency bitset
+// (2 MB at the limit) for constant time edge lookups.
+const int BITSET_MAX_NODES = 4096;
+
+// Connected sub-graphs up to this many slits (one bit per slit in a 64 bit
+// word) are solved exactly. The search gives up after EXACT_MAX_BRANCHES
+// branches per sub-graph and keeps the best selection found until then.
+const int EXACT_MAX_NODES = 64;
+const long EXACT_MAX_BRANCHES = 1000000;
+
+// Joint assignment colours the objects with one bit per mask
+const int MAX_JOINT_MASKS = 64;
+
+// Max-Sky mode expands the slits by at most this many pixels
+const int MAX_EXPAND_ROUNDS = 10000;
+
+// Slits are tested for conflicts in blocks of this many (one AVX register)
+const int BLOCK_SLITS = 8;
+
+// Wiggling moves at most this many slits to place one more, and keeps the
+// slits this much (in pixels) further apart than conflicts() requires.
+const int WIGGLE_MAX_NODES = 128;
+const float WIGGLE_MARGIN = 0.01;
+
+// The position angle optimizer prints this many of its best pointings
+const int MAX_POINTINGS_SHOWN = 10;
+// and keeps the slits with this fraction of their area within the field
+// of view, as gmmps_fov does by default
+const float MIN_FOV_FRACTION = 0.9;
+
+// Columns of a line of the input catalogue, and the number of malformed
+// lines reported one by one
+const int CATALOG_COLUMNS = 16;
+const int MAX_BAD_LINES_SHOWN = 10;
+
+// Score of a placed priority 1, 2 and 3 slit, in the progress lines and
+// by default in the optimizer
+const float PRIORITY_WEIGHTS[3] = {4., 2., 1.};
+
+// Number of worker threads (--threads). Tasks started from a worker
+// thread run in that thread.
+int numThreads = 1;
+thread_local bool workerThread = false;
+
+// The start of the run, and its end if --deadline-ms is given. SIGUSR1
+// ends it at once: the masks are finished with the slits placed so far.
+chrono::steady_clock::time_point runStart, runDeadline;
+atomic<bool> stopRequested(false);
+
+// The mask whose greedy passes report progress (--progress), 0 for none
+int progressMask = 0;
+
+// The ODF columns of a slit that are not kept in pixels by the Slit class.
+// The row is formatted only when the mask is written (writeSlits()).
+typedef struct {
+  float ra, dec;
+  float ccdW, ccdL;         // object position (pixels), as read
+  float offsetW, offsetL;   // slit offset from the object (arcsec)
+  float width, length;      // slit size (arcsec)
+  float mag, redshift;
+  char type;
+  float specLeft, specRight, specBottom, specTop;
+} _odfrow_;
+
+// A line of the input catalogue (see loadSlits()). Positions, offsets 
+// and sizes are x and y, whatever the dispersion direction.
+typedef struct {
+  int id;
+  float ra, dec;
+  float x, y;               // object position (pixels)
+  float offsetX, offsetY;   // slit offset from the object (arcsec)
+  float sizeX, sizeY;       // slit size (arcsec)
+  float angle, mag;
+  char priority, type;
+  float redshift;
+  float specBegin, specEnd; // spectrum footprint (pixels)
+} _catrow_;
 /*
  * ---------------- Helper Class Prototypes ----------------
  */
@@ -126,48 +239,361 @@ public:
     slitWidth, specPosL, specPosW, angle, wiggleRoom, maxWiggle, specStart,
     specEnd, redshift, slitFovMin, slitFovMax;
   char priority;
-  string line;
+  _odfrow_ odf;
   bool wiggleUsed, locked_up, locked_down;
 
   Slit();
   Slit(int, char);
   Slit(int, char, float, float);
   Slit(int, char, float, float, float, float, float, float, float, float,
-       float, float, float, float, string, float, float);
-  int changePosition(float, float, float, string);
-  bool stringToFloat(const string&, float&);
-  vector<string> stringSplit(string, string);
+       float, float, float, float, const _odfrow_&, float, float);
+  int changePosition(float, float, float);
 };
 
-class GraphNode {
+class Graph {
 public:
-  int id, degree;
-  vector<int> adjList;
-
-  GraphNode();
-  GraphNode(int);
-  void addAdj(int);
-  void removeAdj(int);
-  vector<int> getList();
-  int getDegree();
+  // Nodes are numbered densely (0..n-1) in order of increasing slit id.
+  // The adjacency is stored contiguously (CSR): the neighbours of node v
+  // are adj[adjStart[v]] ... adj[adjStart[v+1]-1], sorted by slit id.
+  vector<int> ids;
+  vector<int> adjStart;
+  vector<int> adj;
+  // Removed nodes stay in the adjacency, they are only flagged dead.
+  // 'degree' counts the alive neighbours of each node.
+  vector<char> alive;
+  vector<int> degree;
+  int numAlive;
+  // Optional adjacency bitset for small graphs (see BITSET_MAX_NODES)
+  vector<unsigned long long> matrix;
+  int matrixWords;
+
+  Graph();
+  void build(const vector<int>&, const vector< pair<int, int> >&);
+  void clear();
+  int index(int) const;
+  void removeNode(int);
+  const int * neighboursBegin(int) const;
+  const int * neighboursEnd(int) const;
+  bool adjacent(int, int) const;
+  bool empty() const;
+  int size() const;
+  int nodes() const;
 };
 
-class Graph {
+class DegreeQueue {
 public:
-  map<int, GraphNode> elements;
+  // buckets[d] holds the alive nodes of degree d, ordered by their 
+  // distance key and then by node (i.e. slit id)
+  vector< set< pair<int, int> > > buckets;
+  vector<int> key;
+  int minDegree;
+
+  DegreeQueue(const Graph&, const vector<int>&);
+  int top();
+  void removeNode(Graph&, int);
+};
 
-  void addNode(int);
-  void removeNode(int);
-  void clear();
-  void addEdge(GraphNode*, GraphNode*);
-  void removeEdge(GraphNode*, GraphNode*);
-  GraphNode * getNode(int nid);
-  void clearEdges(GraphNode * node);
-  bool empty();
-  int size();
-  vector<int> getMinDegree();
+// Pointers to the columns of a block of slits, see conflictMask()
+typedef struct {
+  const int *id;
+  const char *priority;
+  const float *start, *end, *top, *bottom, *specStart, *specEnd;
+} _columns_;
+
+// A conflictMask() kernel, see conflictKernel()
+typedef unsigned (*_kernel_)(const Slit&, const _columns_&, float, float, float);
+
+class SlitTable {
+public:
+  // One row per slit, sorted by increasing slitStart: the slit ids, the
+  // slits themselves, and the columns the conflict tests read
+  vector<int> keys;
+  vector<const Slit*> rows;
+  vector<char> priority;
+  vector<float> start, end;
+  vector<float> top, bottom;
+  vector<float> specStart, specEnd;
+  // How far (in pixels) two slits can be apart along the slit length
+  // axis and still conflict
+  float reach;
+  float maxLength;
+
+  SlitTable(const map<int, Slit>&, float);
+  void query(float, float, vector<int>&) const;
+  _columns_ columns(int) const;
+  int size() const;
+  long pairs() const;
+};
+
+class SlitBlock {
+public:
+  // Up to BLOCK_SLITS slits gathered for conflictMask(), in columns
+  int id[BLOCK_SLITS];
+  char priority[BLOCK_SLITS];
+  float start[BLOCK_SLITS], end[BLOCK_SLITS], top[BLOCK_SLITS], bottom[BLOCK_SLITS];
+  float specStart[BLOCK_SLITS], specEnd[BLOCK_SLITS];
+  int size;
+
+  SlitBlock();
+  void add(const Slit&);
+  void add(const _columns_&, int);
+  bool full() const;
+  _columns_ columns() const;
+};
+
+class UnionFind {
+public:
+  vector<int> parent;
+  vector<int> rank;
+
+  UnionFind(int);
+  int find(int);
+  void unite(int, int);
+};
+
+class IndependentSet {
+public:
+  // A sub-graph of at most EXACT_MAX_NODES nodes; bit j of adj[i] is set
+  // if nodes i and j conflict. Nodes are in order of increasing slit id.
+  int n;
+  unsigned long long adj[EXACT_MAX_NODES];
+  vector<int> key;
+  // The largest independent set found so far
+  unsigned long long best;
+  int bestSize;
+  long branches;
+
+  IndependentSet(const Graph&, const vector<int>&, const vector<int>&);
+  unsigned long long greedy() const;
+  unsigned long long exact();
+  void expand(unsigned long long, int, unsigned long long);
+  int coverBound(unsigned long long) const;
+};
+
+class LocalSearch {
+public:
+  const Graph *graph;
+  vector<int> priority;   // 0 (acquisition) to 3, per node
+  vector<char> in;        // placed nodes
+  vector<int> tight;      // number of placed neighbours
+  int counts[4];          // placed nodes per priority
+  // Nodes to look at, and nodes changed since the last accept()
+  vector<int> pending;
+  vector<char> isPending;
+  vector<int> changes;
+  long steps;
+  int swaps;
+  chrono::steady_clock::time_point deadline;
+
+  LocalSearch(const Graph*, const vector<int>&, const vector<char>&);
+  int weight(int) const;
+  void flip(int);
+  void push(int);
+  void pushAll();
+  bool improve();
+  bool swap(int);
+  bool perturb(int);
+  void undo();
+  void accept();
+  int compare(const int*) const;
+  bool expired() const;
 };
 
+typedef struct {
+  // Number of conflicts() evaluations avoided by updating conflict graphs
+  // incrementally after wiggling, instead of rebuilding them
+  long updateTestsSaved;
+  bool updated;
+  // Number of sub-graphs solved exactly, and the number of slits this
+  // placed in addition to the greedy selection
+  int exactComponents;
+  int exactGain;
+  // Moves made by the local search, and the slits it placed in addition
+  int searchSwaps;
+  int searchGain;
+  // Slits placed by wiggleUnplaced()
+  int wiggleGain;
+  // Greedy passes run over the mask (see selectMask())
+  int passes;
+  // Placement or wiggling cut short by the deadline (see pastDeadline())
+  bool stopped;
+} _stats_;
+
+// Two slits that must stay apart along the slit length axis while 
+// wiggling: 'upper' must start at least 'sep' pixels after 'lower' ends.
+// Pairs that are not 'bound' are only re-tested with conflicts().
+typedef struct {
+  int lower, upper;
+  float sep;
+  bool bound;
+} _spacing_;
+
+// Each thread keeps its own statistics, restarts run concurrently
+thread_local _stats_ stats;
+
+// Number of conflicts() evaluations by this thread. runParallel() adds
+// those of its worker threads to the caller's.
+thread_local long conflictTests = 0;
+
+// Options given as '--name value' pairs after the positional arguments
+typedef struct {
+  int restarts;        // number of greedy passes per mask (--restarts)
+  unsigned long seed;  // seed of the first randomized pass (--seed)
+  long timeBudget;     // milliseconds of local search per pass, 0 for none
+                       // (--time-budget-ms)
+  bool jointMasks;     // assign objects to all masks at once (--assign joint)
+  int benchmark;       // time conflict tests over this many sweeps and exit,
+                       // 0 for none (--benchmark)
+  string sweep;        // parameter grid, empty for none (--sweep)
+  string sweepWrite;   // sets of the sweep to write: none, best, all or 
+                       // a list of numbers (--sweep-write)
+  string optimize;     // position angle and pointing grid, empty for none
+                       // (--optimize)
+  string optimizeCat;  // catalogue of the optimizer with all objects,
+                       // empty for the input one (--optimize-catalog)
+  string cwl;          // central wavelengths and grating, empty for none
+                       // (--cwl)
+  long deadline;       // milliseconds for the whole run, 0 for none
+                       // (--deadline-ms)
+  bool progress;       // print progress lines (--progress)
+  int parseBenchmark;  // time the catalogue parser on a synthetic 
+                       // catalogue of this many lines and exit, 0 for none
+                       // (--parse-benchmark)
+} _options_;
+
+_options_ options;
+
+// The outcome of one greedy pass over a mask
+typedef struct {
+  map<int, Slit> slits;    // objects still available
+  map<int, Slit> acqSlits; // acquisition objects still available
+  map<int, Slit> placed;
+  map<int, Slit> removed;
+  int numberPlaced[4];     // per priority (acquisition, 1, 2, 3)
+  _stats_ stats;
+} _selection_;
+
+// Work shared between the threads running greedy passes over a mask
+typedef struct {
+  const _selection_ *input;
+  const Graph *allSlitsG;
+  float microshufflePix;
+  DispDirection dispDirection;
+  float pixelScale;
+  bool wiggle;
+  vector<_selection_> results;
+  // Passes done and the most slits placed so far (see runRestart())
+  mutex lock;
+  int done;
+  int best[4];
+} _restarts_;
+
+// Work shared between the threads solving the bands of a band shuffle mask
+typedef struct {
+  vector<_selection_> results;  // per group of bands
+  vector<Graph> graphs;         // the conflict graph of each group
+  vector<unsigned long> seeds;  // of the randomized passes
+  bool randomized;
+  float microshufflePix;
+  DispDirection dispDirection;
+  float pixelScale;
+  bool wiggle;
+  long timeBudget;              // local search time of each band (ms)
+} _bands_;
+
+// One parameter set of a sweep (--sweep), and the masks designed with it
+typedef struct {
+  float minpixsep;
+  float wiggleVal;
+  char slitMode;
+  bool pack;
+  int numMasks;
+  int slitsSet;                  // index of its slits in the _sweep_
+  int graphSet;                  // index of its conflict graph
+  bool write;                    // write its ODF files
+  int numberPlaced[4];           // per priority, over all masks
+  vector< map<int, Slit> > masks;
+} _sweepset_;
+
+// Work shared between the threads of a sweep
+typedef struct {
+  vector<_sweepset_> sets;
+  vector< map<int, Slit> > slits;  // per wiggle and packing
+  vector<float> microshufflePix;
+  vector<Graph> graphs;            // per slits and minimum separation
+  vector<int> graphSlits;          // the first set using each graph
+  char *inFile, *outFileRoot;
+  string bandConfig;
+  float pixelScale;
+  DispDirection dispDirection;
+  char *det_img, *det_spec, *ra_imag, *dec_imag;
+  vector<string> written;          // the ODF files written
+} _sweep_;
+
+// One pointing of the optimizer (--optimize): the field turned by 'pa' 
+// and shifted by 'dx', 'dy', and the masks designed at it
+typedef struct {
+  float pa;              // position angle change (degrees)
+  float dx, dy;          // shift of the objects on the detector (arcsec)
+  int numSlits;          // objects left inside the field of view
+  int numberPlaced[4];   // per priority, over all masks
+  int minAcq;            // fewest acquisition objects on one mask
+  float score;           // weighted priority 1, 2 and 3 slits
+} _pointing_;
+
+// Work shared between the threads of the optimizer
+typedef struct {
+  vector<_pointing_> pointings;
+  int first;                       // the first pointing of this round
+  const map<int, Slit> *slits;     // at the nominal pointing, also outside
+                                   // the field of view (--optimize-catalog)
+  float microshufflePix;
+  float pixelScale;
+  DispDirection dispDirection;
+  float crpix1, crpix2;
+  bool pack;
+  bool wiggle;
+  int numMasks;
+  float weights[3];                // of priority 1, 2 and 3, see parseOptimize()
+} _optimize_;
+
+// One central wavelength of the CWL scan (--cwl), and the masks designed
+// at it
+typedef struct {
+  float cwl;             // nm
+  int numberPlaced[4];   // per priority, over all masks
+  int minAcq;            // fewest acquisition objects on one mask
+  int inGap;             // placed spectra crossing a detector gap
+  float gapLoss;         // fraction of the placed spectra in the gaps
+  vector<int> perMask;   // slits placed on each mask
+} _cwlrun_;
+
+// Work shared between the threads of the CWL scan
+typedef struct {
+  vector<_cwlrun_> runs;
+  const map<int, Slit> *slits;     // with the footprints of the input file
+  instrument *model;               // the gemwm wavelength model of the grating
+  float lambdaMin, lambdaMax;      // spectral range (nm)
+  float nativeScale;               // pixel scale of the model (arcsec)
+  float microshufflePix;
+  float pixelScale;
+  DispDirection dispDirection;
+  bool pack;
+  bool wiggle;
+  int numMasks;
+} _cwlscan_;
+
+// Work shared between the threads writing the masks of a joint assignment
+typedef struct {
+  vector< map<int, Slit> > *masks;
+  char *outFileRoot;
+  char slitMode;
+  float microshufflePix;
+  DispDirection dispDirection;
+  float pixelScale;
+  char *det_img, *det_spec, *ra_imag, *dec_imag;
+} _masks_;
+
 typedef struct {
   // Vectors contain the vertices defining the illuminated field of view
   // and the overall detector dimensions.
@@ -178,6 +604,9 @@ typedef struct {
   // Same as above, but in terms of spatial and spectral dimension
   vector<float> vert_spatial;
   vector<float> vert_spectral;
+  // The polygon cut into slabs along the dispersion direction, for its
+  // spatial boundaries at any spectral position (u = spectral, v = spatial)
+  FovSlabs slabs;
   // The overall extent of the detector array in x and y, disregarding any vignetting
   vector<float> dimx, dimy;
   // The overall extent of the detector array in x and y (same as dimx and dimy),
@@ -188,6 +617,8 @@ typedef struct {
   // The minima and maxima of the illuminated area
   float illumarea_spectral_min, illumarea_spectral_max;
   float illumarea_spatial_min, illumarea_spatial_max;
+  // The detector gaps along the dispersion direction
+  vector<float> gapStart, gapEnd;
 } _fov_;
 
 // A global (yes, I know...) containing the fov
@@ -216,29 +647,108 @@ typedef struct {
 
 _banddef_ banddef;
 
+// What the service mode (--serve) keeps between requests: the field of 
+// view (in 'fov') and the slits and conflict graph of the last catalogue,
+// each with the inputs it was made from.
+typedef struct {
+  string fovKey;
+  string slitsKey;
+  map<int, Slit> slits;
+  _banddef_ banddef;
+  float microshufflePix;
+  Graph allSlitsG;
+  vector<string> outFiles;  // the ODF files written for the last request
+} _session_;
+
 /**
  * ------------------- Slit Selection Function Prototypes -----------------------
  **/
 
-void initOutputFile(char*, ofstream&, string, float, char*, char*, char*, char*);
-float loadSlits(map<int, Slit>*, char*, string, float, string, float, bool);
-map<int, Slit> getSlits(map<int, Slit>, char);
-void mapConflicts(Graph*, map<int, Slit>, float, string, float);
-void placeSlits(map<int, Slit>*, map<int, Slit>*, map<int, Slit>*,
-		map<int, Slit>*, Graph*, float, string, float);
-void removeConflicts(map<int, Slit>*, map<int, Slit>*, map<int, Slit>*, Graph);
-void loadFov(char*, float, float, float, string);
+int serve();
+int makeMasks(int, char*[], _session_*);
+vector<string> splitRequest(const string&);
+bool readFile(const char*, string*);
+
+void initOutputFile(char*, ofstream&, DispDirection, float, char*, char*, char*, char*);
+void maskFileName(char*, size_t, const char*, int, int);
+float loadSlits(map<int, Slit>*, const char*, string, float, DispDirection, float, bool, bool);
+int parseCatalog(const char*, size_t, const char*, vector<_catrow_>*);
+bool parseCatalogLine(const char*, const char*, _catrow_*, string*);
+bool parseNumber(const char*, const char*, int&);
+bool parseNumber(const char*, const char*, float&);
+const char * mapFile(const char*, size_t*);
+void parseCatalogStreams(const string&, vector<_catrow_>*);
+void benchmarkParse(int);
+map<int, Slit> getSlits(const map<int, Slit>&, char);
+void mapConflicts(Graph*, const map<int, Slit>&, float, DispDirection, float);
+bool placeSlits(map<int, Slit>*, map<int, Slit>*, map<int, Slit>*,
+		map<int, Slit>*, Graph*, float, DispDirection, float, mt19937*);
+void selectSlits(_selection_*, const Graph&, float, DispDirection, float, bool, long, mt19937*);
+int selectMask(_selection_*, const Graph&, float, DispDirection, float, bool);
+int sweepMasks(_sweep_*, const _sweepset_&);
+bool parseSweep(const string&, const _sweepset_&, vector<_sweepset_>*);
+void mapSweepGraph(int, void*);
+void runSweep(int, void*);
+int optimizeMasks(_optimize_*);
+bool parseOptimize(const string&, vector<float>*, vector<float>*, vector<float>*, int*, float*);
+bool parseAxis(const string&, vector<float>*);
+void runPointing(int, void*);
+void moveField(map<int, Slit>*, const map<int, Slit>&, const _optimize_&, const _pointing_&);
+float fovFraction(const Slit&, DispDirection);
+bool betterPointing(const _pointing_&, const _pointing_&);
+int cwlMasks(_cwlscan_*);
+bool parseCwl(const string&, vector<float>*, string*, float*, float*);
+bool loadWavelengthModel(instrument*);
+void runCwl(int, void*);
+void setFootprints(map<int, Slit>*, instrument&, const _cwlscan_&);
+void runRestart(int, void*);
+void selectBands(_selection_*, const Graph&, float, DispDirection, float, bool, mt19937*);
+void selectBand(int, void*);
+int slitBand(const Slit&);
+void subGraph(Graph*, const Graph&, const vector<int>&);
+void subGraph(Graph*, const Graph&, const map<int, Slit>&);
+void improveSelection(_selection_*, float, DispDirection, float, long, mt19937*);
+void assignMasks(vector< map<int, Slit> >*, int, map<int, Slit>*, map<int, Slit>*,
+		 const Graph&, float, DispDirection, float);
+void refineMasks(vector< map<int, Slit> >*, const map<int, Slit>&, float, DispDirection, 
+		 float, bool);
+void writeMask(int, void*);
+bool betterSelection(const _selection_&, const _selection_&);
+int parseOptions(int, char*[]);
+void removeConflicts(map<int, Slit>*, map<int, Slit>*, map<int, Slit>*, const Graph&);
+void loadFov(char*, float, float, float, DispDirection);
 bool bandShuffleCheck(float, float, float);
 void removeSlit(int, map<int, Slit>*, map<int, Slit>*);
-void writeSlits(map<int, Slit>&, ofstream&);
-void maxSlitMode(map<int, Slit>&, float, string);
-void maxOptProcessLine(map<int, Slit>&, int, string, float);
+void writeSlits(map<int, Slit>&, ofstream&, DispDirection);
+void maxSlitMode(map<int, Slit>&, float);
+void maxOptResize(Slit&, float);
+int safeRounds(double, int);
 void expandSlitToFOV(Slit&);
-bool conflicts(Slit, Slit, float, string, float);
-int findMaxSpectrumSid(vector<int>*, map<int, Slit>*, float);
-bool wiggleNear(int, map<int, Slit>*, map<int, Slit>*, float, string);
-int wiggleUnplaced(map<int, Slit>*, map<int, Slit>*, map<int, Slit>*, float, string, float);
-bool checkConflicts(Slit, Slit, map<int, Slit>, float, string, float);
+void limitSlitToBand(Slit&);
+bool conflicts(const Slit&, const Slit&, float, DispDirection, float);
+bool conflictTest(float, float, float, float, float, float, float, float, 
+		  float, float, float, float, float, float, float);
+unsigned conflictMask(const Slit&, const _columns_&, int, float, DispDirection, float);
+unsigned conflictMaskScalar(const Slit&, const _columns_&, float, float, float);
+_kernel_ conflictKernel(string* = 0);
+#ifdef CONFLICT_SIMD
+unsigned conflictMaskSse(const Slit&, const _columns_&, float, float, float);
+unsigned conflictMaskAvx2(const Slit&, const _columns_&, float, float, float);
+#endif
+void benchmarkConflicts(const map<int, Slit>&, float, DispDirection, float, int);
+float conflictReach(float, float);
+int spectrumDistance(const Slit&, float);
+bool wiggleNear(int, map<int, Slit>*, map<int, Slit>*, float, vector<int>*);
+void updateConflicts(Graph*, DegreeQueue*, const SlitTable&, long, const vector<int>&,
+		     map<int, Slit>*, map<int, Slit>*, map<int, Slit>*, float, DispDirection, float);
+int wiggleUnplaced(map<int, Slit>*, map<int, Slit>*, map<int, Slit>*, float, DispDirection, float);
+void solveComponents(const Graph&, const vector<int>&, vector<int>*);
+void solveComponent(int, void*);
+void runParallel(int, void (*)(int, void*), void*);
+bool pastDeadline();
+void requestStop(int);
+void printProgress(const char*, const string&, const int*);
+bool checkConflicts(const Slit&, const Slit&, const map<int, Slit>&, float, DispDirection, float);
 void printIntro(char);
 void printIntroError(int);
 vector<string> stringSplit(string, string);
@@ -246,10 +756,9 @@ bool stringToInt(const string&, int&);
 bool stringToFloat(const string&, float&);
 void stringclean(string&);
 float get_keyvalue(string);
-vector<float> calc_intercept(float);
 float min(vector<float> const &);
 float max(vector<float> const &);
-void printSlit(map<int, Slit>, int, int, float);
+void printSlit(const map<int, Slit>&, int, int, float);
 string RemoveChars(string, string);
 vector<string> getword(string, char);
 void trim(string &, const string&);
@@ -268,17 +777,160 @@ bool checkTilt(map<int, Slit> &);
 *
 * DESCRIPTION: Main entry point to function.
 *
-* [NOTES:]:
+* [NOTES:]: 'gmMakeMasks --serve' runs the service mode, see serve().
 *-
 ************************************************************************
 */
 int main(int argc, char *argv[]) {
+  signal(SIGUSR1, requestStop);
+
+  if (argc == 2 && strcmp(argv[1], "--serve") == 0) {
+    return serve();
+  }
+
+  return makeMasks(argc, argv, 0);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: serve
+*
+* RETURNS: int [success or failure]
+*
+* DESCRIPTION: Service mode: designs masks on request, one request per
+*              line on stdin, until 'quit' or the end of input. A request
+*              holds the arguments of a normal call, separated by blanks;
+*              arguments with blanks, or empty ones, go in double quotes.
+*              A backslash takes the next character as it is (\" or \\).
+*              The reply on stdout is the usual output, then for each ODF
+*              written a line '@ODF <file> <n>' and its n lines, and last 
+*              '@DONE <status>'.
+*
+* [NOTES:]: The field of view, the slits and the conflict graph are kept
+*           for the next request, and re-used while their inputs (files
+*           and arguments) are the same. Errors that end a normal call 
+*           (missing files) also end the service.
+*-
+************************************************************************
+*/
+int serve() {
+  _session_ session;
+  vector<string> words, rows;
+  vector<string>::iterator file;
+  vector<char*> args;
+  ifstream odf;
+  string line;
+  char program[] = "gmMakeMasks";
+  size_t i;
+  int status;
+
+  while (getline(cin, line)) {
+    words = splitRequest(line);
+    if (words.empty()) continue;
+    if (words.size() == 1 && words[0] == "quit") break;
+
+    args.assign(1, program);
+    for (i = 0; i < words.size(); i++) {
+      args.push_back(&words[i][0]);
+    }
+    args.push_back(0);
+
+    session.outFiles.clear();
+    status = makeMasks(args.size() - 1, args.data(), &session);
+
+    for (file = session.outFiles.begin(); file != session.outFiles.end(); file++) {
+      rows.clear();
+      odf.open((*file).c_str());
+      while (getline(odf, line)) rows.push_back(line);
+      odf.close();
+      odf.clear();
+
+      printf("@ODF %s %d\n", (*file).c_str(), int(rows.size()));
+      for (i = 0; i < rows.size(); i++) {
+	printf("%s\n", rows[i].c_str());
+      }
+    }
+    printf("@DONE %d\n", status);
+    fflush(stdout);
+  }
+
+  return 0;
+}
+
+//****************************************************************************
+// Splits a request of the service mode into words. Double quotes group
+// words with blanks, "" is an empty word, and a backslash escapes the
+// next character.
+//****************************************************************************
+vector<string> splitRequest(const string &line) {
+  vector<string> words;
+  string word;
+  size_t i;
+  bool quoted = false, started = false;
+
+  for (i = 0; i < line.size(); i++) {
+    if (line[i] == '\\' && i + 1 < line.size()) {
+      word += line[++i];
+      started = true;
+    }
+    else if (line[i] == '"') {
+      quoted = !quoted;
+      started = true;
+    }
+    else if (!quoted && isspace((unsigned char) line[i])) {
+      if (started) words.push_back(word);
+      word.clear();
+      started = false;
+    }
+    else {
+      word += line[i];
+      started = true;
+    }
+  }
+  if (started) words.push_back(word);
+
+  return words;
+}
+
+//****************************************************************************
+// Reads a whole file into 'text'. Returns false if it cannot be read.
+//****************************************************************************
+bool readFile(const char *fileName, string *text) {
+  ifstream file(fileName, ios::in | ios::binary);
+  ostringstream buffer;
+
+  if (!file.is_open()) return false;
+  buffer << file.rdbuf();
+  *text = buffer.str();
+
+  return true;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: makeMasks
+*
+* RETURNS: int [success or failure]
+*
+* DESCRIPTION: Designs the masks of one call (the command line of 
+*              gmMakeMasks, or a request of the service mode) and writes
+*              their ODF files.
+*
+* [NOTES:]: With a 'session' (service mode), the field of view, the slits
+*           and the conflict graph of the previous request are re-used
+*           when their inputs are unchanged.
+*-
+************************************************************************
+*/
+int makeMasks(int argc, char *argv[], _session_ *session) {
   // Input variables (set from argv).
   char inFile[256];      // Input file
   char outFile[256];     // Output file
   char outFileRoot[256]; // Output root path
   char fovFile[256];     // Field-of-View file
-  string dispDirection;  // Dispersion direction of the spectra
+  DispDirection dispDirection;  // Dispersion direction of the spectra
   char slitMode;         // Determines whether to expand slits into empty space or not.
   float pixelScale;      // pixel scale    (arcseconds/pixel)
   float crpix1, crpix2;  // The fiducial center point
@@ -292,28 +944,33 @@ int main(int argc, char *argv[]) {
   float wiggleVal;
   string bandConfig = "";
 
+  // Inputs of the field of view and of the slits (service mode)
+  string fovKey, slitsKey, text;
+
   // Slit containers.
   map<int, Slit> slits;    // holds all slits
   map<int, Slit> acqSlits; // holds acquisition objects
-  map<int, Slit> p1Slits;  // holds p1 objects
-  map<int, Slit> p2Slits;  // holds p2 objects
-  map<int, Slit> p3Slits;  // holds p3 objects
   map<int, Slit> placed;   // holds objects which to be placed in the ODF
   map<int, Slit> removed;  // holds objects not in ODF
+
+  // The index of the best greedy pass over the current mask
+  int best, r;
+
+  // Masks of a joint assignment
+  _masks_ masksOut;
   
   // Holds band boundaries in nod and shuffle mode (band shuffle).
   banddef.shuffleMagnitude = 0;
   banddef.shuffleUnbPx = 0;
   banddef.shuffleMode = "None";
 
-  // Conflict graphs.
+  // Conflict graph.
   // Nodes represent slits, and edge between two nodes indicates 
   // conflicting spectra between the two represented slits. 
   Graph allSlitsG;
-  Graph acqSlitsG;
-  Graph p1SlitsG;
-  Graph p2SlitsG;
-  Graph p3SlitsG;
+
+  // Number of conflict tests made for the current mask
+  long conflictTestsMask;
 
   // Number of slits placed for each priority.
   int numberPlacedAcq;
@@ -321,11 +978,48 @@ int main(int argc, char *argv[]) {
   int numberPlacedPrio2;
   int numberPlacedPrio3;
 
+  // Fields of a progress line (--progress)
+  char fields[64];
+
   ofstream outStream;
 
   // Holds the microShuffle distance in pixels if in microshuffle mode.
   float microshufflePix = 0;
 
+  // Use all cores for the parallel parts
+  numThreads = thread::hardware_concurrency();
+  if (numThreads < 1) numThreads = 1;
+
+  // Remove the options from argv, leaving the positional arguments.
+  options.restarts = 1;
+  options.seed = 1;
+  options.timeBudget = 0;
+  options.jointMasks = false;
+  options.benchmark = 0;
+  options.sweep = "";
+  options.sweepWrite = "none";
+  options.optimize = "";
+  options.optimizeCat = "";
+  options.cwl = "";
+  options.deadline = 0;
+  options.progress = false;
+  options.parseBenchmark = 0;
+  argc = parseOptions(argc, argv);
+  if (argc < 0) {
+    return (-1);
+  }
+
+  // Only time the catalogue parser.
+  if (options.parseBenchmark > 0) {
+    benchmarkParse(options.parseBenchmark);
+    return 0;
+  }
+
+  // The wall-clock budget starts here.
+  runStart = chrono::steady_clock::now();
+  runDeadline = runStart + chrono::milliseconds(options.deadline);
+  stopRequested = false;
+
   // Load values from argv.
   if (argc >= 18) {
     strcpy(inFile, argv[1]);
@@ -343,7 +1037,7 @@ int main(int argc, char *argv[]) {
     slitMode = argv[7][0];
 
     // dispersion direction ('horizontal' or 'vertical')
-    dispDirection = argv[8];
+    dispDirection = strcmp(argv[8], "vertical") == 0 ? DISP_VERTICAL : DISP_HORIZONTAL;
 
     strcpy(det_img, argv[9]);
     strcpy(det_spec, argv[10]);
@@ -385,36 +1079,220 @@ int main(int argc, char *argv[]) {
   // 4 pixels minimum
   MIN_SPEC_DIST = minpixsep * pixelScale;
 
+  // The inputs of the field of view, and of the slits and their conflicts.
+  // Empty if a file cannot be read: they never match.
+  if (session != 0 && readFile(fovFile, &text)) {
+    fovKey = text + '\n' + argv[5] + ' ' + argv[8] + ' ' + argv[13] + ' ' + argv[14];
+  }
+  if (session != 0 && !fovKey.empty() && readFile(inFile, &text)) {
+    slitsKey = text + '\n' + fovKey + '\n' + instType + ' ' + argv[15] + ' ' + 
+      argv[16] + ' ' + argv[17] + ' ' + bandConfig;
+  }
+
   // Load field of view information, put it into the global 'fov' variable
-  loadFov(fovFile, pixelScale, crpix1, crpix2, dispDirection);
+  if (session == 0 || fovKey.empty() || fovKey != session->fovKey) {
+    loadFov(fovFile, pixelScale, crpix1, crpix2, dispDirection);
+    if (session != 0) session->fovKey = fovKey;
+  }
+
+  // Parameter sweep instead of one design
+  if (!options.sweep.empty()) {
+    _sweep_ sweep;
+    _sweepset_ defaults;
+
+    defaults.minpixsep = minpixsep;
+    defaults.wiggleVal = wiggleVal;
+    defaults.slitMode = slitMode;
+    defaults.pack = pack_spectra;
+    defaults.numMasks = numMasks;
+    defaults.slitsSet = defaults.graphSet = 0;
+    defaults.write = false;
+
+    sweep.inFile = inFile;
+    sweep.outFileRoot = outFileRoot;
+    sweep.bandConfig = bandConfig;
+    sweep.pixelScale = pixelScale;
+    sweep.dispDirection = dispDirection;
+    sweep.det_img = det_img;
+    sweep.det_spec = det_spec;
+    sweep.ra_imag = ra_imag;
+    sweep.dec_imag = dec_imag;
+    r = sweepMasks(&sweep, defaults);
+    if (session != 0) session->outFiles = sweep.written;
+    return r;
+  }
+
+  conflictTestsMask = conflictTests;
+  if (session != 0 && !slitsKey.empty() && slitsKey == session->slitsKey) {
+    // Same catalogue and parameters as the previous request
+    slits = session->slits;
+    banddef = session->banddef;
+    microshufflePix = session->microshufflePix;
+    allSlitsG = session->allSlitsG;
+  }
+  else {
+    // Load in slit data from temporary data file generated in gmmps_spoc.tcl
+    microshufflePix = loadSlits(&slits, inFile, bandConfig, pixelScale, 
+				dispDirection, wiggleVal, pack_spectra, true);
+
+    // Generate the conflict map of all objects, once. Slits only move when 
+    // placed, and placed slits are not used again. The acquisition objects
+    // are re-used, but never moved (see wiggleNear()), so it holds for 
+    // every mask. The graphs of each mask and priority are restricted 
+    // copies of it.
+    mapConflicts(&allSlitsG, slits, microshufflePix, dispDirection, pixelScale);
+
+    if (session != 0) {
+      session->slitsKey = slitsKey;
+      session->slits = slits;
+      session->banddef = banddef;
+      session->microshufflePix = microshufflePix;
+      session->allSlitsG = allSlitsG;
+    }
+  }
+
+  if (options.progress) {
+    long edges = 0;
+    for (int v = 0; v < allSlitsG.nodes(); v++) {
+      edges += allSlitsG.neighboursEnd(v) - allSlitsG.neighboursBegin(v);
+    }
+    sprintf(fields, "slits=%d conflicts=%ld", int(slits.size()), edges / 2);
+    printProgress("conflicts", fields, 0);
+  }
+
+  // Search for the best position angle and pointing instead of one design
+  if (!options.optimize.empty()) {
+    _optimize_ optimize;
+    map<int, Slit> field;
+
+    // The input catalogue only has the objects gmmps_fov kept at the 
+    // nominal pointing. --optimize-catalog also has those that other
+    // pointings bring into the field of view or the bands (moveField()).
+    optimize.slits = &slits;
+    if (!options.optimizeCat.empty()) {
+      loadSlits(&field, options.optimizeCat.c_str(), bandConfig, pixelScale, 
+		dispDirection, wiggleVal, pack_spectra, false);
+      optimize.slits = &field;
+    }
+    optimize.microshufflePix = microshufflePix;
+    optimize.pixelScale = pixelScale;
+    optimize.dispDirection = dispDirection;
+    optimize.crpix1 = crpix1;
+    optimize.crpix2 = crpix2;
+    optimize.pack = pack_spectra;
+    optimize.wiggle = wiggleVal > 0.;
+    optimize.numMasks = numMasks;
+    return optimizeMasks(&optimize);
+  }
 
-  // Load in slit data from temporary data file generated in gmmps_spoc.tcl
-  microshufflePix = loadSlits(&slits, inFile, bandConfig, pixelScale, 
-			      dispDirection, wiggleVal, pack_spectra);
+  // Scan the central wavelength instead of one design
+  if (!options.cwl.empty()) {
+    _cwlscan_ scan;
+
+    scan.slits = &slits;
+    scan.microshufflePix = microshufflePix;
+    scan.pixelScale = pixelScale;
+    scan.dispDirection = dispDirection;
+    scan.pack = pack_spectra;
+    scan.wiggle = wiggleVal > 0.;
+    scan.numMasks = numMasks;
+    return cwlMasks(&scan);
+  }
 
   // Search slit container for acquisition slits.
   acqSlits = getSlits(slits, '0');
 
+  // Only time the conflict tests.
+  if (options.benchmark > 0) {
+    benchmarkConflicts(slits, microshufflePix, dispDirection, pixelScale, options.benchmark);
+    return 0;
+  }
+
+  // Assign the objects to all masks at once.
+  if (options.jointMasks && numMasks > MAX_JOINT_MASKS) {
+    printf("WARNING: Joint assignment supports up to %d masks, assigning sequentially.\n",
+	   MAX_JOINT_MASKS);
+    options.jointMasks = false;
+  }
+  if (options.jointMasks && numMasks > 1) {
+    vector< map<int, Slit> > masks;
+    int nobj_tot = int(slits.size());
+
+    if (options.restarts > 1) {
+      printf("WARNING: Joint assignment is deterministic, ignoring --restarts.\n");
+    }
+    assignMasks(&masks, numMasks, &slits, &acqSlits, allSlitsG, 
+		microshufflePix, dispDirection, pixelScale);
+    refineMasks(&masks, slits, microshufflePix, dispDirection, pixelScale, wiggleVal > 0.);
+    // The assignment stops at the deadline
+    bool stopped = pastDeadline();
+
+    masksOut.masks = &masks;
+    masksOut.outFileRoot = outFileRoot;
+    masksOut.slitMode = slitMode;
+    masksOut.microshufflePix = microshufflePix;
+    masksOut.dispDirection = dispDirection;
+    masksOut.pixelScale = pixelScale;
+    masksOut.det_img = det_img;
+    masksOut.det_spec = det_spec;
+    masksOut.ra_imag = ra_imag;
+    masksOut.dec_imag = dec_imag;
+    runParallel(numMasks, writeMask, &masksOut);
+    for (int i=0; i<numMasks && session != 0; i++) {
+      maskFileName(outFile, sizeof(outFile), outFileRoot, 0, i + 1);
+      session->outFiles.push_back(outFile);
+    }
+
+    // Print placement summaries to the 'Design Masks' window.
+    for (int i=0; i<numMasks; i++) {
+      maskFileName(outFile, sizeof(outFile), outFileRoot, 0, i + 1);
+      printf("\nMASK %d (of %d): %s\n", i + 1, numMasks, 
+	     strrchr(outFile, '/') != 0 ? strrchr(outFile, '/') + 1 : outFile);
+
+      numberPlacedAcq = numberPlacedPrio1 = numberPlacedPrio2 = numberPlacedPrio3 = 0;
+      for (map<int, Slit>::iterator it = masks[i].begin(); it != masks[i].end(); it++) {
+	if ((*it).second.priority == '0') numberPlacedAcq++;
+	if ((*it).second.priority == '1') numberPlacedPrio1++;
+	if ((*it).second.priority == '2') numberPlacedPrio2++;
+	if ((*it).second.priority == '3') numberPlacedPrio3++;
+      }
+      printf("  %d of %d available objects included.\n", int(masks[i].size()), nobj_tot);
+      printf("  Thereof priority 0/1/2/3: %d / %d / %d / %d\n", numberPlacedAcq,
+	     numberPlacedPrio1, numberPlacedPrio2, numberPlacedPrio3);
+      if (stopped) {
+	printf("  %s: slit placement cut short.\n", stopRequested ? "Stopped" : "Deadline reached");
+      }
+      if (numberPlacedAcq < 2) {
+	printf("  WARNING: Less than 2 acquisition objects!\n");
+      }
+      int counts[4] = {numberPlacedAcq, numberPlacedPrio1, numberPlacedPrio2, 
+		       numberPlacedPrio3};
+      sprintf(fields, "mask=%d", i + 1);
+      printProgress("mask", fields, counts);
+      // Objects are used on one mask only, the acquisition objects on all.
+      nobj_tot -= masks[i].size() - (i == 0 ? 0 : numberPlacedAcq);
+    }
+
+    printProgress("done", "", 0);
+    return 0;
+  }
+
   // Select slits for each mask up to numMasks.
   for (int i=0; i<numMasks; i++) {
 
     // Leave if no objects left! Otherwise the program will hang
     if (int(slits.size()) <= 0) break;
 
-    numberPlacedAcq   = 0;
-    numberPlacedPrio1 = 0;
-    numberPlacedPrio2 = 0;
-    numberPlacedPrio3 = 0;
-
     // Init output stream.
-    sprintf(outFile, "%s%d.cat", outFileRoot, i + 1);
+    maskFileName(outFile, sizeof(outFile), outFileRoot, 0, i + 1);
     outStream.open(outFile);
+    if (session != 0) session->outFiles.push_back(outFile);
 
-    char outShortFile[128];
+    char outShortFile[256];
     if (strrchr(outFile, '/') != 0)
-      sprintf(outShortFile, "%s", strrchr(outFile, '/') + 1);
+      snprintf(outShortFile, sizeof(outShortFile), "%s", strrchr(outFile, '/') + 1);
     else
-      sprintf(outShortFile, "%s", outFile);
+      snprintf(outShortFile, sizeof(outShortFile), "%s", outFile);
 
     printf("\nMASK %d (of %d): %s\n", i + 1, numMasks, outShortFile);
     int nobj_tot = int(slits.size());
@@ -423,94 +1301,101 @@ int main(int argc, char *argv[]) {
     initOutputFile(outFile, outStream, dispDirection, pixelScale, det_img,
 		   det_spec, ra_imag, dec_imag);
 
-    // Acquisition slit processing.
-    // Generate conflict map using only acquisition slits.
-    mapConflicts(&acqSlitsG, acqSlits, microshufflePix, dispDirection, pixelScale);
-
-    // Place as many acquisition slits as we can.
-    placeSlits(&acqSlits, &placed, &removed, &acqSlits, &acqSlitsG,
-	       microshufflePix, dispDirection, pixelScale);
-    numberPlacedAcq = placed.size();
-
-    // Generate conflict map using all slits.
-    mapConflicts(&allSlitsG, slits, microshufflePix, dispDirection, pixelScale);
-
-    // Remove any slits from "slits" which have been placed and add them to "removed".
-    removeConflicts(&slits, &placed, &removed, allSlitsG);
-
-    // Priority 1 slit processing.
-
-    // Fetch all priority 1 slits.
-    p1Slits = getSlits(slits, '1');
-    // Generate conflict graph using priority 1 slits only.
-    mapConflicts(&p1SlitsG, p1Slits, microshufflePix, dispDirection, pixelScale);
-    // Place as many priority 1 slits as we can.
-    placeSlits(&slits, &placed, &removed, &p1Slits, &p1SlitsG, 
-	       microshufflePix, dispDirection, pixelScale);
-    numberPlacedPrio1 = placed.size() - numberPlacedAcq;
-    // Remove slits which now cannot be placed from consideration.
-    removeConflicts(&slits, &placed, &removed, allSlitsG);
-
-    // Priority 2 slit processing.
-    p2Slits = getSlits(slits, '2');
-    mapConflicts(&p2SlitsG, p2Slits, microshufflePix, dispDirection, pixelScale);
-    placeSlits(&slits, &placed, &removed, &p2Slits, &p2SlitsG, 
-	       microshufflePix, dispDirection, pixelScale);
-    numberPlacedPrio2 = placed.size() - numberPlacedAcq - numberPlacedPrio1;
-    removeConflicts(&slits, &placed, &removed, allSlitsG);
-
-    // Priority 3 slit processing.
-    p3Slits = getSlits(slits, '3');
-    mapConflicts(&p3SlitsG, p3Slits, microshufflePix, dispDirection, pixelScale);
-    placeSlits(&slits, &placed, &removed, &p3Slits, &p3SlitsG, 
-	       microshufflePix, dispDirection, pixelScale);
-    numberPlacedPrio3 = placed.size() - numberPlacedAcq - numberPlacedPrio1 - numberPlacedPrio2;
-    removeConflicts(&slits, &placed, &removed, allSlitsG);
-
-    // Adjust slit positions slightly to try to place more slits on the mask
-    // BUGGY IF MORE THAN ONE MASK PRODUCED! FIRST MASK IS FINE, SUBSEQUENT MASKS MAY HAVE SPECTRA
-    // OVERLAP WITH (OVERLAPPING?) ACQ SOURCES. Hence only for i=0.
-    // We may wiggle slits that have been placed already, though (see other wiggle scripts)
-    if (wiggleVal > 0. && i==0) {
-      wiggleUnplaced(&slits, &placed, &removed, microshufflePix, dispDirection, pixelScale);
-    }
+    // Run the greedy passes. Adjust slit positions slightly to try to 
+    // place more slits on the mask. Every move is re-tested against all 
+    // placed slits (including the acquisition objects), so this holds 
+    // for all masks.
+    _selection_ selection;
+    selection.slits.swap(slits);
+    selection.acqSlits = acqSlits;
+    progressMask = i + 1;
+    best = selectMask(&selection, allSlitsG, microshufflePix, dispDirection, 
+		      pixelScale, wiggleVal > 0.);
+    progressMask = 0;
+
+    slits.swap(selection.slits);
+    acqSlits.swap(selection.acqSlits);
+    placed.swap(selection.placed);
+    removed.swap(selection.removed);
+    numberPlacedAcq   = selection.numberPlaced[0];
+    numberPlacedPrio1 = selection.numberPlaced[1];
+    numberPlacedPrio2 = selection.numberPlaced[2];
+    numberPlacedPrio3 = selection.numberPlaced[3];
+    stats = selection.stats;
 
     // Expand slits length-wise into each other, to maximize sky.
     // Expansion will be asymmetric, i.e. the object will in general 
     // not be centered along the slitlet hereafter
     if (slitMode == 'M' && microshufflePix == 0) {
-      maxSlitMode(placed, pixelScale, dispDirection);
+      maxSlitMode(placed, pixelScale);
     }
 
     // Write slits to ODF file.
-    writeSlits(placed, outStream);
+    writeSlits(placed, outStream, dispDirection);
 
     // Print placement summary to the 'Design Masks' window.
     printf("  %d of %d available objects included.\n", int(placed.size()), nobj_tot);
     printf("  Thereof priority 0/1/2/3: %d / %d / %d / %d\n", numberPlacedAcq,
 	   numberPlacedPrio1, numberPlacedPrio2, numberPlacedPrio3);
+    if (options.restarts > 1) {
+      if (best == 0)
+	printf("  Best of %d restarts: the deterministic pass.\n", options.restarts);
+      else
+	printf("  Best of %d restarts: pass %d (seed %lu).\n", options.restarts, best, 
+	       options.seed + best - 1);
+    }
+    if (stats.passes < options.restarts) {
+      printf("  %s: %d of %d restarts run.\n", stopRequested ? "Stopped" : "Deadline reached",
+	     stats.passes, options.restarts);
+    }
+    else if (stats.stopped) {
+      printf("  %s: slit placement cut short.\n", stopRequested ? "Stopped" : "Deadline reached");
+    }
+    if (stats.updated) {
+      printf("  Conflict graph updates after wiggling saved %ld conflict tests.\n",
+	     stats.updateTestsSaved);
+    }
+    if (stats.exactGain > 0) {
+      printf("  Exact selection in %d conflict sub-graphs placed %d more objects.\n",
+	     stats.exactComponents, stats.exactGain);
+    }
+    if (options.timeBudget > 0) {
+      printf("  Local search placed %d more objects (%d swaps).\n", 
+	     stats.searchGain, stats.searchSwaps);
+    }
+    if (stats.wiggleGain > 0) {
+      printf("  Wiggling placed %d more objects.\n", stats.wiggleGain);
+    }
+    if (options.progress) {
+      printf("  Conflict tests: %ld\n", conflictTests - conflictTestsMask);
+    }
+    conflictTestsMask = conflictTests;
     if (numberPlacedAcq < 2) {
       printf("  WARNING: Less than 2 acquisition objects!\n");
     }
+    sprintf(fields, "mask=%d", i + 1);
+    printProgress("mask", fields, selection.numberPlaced);
 
     // If we're constructing another ODF file, rearrange data to do so.
     if (i + 1 != numMasks) {
       // Removed is a list of all unplaced slits. This becomes our new input data. 
-      // NOTE : 'slits' container should be empty at this point. 
+      // NOTE : 'slits' container only holds the placed slits at this point,
+      // and those not reached if the placement was cut short by the deadline.
+      for (map<int, Slit>::iterator it = slits.begin(); it != slits.end(); it++) {
+	if (placed.count((*it).first) == 0) removed.insert(*it);
+      }
       slits.swap(removed);
 
       // Clear all other containers. 
       // NOTE: Except 'acqSlits', those slits are re-used for each mask.
       removed.clear();
       placed.clear();
-      p1Slits.clear();
-      p2Slits.clear();
-      p3Slits.clear();
     }
 
     outStream.close();
   }
 
+  printProgress("done", "", 0);
   return 0;
 }
 
@@ -518,423 +1403,2496 @@ int main(int argc, char *argv[]) {
 /*
 ************************************************************************
 *+
-* FUNCTION: initOutputFile
-*
-* RETURNS: n/a
+* FUNCTION: sweepMasks
 *
-* DESCRIPTION: Writes some preliminary data to the output file.  
+* RETURNS: int [success or failure]
 *
-* [NOTES:]: 
+* DESCRIPTION: Parameter sweep (--sweep): designs the masks of every 
+*              parameter set of options.sweep, sharing the loaded slits
+*              between the sets with the same wiggle and packing, and the
+*              conflict graphs between those with the same minimum 
+*              separation as well. The sets run on the thread pool. Prints
+*              a table of the slits placed per priority, and writes the 
+*              ODFs of the sets chosen with --sweep-write.
 *
+* [NOTES:]: 'work' holds the inputs of the call, 'defaults' the parameters
+*           of the command line. Masks are designed one after the other 
+*           (as with --assign sequential).
 *-
 ************************************************************************
 */
-void initOutputFile(char * outFile, ofstream & outStream, string dispDirection, 
-		    float pixelScale, char * det_img,
-		    char * det_spec, char * ra_imag, char * dec_imag) {
-  char outShortFile[128];
-  char temp[1024];
+int sweepMasks(_sweep_ *work, const _sweepset_ &defaults) {
+  vector<_sweepset_> &sets = work->sets;
+  ofstream outStream;
+  char outFile[256];
+  size_t c, k, best = 0;
+  int i, p, used;
 
-  if (strrchr(outFile, '/') != 0) sprintf(outShortFile, "%s", strrchr(outFile, '/') + 1);
-  else sprintf(outShortFile, "%s", outFile);
+  if (!parseSweep(options.sweep, defaults, &sets)) {
+    printf("ERROR: Invalid parameter grid '%s' for option --sweep\n", options.sweep.c_str());
+    return (-1);
+  }
 
-  // This writes to the .cat file.
-  outStream.write("QueryResult\n\n", strlen("QueryResult\n\n"));
-  outStream.write("# Config entry for original catalog server:\n",
-		  strlen("# Config entry for original catalog server:\n"));
-  outStream.write("serv_type: local\n", strlen("serv_type: local\n"));
-  sprintf(temp, "long_name: %s\n", outFile);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "short_name: %s\n", outShortFile);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "url: %s\n", outFile);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp,
-	  "symbol: {x_ccd y_ccd priority} {diamond magenta {} {} {} {$priority == \"0\"}} {20 {}}:{x_ccd y_ccd priority} {circle red {} {} {} {$priority == \"1\"}} {15 {}}:{x_ccd y_ccd priority} {square green {} {} {} {$priority == \"2\"}} {15 {}}:{x_ccd y_ccd priority} {triangle turquoise {} {} {} {$priority == \"3\"}} {15 {}}:{x_ccd y_ccd priority} {cross yellow {} {} {} {$priority == \"X\"}} {15 {}}\n");
-  outStream.write(temp, strlen(temp));
-  //  sprintf(temp, "#SpectrumLength: %d\n", (int) specLen);
-  //  outStream.write(temp, strlen(temp));
-  outStream.write("# Fits keywords\n", strlen("# Fits keywords\n"));
-  sprintf(temp, "#fits INSTRUME= %s / Mask defined for this instrument\n", instType.c_str());
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "#fits DISPDIR = %s / Dispersion direction\n", dispDirection.c_str());
-  outStream.write(temp, strlen(temp));
+  // The sets to write ('best' is known at the end)
+  if (options.sweepWrite == "all") {
+    for (c = 0; c < sets.size(); c++) sets[c].write = true;
+  }
+  else if (options.sweepWrite != "none" && options.sweepWrite != "best") {
+    vector<string> chosen = stringSplit(options.sweepWrite, ",");
+    for (k = 0; k < chosen.size(); k++) {
+      if (!stringToInt(chosen[k], used) || used < 1 || used > int(sets.size())) {
+	printf("ERROR: No parameter set '%s' to write.\n", chosen[k].c_str());
+	return (-1);
+      }
+      sets[used - 1].write = true;
+    }
+  }
 
-  // The pixel scale isn't relevant for GMMPS itself. It is alsno not constant across the image.
-  // However, odf2mdf needs the nominal values, and we lock them in here so that IRAF doesn't do nonsense:
-  float pixelScaleOut = 0.0;
-  if (instType == "F2") pixelScaleOut = 0.1792;
-  if (instType == "GMOS-N") {
-    if      (pixelScale >  0.071 && pixelScale < 0.075) pixelScaleOut = 0.0727; // EEV 1x1, old pseudo-image
-    else if (pixelScale >= 0.075 && pixelScale < 0.085) pixelScaleOut = 0.0807; // Hamamatsu 1x1
-    else if (pixelScale >  0.142 && pixelScale < 0.150) pixelScaleOut = 0.1454; // EEV 2x2, old pseudo-image
-    else if (pixelScale >= 0.150 && pixelScale < 0.170) pixelScaleOut = 0.1614; // Hamamatsu 2x2
-    else {
-      cout << "ERROR: Pixel scale " << pixelScale << " could not be matched with valid GMOS-N configurations!";
-      exit (1);
+  // The slits of each wiggle and packing, and the conflict graph of each
+  // minimum separation on top, in the order the sets use them first
+  for (c = 0; c < sets.size(); c++) {
+    for (k = 0; k < c; k++) {
+      if (sets[k].wiggleVal == sets[c].wiggleVal && sets[k].pack == sets[c].pack) break;
     }
+    sets[c].slitsSet = (k < c) ? sets[k].slitsSet : work->slits.size();
+    if (k == c) {
+      work->slits.push_back(map<int, Slit>());
+      work->microshufflePix.push_back(loadSlits(&work->slits.back(), work->inFile, 
+						work->bandConfig, work->pixelScale, 
+						work->dispDirection, sets[c].wiggleVal, 
+						sets[c].pack, true));
+    }
+
+    for (k = 0; k < c; k++) {
+      if (sets[k].slitsSet == sets[c].slitsSet && sets[k].minpixsep == sets[c].minpixsep) break;
+    }
+    sets[c].graphSet = (k < c) ? sets[k].graphSet : work->graphSlits.size();
+    if (k == c) work->graphSlits.push_back(c);
   }
-  if (instType == "GMOS-S") {
-    if      (pixelScale >  0.071 && pixelScale < 0.075) pixelScaleOut = 0.0730; // EEV 1x1, old pseudo-image
-    else if (pixelScale >= 0.075 && pixelScale < 0.085) pixelScaleOut = 0.0800; // Hamamatsu 1x1
-    else if (pixelScale >  0.142 && pixelScale < 0.150) pixelScaleOut = 0.1460; // EEV 2x2, old pseudo-image
-    else if (pixelScale >= 0.150 && pixelScale < 0.170) pixelScaleOut = 0.1600; // Hamamatsu 2x2
-    else {
-      cout << "ERROR: Pixel scale " << pixelScale << " could not be matched with valid GMOS-N configurations!";
-      exit (1);
+  work->graphs.resize(work->graphSlits.size());
+
+  runParallel(work->graphs.size(), mapSweepGraph, work);
+  runParallel(sets.size(), runSweep, work);
+
+  // The summary table, and the best set: the most acquisition, priority
+  // 1, 2 and 3 slits, in that order
+  printf("SWEEP: %d parameter sets, %d slit loads, %d conflict graphs\n", int(sets.size()),
+	 int(work->slits.size()), int(work->graphs.size()));
+  printf("   # minpixsep wiggle mode pack masks placed  acq prio1 prio2 prio3  per mask\n");
+  for (c = 0; c < sets.size(); c++) {
+    printf("%4d %9.2f %6.2f %4c %4d %5d %6d %4d %5d %5d %5d ", int(c + 1), 
+	   sets[c].minpixsep, sets[c].wiggleVal, sets[c].slitMode, int(sets[c].pack), 
+	   sets[c].numMasks, sets[c].numberPlaced[0] + sets[c].numberPlaced[1] + 
+	   sets[c].numberPlaced[2] + sets[c].numberPlaced[3], sets[c].numberPlaced[0],
+	   sets[c].numberPlaced[1], sets[c].numberPlaced[2], sets[c].numberPlaced[3]);
+    for (k = 0; k < sets[c].masks.size(); k++) {
+      printf(" %d", int(sets[c].masks[k].size()));
+    }
+    printf("\n");
+
+    for (p = 0; p < 4; p++) {
+      if (sets[c].numberPlaced[p] != sets[best].numberPlaced[p]) {
+	if (sets[c].numberPlaced[p] > sets[best].numberPlaced[p]) best = c;
+	break;
+      }
+    }
+  }
+  printf("Best: parameter set %d\n", int(best + 1));
+
+  if (options.sweepWrite == "best") sets[best].write = true;
+
+  for (c = 0; c < sets.size(); c++) {
+    if (!sets[c].write) continue;
+    for (i = 0; i < int(sets[c].masks.size()); i++) {
+      maskFileName(outFile, sizeof(outFile), work->outFileRoot, int(c + 1), i + 1);
+      outStream.open(outFile);
+      initOutputFile(outFile, outStream, work->dispDirection, work->pixelScale, 
+		     work->det_img, work->det_spec, work->ra_imag, work->dec_imag);
+      writeSlits(sets[c].masks[i], outStream, work->dispDirection);
+      outStream.close();
+      work->written.push_back(outFile);
+      printf("Wrote %s\n", outFile);
     }
   }
-  sprintf(temp, "#fits PIXSCALE= %f / Nominal pixel scale for IRAF (odf2mdf)\n", pixelScaleOut);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "#fits DET_IMG = %s / Detector ID for pre-image \n", det_img);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "#fits DET_SPEC= %s / Detector ID for the spectrograph\n", det_spec);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "#fits RA_IMAG = %s / Right ascension of pointing center\n", ra_imag);
-  outStream.write(temp, strlen(temp));
-  sprintf(temp, "#fits DEC_IMAG= %s / Declination of pointing center\n", dec_imag);
-  outStream.write(temp, strlen(temp));
 
-  // Add Nod&Shuffle parameters
-  if (banddef.microShuffle || banddef.bandShuffle) {
-    sprintf(temp, "#fits SHUFMODE= %s / Microshuffling or bandshuffling\n", banddef.shuffleMode.c_str());
-    outStream.write(temp, strlen(temp));
-    sprintf(temp, "#fits SHUFSIZE= %d / Shuffle distance [unbinned pixel]\n", int(banddef.shuffleUnbPx));
-    outStream.write(temp, strlen(temp));
+  return 0;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseSweep
+*
+* RETURNS: False if the grid is not valid.
+*
+* DESCRIPTION: Reads the parameter grid of a sweep, e.g. 
+*              'minpixsep=3,4 wiggle=0,0.2 mode=N,M pack=0,1 masks=1,2'
+*              (blanks or ';' between parameters), into one set per
+*              combination. Parameters left out keep their value in
+*              'defaults'.
+*
+* [NOTES:]: The sets are ordered with the last parameter above changing
+*           fastest.
+*-
+************************************************************************
+*/
+bool parseSweep(const string &grid, const _sweepset_ &defaults, vector<_sweepset_> *sets) {
+  vector<string> params, values;
+  vector<float> minpixsep(1, defaults.minpixsep), wiggleVal(1, defaults.wiggleVal);
+  vector<char> slitMode(1, defaults.slitMode);
+  vector<int> pack(1, defaults.pack), numMasks(1, defaults.numMasks);
+  vector<string>::iterator param;
+  string name, spec = grid;
+  size_t i, a, b, c, d, e;
+  float f;
+  int n;
+
+  replace(spec.begin(), spec.end(), ';', ' ');
+  params = stringSplit(spec, " ");
+  for (param = params.begin(); param != params.end(); param++) {
+    if ((*param).empty()) continue;
+    if ((*param).find('=') == string::npos) return false;
+    name = (*param).substr(0, (*param).find('='));
+    values = stringSplit((*param).substr((*param).find('=') + 1), ",");
+    if (values.empty()) return false;
+
+    if (name == "minpixsep") minpixsep.clear();
+    else if (name == "wiggle") wiggleVal.clear();
+    else if (name == "mode") slitMode.clear();
+    else if (name == "pack") pack.clear();
+    else if (name == "masks") numMasks.clear();
+    else return false;
+
+    for (i = 0; i < values.size(); i++) {
+      if (name == "mode") {
+	if (values[i] != "N" && values[i] != "M") return false;
+	slitMode.push_back(values[i][0]);
+      }
+      else if (name == "pack" || name == "masks") {
+	if (!stringToInt(values[i], n) || n < (name == "pack" ? 0 : 1)) return false;
+	if (name == "pack") pack.push_back(n != 0);
+	else numMasks.push_back(n);
+      }
+      else {
+	if (!stringToFloat(values[i], f) || f < 0) return false;
+	if (name == "minpixsep") minpixsep.push_back(f);
+	else wiggleVal.push_back(f);
+      }
+    }
+  }
+
+  sets->clear();
+  for (a = 0; a < minpixsep.size(); a++) 
+    for (b = 0; b < wiggleVal.size(); b++) 
+      for (c = 0; c < slitMode.size(); c++) 
+	for (d = 0; d < pack.size(); d++) 
+	  for (e = 0; e < numMasks.size(); e++) {
+	    sets->push_back(defaults);
+	    sets->back().minpixsep = minpixsep[a];
+	    sets->back().wiggleVal = wiggleVal[b];
+	    sets->back().slitMode = slitMode[c];
+	    sets->back().pack = pack[d];
+	    sets->back().numMasks = numMasks[e];
+	  }
+
+  return true;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: mapSweepGraph
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): maps conflict graph 'g' of the 
+*              _sweep_ in 'context', with the slits and minimum spectra 
+*              separation of the first set using it.
+*
+* [NOTES:]: Only writes to graph 'g'.
+*-
+************************************************************************
+*/
+void mapSweepGraph(int g, void *context) {
+  _sweep_ *work = (_sweep_ *) context;
+  const _sweepset_ &set = work->sets[work->graphSlits[g]];
+
+  MIN_SPEC_DIST = set.minpixsep * work->pixelScale;
+  mapConflicts(&work->graphs[g], work->slits[set.slitsSet], 
+	       work->microshufflePix[set.slitsSet], work->dispDirection, work->pixelScale);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: runSweep
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): designs the masks of parameter set
+*              'c' of the _sweep_ in 'context' one after the other, as 
+*              makeMasks() does, and keeps them with their counts.
+*
+* [NOTES:]: Only writes to set 'c'.
+*-
+************************************************************************
+*/
+void runSweep(int c, void *context) {
+  _sweep_ *work = (_sweep_ *) context;
+  _sweepset_ &set = work->sets[c];
+  float microshufflePix = work->microshufflePix[set.slitsSet];
+  _selection_ selection;
+  map<int, Slit> slits, acqSlits;
+  int i, p;
+
+  MIN_SPEC_DIST = set.minpixsep * work->pixelScale;
+
+  slits = work->slits[set.slitsSet];
+  acqSlits = getSlits(slits, '0');
+  for (p = 0; p < 4; p++) set.numberPlaced[p] = 0;
+
+  for (i = 0; i < set.numMasks && !slits.empty(); i++) {
+    selection = _selection_();
+    selection.slits.swap(slits);
+    selection.acqSlits = acqSlits;
+    selectMask(&selection, work->graphs[set.graphSet], microshufflePix, 
+	       work->dispDirection, work->pixelScale, set.wiggleVal > 0.);
+
+    if (set.slitMode == 'M' && microshufflePix == 0) {
+      maxSlitMode(selection.placed, work->pixelScale);
+    }
+
+    for (p = 0; p < 4; p++) set.numberPlaced[p] += selection.numberPlaced[p];
+    set.masks.push_back(map<int, Slit>());
+    set.masks.back().swap(selection.placed);
+
+    // The unplaced slits make the next mask.
+    acqSlits.swap(selection.acqSlits);
+    slits.swap(selection.removed);
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: optimizeMasks
+*
+* RETURNS: int [success or failure]
+*
+* DESCRIPTION: Position angle and pointing optimizer (--optimize): turns 
+*              the field about the pointing center and shifts it on the 
+*              detector for every pointing of the grid in 
+*              options.optimize, and designs the masks at each of them
+*              on the thread pool. The 'refine' rounds then try the 
+*              neighbours of the best pointing at half the grid step. 
+*              Prints the best pointings, with the nominal one for 
+*              reference.
+*
+* [NOTES:]: The objects are moved in pixel space (see moveField()), a 
+*           first order approximation of projecting their coordinates 
+*           again. The objects outside the field of view at the 
+*           nominal pointing are only known from --optimize-catalog; 
+*           with the input catalogue (gmmps_fov's output) the other 
+*           pointings can only lose objects. No ODF is written: the 
+*           masks must be designed again at the chosen position angle 
+*           and pointing.
+*-
+************************************************************************
+*/
+int optimizeMasks(_optimize_ *work) {
+  vector<_pointing_> &pointings = work->pointings;
+  vector<_pointing_> ranked;
+  vector<float> pa, dx, dy;
+  vector<float> *axis[3] = {&pa, &dx, &dy};
+  float step[3] = {0., 0., 0.};
+  _pointing_ pointing, centre;
+  size_t a, b, c, k;
+  int refine, round, nominal;
+
+  if (!parseOptimize(options.optimize, &pa, &dx, &dy, &refine, work->weights)) {
+    printf("ERROR: Invalid pointing grid '%s' for option --optimize\n", options.optimize.c_str());
+    return (-1);
+  }
+
+  // The refinement step of each axis is the smallest one of its grid
+  for (k = 0; k < 3; k++) {
+    sort(axis[k]->begin(), axis[k]->end());
+    for (a = 1; a < axis[k]->size(); a++) {
+      float d = (*axis[k])[a] - (*axis[k])[a-1];
+      if (d > 0. && (step[k] == 0. || d < step[k])) step[k] = d;
+    }
+  }
+
+  // The nominal pointing first, then the grid
+  pointings.push_back(_pointing_());
+  for (a = 0; a < pa.size(); a++) 
+    for (b = 0; b < dx.size(); b++) 
+      for (c = 0; c < dy.size(); c++) {
+	if (pa[a] == 0. && dx[b] == 0. && dy[c] == 0.) continue;
+	pointing = _pointing_();
+	pointing.pa = pa[a];
+	pointing.dx = dx[b];
+	pointing.dy = dy[c];
+	pointings.push_back(pointing);
+      }
+
+  work->first = 0;
+  for (round = 0; ; round++) {
+    runParallel(pointings.size() - work->first, runPointing, work);
+
+    centre = pointings[0];
+    for (k = 1; k < pointings.size(); k++) {
+      if (betterPointing(pointings[k], centre)) centre = pointings[k];
+    }
+    if (round == refine) break;
+
+    // The neighbours of the best pointing, at half the step
+    work->first = pointings.size();
+    for (k = 0; k < 3; k++) step[k] /= 2.;
+    for (a = 0; a < 3; a++) 
+      for (b = 0; b < 3; b++) 
+	for (c = 0; c < 3; c++) {
+	  pointing = _pointing_();
+	  pointing.pa = centre.pa + (int(a) - 1) * step[0];
+	  pointing.dx = centre.dx + (int(b) - 1) * step[1];
+	  pointing.dy = centre.dy + (int(c) - 1) * step[2];
+	  for (k = 0; k < pointings.size(); k++) {
+	    if (fabs(pointings[k].pa - pointing.pa) < 1e-4 && 
+		fabs(pointings[k].dx - pointing.dx) < 1e-4 &&
+		fabs(pointings[k].dy - pointing.dy) < 1e-4) break;
+	  }
+	  if (k == pointings.size()) pointings.push_back(pointing);
+	}
+    if (int(pointings.size()) == work->first) break;
+  }
+
+  // The best pointings, and the nominal one if it is not among them
+  ranked = pointings;
+  stable_sort(ranked.begin(), ranked.end(), betterPointing);
+  for (nominal = 0; ranked[nominal].pa != 0. || ranked[nominal].dx != 0. || 
+	 ranked[nominal].dy != 0.; nominal++);
+
+  printf("OPTIMIZE: %d pointings, %d refinement rounds, weights %g/%g/%g\n", 
+	 int(pointings.size()), round, work->weights[0], work->weights[1], work->weights[2]);
+  printf("rank    dPA     dx     dy  inFoV placed  acq prio1 prio2 prio3    score\n");
+  for (k = 0; k < ranked.size(); k++) {
+    if (k >= size_t(MAX_POINTINGS_SHOWN) && int(k) != nominal) continue;
+    const _pointing_ &p = ranked[k];
+    printf("%4d %6.2f %6.2f %6.2f %6d %6d %4d %5d %5d %5d %8.1f%s\n", int(k + 1), 
+	   p.pa, p.dx, p.dy, p.numSlits, p.numberPlaced[0] + p.numberPlaced[1] + 
+	   p.numberPlaced[2] + p.numberPlaced[3], p.numberPlaced[0], p.numberPlaced[1], 
+	   p.numberPlaced[2], p.numberPlaced[3], p.score, int(k) == nominal ? "  nominal" : "");
+  }
+
+  printf("Best: position angle %+.2f deg, objects shifted by %+.2f, %+.2f arcsec on the detector\n",
+	 ranked[0].pa, ranked[0].dx, ranked[0].dy);
+  printf("  Score %.1f, %.1f at the nominal pointing.\n", ranked[0].score, ranked[nominal].score);
+  if (ranked[0].minAcq < 2) {
+    printf("  WARNING: Less than 2 acquisition objects!\n");
+  }
+
+  return 0;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseOptimize
+*
+* RETURNS: False if the grid is not valid.
+*
+* DESCRIPTION: Reads the pointing grid of the optimizer, e.g. 
+*              'pa=-10:10:2 dx=-5:5:2.5 dy=0 refine=2 weights=4,2,1'
+*              (blanks or ';' between parameters). 'pa' is the change of
+*              the position angle (degrees), 'dx' and 'dy' the shift of
+*              the objects on the detector (arcseconds), each given as 
+*              a list of values or as 'first:last:step'. Axes left out 
+*              stay at 0. 'refine' is the number of refinement rounds 
+*              (default 0), 'weights' the score of a priority 1, 2 and 3
+*              slit (default 4,2,1).
+*
+* [NOTES:]: 
+*-
+************************************************************************
+*/
+bool parseOptimize(const string &grid, vector<float> *pa, vector<float> *dx, 
+		   vector<float> *dy, int *refine, float *weights) {
+  vector<string> params, values;
+  vector<string>::iterator param;
+  vector<float> *axis;
+  string name, spec = grid;
+  float f;
+  size_t i;
+  int n;
+
+  pa->assign(1, 0.);
+  dx->assign(1, 0.);
+  dy->assign(1, 0.);
+  *refine = 0;
+  weights[0] = PRIORITY_WEIGHTS[0];
+  weights[1] = PRIORITY_WEIGHTS[1];
+  weights[2] = PRIORITY_WEIGHTS[2];
+
+  replace(spec.begin(), spec.end(), ';', ' ');
+  params = stringSplit(spec, " ");
+  for (param = params.begin(); param != params.end(); param++) {
+    if ((*param).empty()) continue;
+    if ((*param).find('=') == string::npos) return false;
+    name = (*param).substr(0, (*param).find('='));
+    values = stringSplit((*param).substr((*param).find('=') + 1), ",");
+    if (values.empty()) return false;
+
+    if (name == "refine") {
+      if (values.size() != 1 || !stringToInt(values[0], n) || n < 0) return false;
+      *refine = n;
+      continue;
+    }
+    if (name == "weights") {
+      if (values.size() != 3) return false;
+      for (i = 0; i < 3; i++) {
+	if (!stringToFloat(values[i], f) || f < 0) return false;
+	weights[i] = f;
+      }
+      continue;
+    }
+
+    if (name == "pa") axis = pa;
+    else if (name == "dx") axis = dx;
+    else if (name == "dy") axis = dy;
+    else return false;
+
+    if (!parseAxis((*param).substr((*param).find('=') + 1), axis)) return false;
+  }
+
+  return true;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseAxis
+*
+* RETURNS: False if the values are not valid.
+*
+* DESCRIPTION: Reads the values of one axis of a grid into 'axis': a 
+*              list like '1,2,4', ranges 'first:last:step', or both, 
+*              e.g. '-2,0:10:5'.
+*
+* [NOTES:]: 
+*-
+************************************************************************
+*/
+bool parseAxis(const string &spec, vector<float> *axis) {
+  vector<string> values, range;
+  float f, first, last, step;
+  size_t i;
+  int n;
+
+  axis->clear();
+  values = stringSplit(spec, ",");
+  for (i = 0; i < values.size(); i++) {
+    range = stringSplit(values[i], ":");
+    if (range.size() == 1) {
+      if (!stringToFloat(range[0], f)) return false;
+      axis->push_back(f);
+    }
+    else if (range.size() == 3) {
+      if (!stringToFloat(range[0], first) || !stringToFloat(range[1], last) || 
+	  !stringToFloat(range[2], step) || step <= 0 || last < first) return false;
+      for (n = 0; first + n * step <= last + 1e-4 * step; n++) {
+	axis->push_back(first + n * step);
+      }
+    }
+    else return false;
+  }
+
+  return !axis->empty();
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: runPointing
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): moves the objects to pointing 
+*              'first + i' of the _optimize_ in 'context', maps their 
+*              conflicts and designs the masks one after the other (as 
+*              makeMasks() does), and scores the slits placed.
+*
+* [NOTES:]: Only writes to its pointing.
+*-
+************************************************************************
+*/
+void runPointing(int i, void *context) {
+  _optimize_ *work = (_optimize_ *) context;
+  _pointing_ &pointing = work->pointings[work->first + i];
+  _selection_ selection;
+  map<int, Slit> slits, acqSlits;
+  Graph graph;
+  int m, p;
+
+  moveField(&slits, *work->slits, *work, pointing);
+  pointing.numSlits = slits.size();
+  mapConflicts(&graph, slits, work->microshufflePix, work->dispDirection, work->pixelScale);
+
+  acqSlits = getSlits(slits, '0');
+  for (p = 0; p < 4; p++) pointing.numberPlaced[p] = 0;
+  pointing.minAcq = 0;
+
+  for (m = 0; m < work->numMasks && !slits.empty(); m++) {
+    selection = _selection_();
+    selection.slits.swap(slits);
+    selection.acqSlits = acqSlits;
+    selectMask(&selection, graph, work->microshufflePix, work->dispDirection, 
+	       work->pixelScale, work->wiggle);
+
+    for (p = 0; p < 4; p++) pointing.numberPlaced[p] += selection.numberPlaced[p];
+    if (m == 0 || selection.numberPlaced[0] < pointing.minAcq) {
+      pointing.minAcq = selection.numberPlaced[0];
+    }
+
+    // The unplaced slits make the next mask.
+    acqSlits.swap(selection.acqSlits);
+    slits.swap(selection.removed);
+  }
+
+  pointing.score = 0.;
+  for (p = 1; p < 4; p++) pointing.score += work->weights[p-1] * pointing.numberPlaced[p];
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: moveField
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Copies the 'slits' at the nominal pointing into 'moved', 
+*              turning the objects about the pointing center (crpix1, 
+*              crpix2) and shifting them as 'pointing' says. The slits 
+*              keep their offsets, sizes and tilts on the mask, and the 
+*              spectra move with their objects along the dispersion 
+*              direction. Slits with less than MIN_FOV_FRACTION of their 
+*              area inside the field of view (see fovFraction()), or 
+*              outside the bands of a band shuffle mask, are left out.
+*
+* [NOTES:]: A positive 'pa' turns the objects clockwise on the detector,
+*           as increasing the position angle does for an image with 
+*           North up and East left.
+*-
+************************************************************************
+*/
+void moveField(map<int, Slit> *moved, const map<int, Slit> &slits, 
+	       const _optimize_ &work, const _pointing_ &pointing) {
+  map<int, Slit>::const_iterator it;
+  float cosPA = cos(pointing.pa * M_PI / 180.);
+  float sinPA = sin(pointing.pa * M_PI / 180.);
+  float x, y, deltaX, deltaY, deltaW, deltaL;
+  bool horizontal = work.dispDirection == DISP_HORIZONTAL;
+  bool inside;
+
+  moved->clear();
+  for (it = slits.begin(); it != slits.end(); it++) {
+    Slit slit = (*it).second;
+
+    // The object, relative to the pointing center
+    x = (horizontal ? slit.odf.ccdW : slit.odf.ccdL) - work.crpix1;
+    y = (horizontal ? slit.odf.ccdL : slit.odf.ccdW) - work.crpix2;
+    deltaX = cosPA * x + sinPA * y - x + pointing.dx / work.pixelScale;
+    deltaY = cosPA * y - sinPA * x - y + pointing.dy / work.pixelScale;
+    deltaW = horizontal ? deltaX : deltaY;
+    deltaL = horizontal ? deltaY : deltaX;
+
+    slit.ccdW += deltaW;
+    slit.ccdL += deltaL;
+    slit.slitTop += deltaW;
+    slit.slitBottom += deltaW;
+    slit.slitStart += deltaL;
+    slit.slitEnd += deltaL;
+    slit.odf.ccdW += deltaW;
+    slit.odf.ccdL += deltaL;
+    if (horizontal) {
+      slit.odf.specBottom += deltaL;
+      slit.odf.specTop += deltaL;
+    } else {
+      slit.odf.specLeft += deltaL;
+      slit.odf.specRight += deltaL;
+    }
+
+    // Spectra that are not packed span the detector anyway
+    if (work.pack) {
+      slit.specStart += deltaW;
+      slit.specEnd += deltaW;
+      slit.specPosW += deltaW;
+      if (horizontal) {
+	slit.odf.specLeft += deltaW;
+	slit.odf.specRight += deltaW;
+      } else {
+	slit.odf.specBottom += deltaW;
+	slit.odf.specTop += deltaW;
+      }
+    }
+
+    inside = fovFraction(slit, work.dispDirection) >= MIN_FOV_FRACTION;
+    if (inside && banddef.bandShuffle) {
+      inside = bandShuffleCheck(banddef.bandSize, slit.slitLength, slit.ccdL);
+    }
+
+    if (inside) moved->insert(pair<int, Slit>(slit.id, slit));
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: fovFraction
+*
+* RETURNS: The fraction of the area of 'slit' within the field of view.
+*
+* DESCRIPTION: The test gmmps_fov keeps slits by: tilted slits are 
+*              parallelograms, their ends sheared along the dispersion 
+*              direction by tan(angle) as vmAstroCat.tcl draws them, and
+*              are clipped to the field of view (FovSlabs::clippedArea()).
+*              A slit whose bounding box lies within the field of view is
+*              not clipped. A slit without area counts by its center.
+*-
+************************************************************************
+*/
+float fovFraction(const Slit &slit, DispDirection dispDirection) {
+  double w[4], l[4], shear, area;
+  float wmin, wmax, lmin, lmax;
+  int k;
+
+  // The corners, in order around the slit
+  shear = 0.5 * slit.slitLength * tan(slit.angle * M_PI / 180.);
+  if (dispDirection == DISP_HORIZONTAL) shear = -shear;
+  w[0] = slit.ccdW + shear - 0.5 * slit.slitWidth;  l[0] = slit.ccdL + 0.5 * slit.slitLength;
+  w[1] = slit.ccdW + shear + 0.5 * slit.slitWidth;  l[1] = l[0];
+  w[2] = slit.ccdW - shear + 0.5 * slit.slitWidth;  l[2] = slit.ccdL - 0.5 * slit.slitLength;
+  w[3] = slit.ccdW - shear - 0.5 * slit.slitWidth;  l[3] = l[2];
+
+  area = (double) slit.slitLength * slit.slitWidth;
+  if (area <= 0.) return fov.slabs.inside(slit.ccdW, slit.ccdL) ? 1. : 0.;
+
+  // The FoV need not be convex: a bounding box with its corners inside
+  // is checked edge by edge
+  wmin = min(w[0], w[3]);
+  wmax = max(w[1], w[2]);
+  lmin = l[2];
+  lmax = l[0];
+  for (k = 0; k < 4 && fov.slabs.inside((k & 1) ? wmax : wmin, (k & 2) ? lmax : lmin); k++);
+  if (k == 4 && fov.slabs.contains(wmin, wmax, lmin, lmax)) return 1.;
+
+  return fov.slabs.clippedArea(w, l, 4) / area;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: betterPointing
+*
+* RETURNS: True if pointing 'one' is better than 'two'.
+*
+* DESCRIPTION: Orders the pointings of the optimizer: at least 2 
+*              acquisition objects on every mask first, then the higher
+*              score, then the smaller shift and position angle change.
+*
+* [NOTES:]: 
+*-
+************************************************************************
+*/
+bool betterPointing(const _pointing_ &one, const _pointing_ &two) {
+  if (min(one.minAcq, 2) != min(two.minAcq, 2)) return one.minAcq > two.minAcq;
+  if (one.score != two.score) return one.score > two.score;
+  if (hypot(one.dx, one.dy) != hypot(two.dx, two.dy)) {
+    return hypot(one.dx, one.dy) < hypot(two.dx, two.dy);
+  }
+  return fabs(one.pa) < fabs(two.pa);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: cwlMasks
+*
+* RETURNS: int [success or failure]
+*
+* DESCRIPTION: Central wavelength scan (--cwl): evaluates the gemwm 
+*              wavelength model of the grating in-process for every 
+*              central wavelength of options.cwl, sets the spectral 
+*              footprints of the slits from it (setFootprints()), and 
+*              designs the masks at each of them on the thread pool. 
+*              Prints a table of the slits placed per priority, and of
+*              how much of the placed spectra falls into the detector 
+*              gaps.
+*
+* [NOTES:]: The footprints follow append_specdims in gmmps_spoc.tcl, 
+*           without the corrections for old GMOS pseudo-images. No ODF
+*           is written.
+*-
+************************************************************************
+*/
+int cwlMasks(_cwlscan_ *work) {
+  vector<_cwlrun_> &runs = work->runs;
+  vector<float> cwl;
+  string grating;
+  instrument model(instType, "", "MOS");
+  size_t c, k, best = 0;
+  int p;
+
+  if (!parseCwl(options.cwl, &cwl, &grating, &work->lambdaMin, &work->lambdaMax)) {
+    printf("ERROR: Invalid central wavelengths '%s' for option --cwl\n", options.cwl.c_str());
+    return (-1);
+  }
+
+  // The valid range of the GMOS models, as in instrument::check_instconfig()
+  if (instType == "GMOS-N" || instType == "GMOS-S") {
+    for (c = 0; c < cwl.size(); c++) {
+      if (cwl[c] < 350. || cwl[c] > 1050.) {
+	printf("ERROR: Central wavelength %g nm outside valid range [350-1050nm]\n", cwl[c]);
+	return (-1);
+      }
+    }
+  }
+
+  // The models are for 1x1 binning at the native pixel scale
+  if (instType == "GMOS-N") work->nativeScale = 0.0807;
+  else if (instType == "GMOS-S") work->nativeScale = 0.0800;
+  else if (instType == "F2") work->nativeScale = 0.1792;
+  else if (instType == "F2-AO") work->nativeScale = 0.0896;
+  else {
+    printf("ERROR: No wavelength model for instrument %s\n", instType.c_str());
+    return (-1);
+  }
+
+  model.disperser = grating;
+  if (!loadWavelengthModel(&model)) {
+    return (-1);
+  }
+  work->model = &model;
+
+  runs.resize(cwl.size());
+  for (c = 0; c < runs.size(); c++) runs[c].cwl = cwl[c];
+  runParallel(runs.size(), runCwl, work);
+
+  // The summary table, and the best central wavelength: the most 
+  // acquisition, priority 1, 2 and 3 slits, in that order, then the 
+  // least spectrum in the gaps
+  printf("CWL: %d central wavelengths, %s %s, %g-%g nm\n", int(runs.size()), 
+	 instType.c_str(), grating.c_str(), work->lambdaMin, work->lambdaMax);
+  printf("    cwl placed  acq prio1 prio2 prio3 in gap gap loss  per mask\n");
+  for (c = 0; c < runs.size(); c++) {
+    printf("%7.1f %6d %4d %5d %5d %5d %6d %7.1f%% ", runs[c].cwl, 
+	   runs[c].numberPlaced[0] + runs[c].numberPlaced[1] + runs[c].numberPlaced[2] + 
+	   runs[c].numberPlaced[3], runs[c].numberPlaced[0], runs[c].numberPlaced[1], 
+	   runs[c].numberPlaced[2], runs[c].numberPlaced[3], runs[c].inGap, 
+	   100. * runs[c].gapLoss);
+    for (k = 0; k < runs[c].perMask.size(); k++) {
+      printf(" %d", runs[c].perMask[k]);
+    }
+    printf("\n");
+
+    for (p = 0; p < 4; p++) {
+      if (runs[c].numberPlaced[p] != runs[best].numberPlaced[p]) {
+	if (runs[c].numberPlaced[p] > runs[best].numberPlaced[p]) best = c;
+	break;
+      }
+    }
+    if (p == 4 && runs[c].gapLoss < runs[best].gapLoss) best = c;
+  }
+  printf("Best: central wavelength %.1f nm\n", runs[best].cwl);
+  if (runs[best].minAcq < 2) {
+    printf("  WARNING: Less than 2 acquisition objects!\n");
+  }
+
+  return 0;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseCwl
+*
+* RETURNS: False if the parameters are not valid.
+*
+* DESCRIPTION: Reads the parameters of a central wavelength scan, e.g.
+*              'cwl=600:800:25 grating=R400 range=520,950' (blanks or 
+*              ';' between parameters): the central wavelengths (nm, as
+*              in parseAxis()), the grating as named in the gemwm data 
+*              files, and the spectral range (nm) cut by the filter.
+*
+* [NOTES:]: All three are required.
+*-
+************************************************************************
+*/
+bool parseCwl(const string &grid, vector<float> *cwl, string *grating, 
+	      float *lambdaMin, float *lambdaMax) {
+  vector<string> params, values;
+  vector<string>::iterator param;
+  string name, value, spec = grid;
+
+  cwl->clear();
+  grating->clear();
+  *lambdaMin = *lambdaMax = 0.;
+
+  replace(spec.begin(), spec.end(), ';', ' ');
+  params = stringSplit(spec, " ");
+  for (param = params.begin(); param != params.end(); param++) {
+    if ((*param).empty()) continue;
+    if ((*param).find('=') == string::npos) return false;
+    name = (*param).substr(0, (*param).find('='));
+    value = (*param).substr((*param).find('=') + 1);
+
+    if (name == "cwl") {
+      if (!parseAxis(value, cwl)) return false;
+    }
+    else if (name == "grating") {
+      *grating = value;
+    }
+    else if (name == "range") {
+      values = stringSplit(value, ",");
+      if (values.size() != 2 || !stringToFloat(values[0], *lambdaMin) || 
+	  !stringToFloat(values[1], *lambdaMax) || *lambdaMin <= 0. || 
+	  *lambdaMax <= *lambdaMin) return false;
+    }
+    else return false;
+  }
+
+  return !cwl->empty() && !grating->empty() && *lambdaMax > 0.;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: loadWavelengthModel
+*
+* RETURNS: False if the coefficients could not be read.
+*
+* DESCRIPTION: Reads the wavelength calibration coefficients of the 
+*              grating of 'inst' from $GMMPS/gemwm/data, as gemwm does
+*              (read_wavecal_table() in gemwm.cc).
+*
+* [NOTES:]: 
+*-
+************************************************************************
+*/
+bool loadWavelengthModel(instrument *inst) {
+  const char *dpath = getenv("GMMPS");
+  string filename, disperser;
+  ifstream input;
+  double a, b, c;
+  int i, j, found = 0;
+
+  if (dpath == NULL) {
+    printf("ERROR: Environment variable \"GMMPS\" not found!\n");
+    return false;
+  }
+  filename = string(dpath) + "/gemwm/data/" + inst->name + "_wavecal_coeffs.dat";
+  input.open(filename.c_str());
+  if (!input.is_open()) {
+    printf("ERROR: Could not open %s\n", filename.c_str());
+    return false;
+  }
+
+  memset(inst->coeff, 0, sizeof(inst->coeff));
+  while (input >> disperser >> i >> j >> a >> b >> c) {
+    if (inst->disperser == disperser && i >= 0 && i < 4 && j >= 0 && j < 6) {
+      inst->coeff[i][j][0] = a;
+      inst->coeff[i][j][1] = b;
+      inst->coeff[i][j][2] = c;
+      found++;
+    }
+  }
+  input.close();
+
+  if (found == 0) {
+    printf("ERROR: No wavelength model for grating %s in %s\n", inst->disperser.c_str(), 
+	   filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: runCwl
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): sets the footprints of the slits 
+*              for central wavelength 'c' of the _cwlscan_ in 'context',
+*              maps their conflicts and designs the masks one after the
+*              other (as makeMasks() does). Counts the slits placed, and
+*              the placed spectra (without the acquisition objects) 
+*              crossing a detector gap.
+*
+* [NOTES:]: Only writes to run 'c'. With pack_spectra 0 the spectra span
+*           the detector at every central wavelength, only the gap 
+*           counts change.
+*-
+************************************************************************
+*/
+void runCwl(int c, void *context) {
+  _cwlscan_ *work = (_cwlscan_ *) context;
+  _cwlrun_ &run = work->runs[c];
+  instrument model = *work->model;
+  map<int, Slit> slits = *work->slits, acqSlits;
+  map<int, Slit>::iterator it;
+  _selection_ selection;
+  Graph graph;
+  double length = 0., lost, lostTotal = 0.;
+  float start, end;
+  size_t g;
+  int m, p;
+
+  // gemwm takes the central wavelength in Angstrom
+  model.cwl = run.cwl * 10.;
+  setFootprints(&slits, model, *work);
+  mapConflicts(&graph, slits, work->microshufflePix, work->dispDirection, work->pixelScale);
+
+  acqSlits = getSlits(slits, '0');
+  for (p = 0; p < 4; p++) run.numberPlaced[p] = 0;
+  run.minAcq = run.inGap = 0;
+
+  for (m = 0; m < work->numMasks && !slits.empty(); m++) {
+    selection = _selection_();
+    selection.slits.swap(slits);
+    selection.acqSlits = acqSlits;
+    selectMask(&selection, graph, work->microshufflePix, work->dispDirection, 
+	       work->pixelScale, work->wiggle);
+
+    for (p = 0; p < 4; p++) run.numberPlaced[p] += selection.numberPlaced[p];
+    if (m == 0 || selection.numberPlaced[0] < run.minAcq) {
+      run.minAcq = selection.numberPlaced[0];
+    }
+    run.perMask.push_back(selection.placed.size());
+
+    // The spectra of the model, also without packing
+    for (it = selection.placed.begin(); it != selection.placed.end(); it++) {
+      if ((*it).second.priority == '0') continue;
+      const _odfrow_ &odf = (*it).second.odf;
+      start = work->dispDirection == DISP_HORIZONTAL ? odf.specLeft : odf.specBottom;
+      end = work->dispDirection == DISP_HORIZONTAL ? odf.specRight : odf.specTop;
+      lost = 0.;
+      for (g = 0; g < fov.gapStart.size(); g++) {
+	lost += max(0.f, min(end, fov.gapEnd[g]) - max(start, fov.gapStart[g]));
+      }
+      if (lost > 0.) run.inGap++;
+      lostTotal += lost;
+      length += end - start;
+    }
+
+    // The unplaced slits make the next mask.
+    acqSlits.swap(selection.acqSlits);
+    slits.swap(selection.removed);
+  }
+
+  run.gapLoss = length > 0. ? lostTotal / length : 0.;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: setFootprints
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Sets the spectra of the 'slits' from the wavelength model
+*              'model' at its central wavelength: the positions of the 
+*              red and blue end of the spectral range of 'work' for the
+*              slit center, truncated at the detector, as 
+*              append_specdims in gmmps_spoc.tcl does with gemwm.
+*
+* [NOTES:]: The ODF columns always take the spectra of the model, the 
+*           conflict tests only if packing is on.
+*-
+************************************************************************
+*/
+void setFootprints(map<int, Slit> *slits, instrument &model, const _cwlscan_ &work) {
+  map<int, Slit>::iterator it;
+  bool horizontal = work.dispDirection == DISP_HORIZONTAL;
+  string linearmode = model.disperser == "R831_2nd" ? "linear" : "";
+  float corrfac = work.pixelScale / work.nativeScale;
+  float detMin = min(horizontal ? fov.dimx : fov.dimy);
+  float detMax = max(horizontal ? fov.dimx : fov.dimy);
+  float xslit, yslit, red, blue;
+
+  for (it = slits->begin(); it != slits->end(); it++) {
+    Slit &slit = (*it).second;
+
+    // The slit center in the pixels of the model. F2 disperses along y,
+    // its model along x.
+    xslit = (horizontal ? slit.ccdW : slit.ccdL) * corrfac;
+    yslit = (horizontal ? slit.ccdL : slit.ccdW) * corrfac;
+    if (instType.compare(0, 2, "F2") == 0) swap(xslit, yslit);
+
+    red  = model.lambda2x(xslit, yslit, work.lambdaMax * 10., linearmode) / corrfac;
+    blue = model.lambda2x(xslit, yslit, work.lambdaMin * 10., linearmode) / corrfac;
+    red  = max(detMin, red);
+    blue = min(detMax, blue);
+
+    if (horizontal) {
+      slit.odf.specLeft = red;
+      slit.odf.specRight = blue;
+    } else {
+      slit.odf.specBottom = red;
+      slit.odf.specTop = blue;
+    }
+    if (work.pack) {
+      slit.specStart = red;
+      slit.specEnd = blue;
+      slit.specPosW = (red + blue) / 2.;
+    }
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: initOutputFile
+*
+* RETURNS: n/a
+*
+* DESCRIPTION: Writes some preliminary data to the output file.  
+*
+* [NOTES:]: 
+*
+*-
+************************************************************************
+*/
+void initOutputFile(char * outFile, ofstream & outStream, DispDirection dispDirection, 
+		    float pixelScale, char * det_img,
+		    char * det_spec, char * ra_imag, char * dec_imag) {
+  char outShortFile[256];
+  char temp[1024];
+
+  if (strrchr(outFile, '/') != 0) snprintf(outShortFile, sizeof(outShortFile), "%s", strrchr(outFile, '/') + 1);
+  else snprintf(outShortFile, sizeof(outShortFile), "%s", outFile);
+
+  // This writes to the .cat file.
+  outStream.write("QueryResult\n\n", strlen("QueryResult\n\n"));
+  outStream.write("# Config entry for original catalog server:\n",
+		  strlen("# Config entry for original catalog server:\n"));
+  outStream.write("serv_type: local\n", strlen("serv_type: local\n"));
+  sprintf(temp, "long_name: %s\n", outFile);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "short_name: %s\n", outShortFile);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "url: %s\n", outFile);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp,
+	  "symbol: {x_ccd y_ccd priority} {diamond magenta {} {} {} {$priority == \"0\"}} {20 {}}:{x_ccd y_ccd priority} {circle red {} {} {} {$priority == \"1\"}} {15 {}}:{x_ccd y_ccd priority} {square green {} {} {} {$priority == \"2\"}} {15 {}}:{x_ccd y_ccd priority} {triangle turquoise {} {} {} {$priority == \"3\"}} {15 {}}:{x_ccd y_ccd priority} {cross yellow {} {} {} {$priority == \"X\"}} {15 {}}\n");
+  outStream.write(temp, strlen(temp));
+  //  sprintf(temp, "#SpectrumLength: %d\n", (int) specLen);
+  //  outStream.write(temp, strlen(temp));
+  outStream.write("# Fits keywords\n", strlen("# Fits keywords\n"));
+  sprintf(temp, "#fits INSTRUME= %s / Mask defined for this instrument\n", instType.c_str());
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "#fits DISPDIR = %s / Dispersion direction\n", 
+	  dispDirection == DISP_VERTICAL ? "vertical" : "horizontal");
+  outStream.write(temp, strlen(temp));
+
+  // The pixel scale isn't relevant for GMMPS itself. It is alsno not constant across the image.
+  // However, odf2mdf needs the nominal values, and we lock them in here so that IRAF doesn't do nonsense:
+  float pixelScaleOut = 0.0;
+  if (instType == "F2") pixelScaleOut = 0.1792;
+  if (instType == "GMOS-N") {
+    if      (pixelScale >  0.071 && pixelScale < 0.075) pixelScaleOut = 0.0727; // EEV 1x1, old pseudo-image
+    else if (pixelScale >= 0.075 && pixelScale < 0.085) pixelScaleOut = 0.0807; // Hamamatsu 1x1
+    else if (pixelScale >  0.142 && pixelScale < 0.150) pixelScaleOut = 0.1454; // EEV 2x2, old pseudo-image
+    else if (pixelScale >= 0.150 && pixelScale < 0.170) pixelScaleOut = 0.1614; // Hamamatsu 2x2
+    else {
+      cout << "ERROR: Pixel scale " << pixelScale << " could not be matched with valid GMOS-N configurations!";
+      exit (1);
+    }
+  }
+  if (instType == "GMOS-S") {
+    if      (pixelScale >  0.071 && pixelScale < 0.075) pixelScaleOut = 0.0730; // EEV 1x1, old pseudo-image
+    else if (pixelScale >= 0.075 && pixelScale < 0.085) pixelScaleOut = 0.0800; // Hamamatsu 1x1
+    else if (pixelScale >  0.142 && pixelScale < 0.150) pixelScaleOut = 0.1460; // EEV 2x2, old pseudo-image
+    else if (pixelScale >= 0.150 && pixelScale < 0.170) pixelScaleOut = 0.1600; // Hamamatsu 2x2
+    else {
+      cout << "ERROR: Pixel scale " << pixelScale << " could not be matched with valid GMOS-N configurations!";
+      exit (1);
+    }
+  }
+  sprintf(temp, "#fits PIXSCALE= %f / Nominal pixel scale for IRAF (odf2mdf)\n", pixelScaleOut);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "#fits DET_IMG = %s / Detector ID for pre-image \n", det_img);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "#fits DET_SPEC= %s / Detector ID for the spectrograph\n", det_spec);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "#fits RA_IMAG = %s / Right ascension of pointing center\n", ra_imag);
+  outStream.write(temp, strlen(temp));
+  sprintf(temp, "#fits DEC_IMAG= %s / Declination of pointing center\n", dec_imag);
+  outStream.write(temp, strlen(temp));
+
+  // Add Nod&Shuffle parameters
+  if (banddef.microShuffle || banddef.bandShuffle) {
+    sprintf(temp, "#fits SHUFMODE= %s / Microshuffling or bandshuffling\n", banddef.shuffleMode.c_str());
+    outStream.write(temp, strlen(temp));
+    sprintf(temp, "#fits SHUFSIZE= %d / Shuffle distance [unbinned pixel]\n", int(banddef.shuffleUnbPx));
+    outStream.write(temp, strlen(temp));
     sprintf(temp, "#fits BINNING = %d / Binning\n", int(banddef.binning));
     outStream.write(temp, strlen(temp));
 
-    // Microshuffling
-    if (banddef.microShuffle) {
-      sprintf(temp, "#fits SLITLEN = %.2f / Slit length for microshuffling [arcsec]\n", banddef.msSlitLen);
-      outStream.write(temp, strlen(temp));
-      sprintf(temp, "#fits YOFFSET = %d / Band offset [unbinned pixel]\n", banddef.yoffset);
-      outStream.write(temp, strlen(temp));
+    // Microshuffling
+    if (banddef.microShuffle) {
+      sprintf(temp, "#fits SLITLEN = %.2f / Slit length for microshuffling [arcsec]\n", banddef.msSlitLen);
+      outStream.write(temp, strlen(temp));
+      sprintf(temp, "#fits YOFFSET = %d / Band offset [unbinned pixel]\n", banddef.yoffset);
+      outStream.write(temp, strlen(temp));
+    }
+
+    // Bandshuffling
+    if (banddef.bandShuffle) {
+      sprintf(temp, "#fits BANDSIZE= %d / Height of the science band [unbinned pixel]\n", 
+	      int(banddef.bandSize * banddef.binning));
+      outStream.write(temp, strlen(temp));
+      sprintf(temp, "#fits YOFFSET = %d / Band offset [unbinned pixel]\n", banddef.yoffset);
+      outStream.write(temp, strlen(temp));
+    }
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: loadSlits
+*
+* RETURNS: Zero if not in microShuffle mode, the microShuffle distance
+*          (in arcseconds) otherwise.
+*
+* DESCRIPTION: Loads all slit data from the input file. With 'inBands', 
+*              only the slits within the bands of a band shuffle mask.
+*
+* [NOTES:]: The file is mapped and parsed in place (parseCatalog()). 
+*           Malformed lines are reported with their line number and 
+*           skipped.
+*-
+************************************************************************
+*/
+float loadSlits(map<int, Slit> *slits, const char *inFileName, 
+		string bandConfig, float pixelScale, DispDirection dispDirection,
+		float wiggleFactor, bool pack_spectra, bool inBands) {
+
+  // The input catalogue, mapped or read, and its lines
+  const char *data;
+  size_t size;
+  string text;
+  bool mapped;
+  vector<_catrow_> rows;
+  vector<_catrow_>::iterator row;
+
+  // Nod and Shuffle variables.
+  banddef.binning = 0;      // Image binning value. 
+  banddef.bandSize = 0.0; // The size of each band in pixels.
+  banddef.shuffleAmt = 0.0;
+  banddef.shufflePix = 0.0; // The magnitude of the shuffling, in pixels. 
+  banddef.msSlitLen = 0.0;
+  banddef.yoffset = 0;
+  banddef.bandShuffle = false;  // bandShuffle mode flag.
+  banddef.microShuffle = false; // microShuffle mode flag. 
+  banddef.numBands = 1;
+  banddef.shuffleBands.clear();
+
+  // Slit data variables.
+
+  // Useful vars for calculations:
+  int id, j;
+  float ccdW, ccdL;            // width-wise and length-wise ccd slit position
+  float slitOffsetW, slitOffsetL;
+  float slitLength, slitWidth;
+  float ccdW_orig, ccdL_orig;            // backups
+  float slitOffsetW_orig, slitOffsetL_orig;
+  float slitLength_orig, slitWidth_orig;
+  char priority;
+  float slitStart; // The length-wise pixel coordinate of the start of the slit
+  float slitEnd;   // The length-wise pixel coordinate of the end of the slit
+  float slitTop, slitBottom;
+  float bandPos;
+  _odfrow_ odf;
+
+  // These we only need because we need to output them later:
+  float ra, dec, angle, mag, redshift;
+  char type;
+  float specPosW, specPosL; // need to be calculated 
+  //  float wlambdac, lambda1, lambda2;
+  float spec_begin; // starting position of spectrum (lower value, pixels)
+  float spec_end; // end position of spectrum (higher value, pixels)
+  
+  vector<string>bandArgs;
+
+  // Disentangle the Nod & Shuffle parameters
+  if (bandConfig.compare("") != 0) {
+    // Split the string into words
+    bandArgs = getword(bandConfig,' ');
+    
+    banddef.binning    = atof(bandArgs[0].c_str());
+    banddef.bandSize   = atof(bandArgs[2].c_str());   // if in bandshuffle mode
+    banddef.msSlitLen  = atof(bandArgs[2].c_str());   // if in microshuffle mode
+    banddef.shufflePix = atof(bandArgs[3].c_str());
+    banddef.shuffleAmt = atof(bandArgs[4].c_str());
+    banddef.shuffleMode = bandArgs[1];
+
+    if (bandArgs[1].compare("microShuffle") == 0) 
+      banddef.microShuffle = true;
+    else
+      banddef.bandShuffle = true;
+
+    if (banddef.bandShuffle) {
+      banddef.numBands = atoi(bandArgs.back().c_str());
+      j = 0;
+      while (j<banddef.numBands) {
+	bandPos = atof(bandArgs[j+5].c_str()) / banddef.binning;
+	banddef.shuffleBands.push_back(bandPos);
+	j++;
+      }
+      banddef.yoffset = atoi(bandArgs[bandArgs.size()-2].c_str());
+    }
+
+    banddef.shuffleUnbPx = banddef.shufflePix;
+      
+    // Convert to _binned_ pixels
+    banddef.shufflePix = banddef.shuffleAmt / pixelScale;
+    // Set shuffle magnitude for access in 'main' function;
+    banddef.shuffleMagnitude = banddef.shufflePix;
+    // shufflePix = shufflePix / binning;
+    banddef.bandSize /= banddef.binning;
+  }
+
+
+  // Map the file, or read it if it cannot be mapped (e.g. it is empty).
+  data = mapFile(inFileName, &size);
+  mapped = data != 0;
+  if (!mapped) {
+    if (!readFile(inFileName, &text)) {
+      printf("Unable to open input file. Exiting.\n");
+      exit(1);
+    }
+    data = text.data();
+    size = text.size();
+  }
+  parseCatalog(data, size, inFileName, &rows);
+  if (mapped) munmap(const_cast<char *>(data), size);
+
+  for (row = rows.begin(); row != rows.end(); row++) {
+    id = (*row).id;
+    ra = (*row).ra;
+    dec = (*row).dec;
+    angle = (*row).angle;
+    mag = (*row).mag;
+    priority = (*row).priority;
+    type = (*row).type;
+    redshift = (*row).redshift;
+    spec_begin = (*row).specBegin;
+    spec_end = (*row).specEnd;
+
+    // Dependency on dispersion direction
+    if (dispDirection == DISP_HORIZONTAL) {
+      ccdW = (*row).x;
+      ccdL = (*row).y;
+      slitOffsetW = (*row).offsetX;
+      slitOffsetL = (*row).offsetY;
+      slitWidth = (*row).sizeX;
+      slitLength = (*row).sizeY;
+    } else {
+      ccdL = (*row).x;
+      ccdW = (*row).y;
+      slitOffsetL = (*row).offsetX;
+      slitOffsetW = (*row).offsetY;
+      slitLength = (*row).sizeX;
+      slitWidth = (*row).sizeY;
+    }
+
+    // Slits have a constant length if we are in microshuffle mode.
+    if (banddef.microShuffle && priority != '0') {
+      slitLength = banddef.msSlitLen;
+    }
+
+    // Acq Objects have to be 2.0 x 2.0 arcseconds.
+    if (priority == '0') {
+      slitLength = 2.0;
+      slitWidth = 2.0;
+    }
+
+    // Make the spectra as long as the detector array to prevent packing
+    if (!pack_spectra) {
+      spec_begin = 1.;
+      spec_end = fov.totalwidth_spectral;
+    }
+
+    // Center of spectrum footprint (only used in the print function for debugging purposes)
+    specPosW = (spec_begin + spec_end) / 2.;
+
+    // Only used to find the slit that is most central to the mask
+    specPosL = slitOffsetL / pixelScale;
+
+    // make a backup copy (for the ODF output)
+    slitOffsetL_orig = slitOffsetL;
+    slitOffsetW_orig = slitOffsetW;
+    slitLength_orig  = slitLength;
+    slitWidth_orig   = slitWidth;
+    ccdL_orig        = ccdL;
+    ccdW_orig        = ccdW;
+
+    // Convert slit dimensions into pixels.
+    slitOffsetL /= pixelScale;
+    slitOffsetW /= pixelScale;
+    slitLength  /= pixelScale;
+    slitWidth   /= pixelScale;
+
+    // Calculate slit centers and dimensions (in pixels)
+    ccdL += slitOffsetL;
+    ccdW += slitOffsetW;
+    slitStart  = ccdL - (slitLength / 2.0);
+    slitEnd    = ccdL + (slitLength / 2.0);
+    slitTop    = ccdW + (slitWidth / 2.0);
+    slitBottom = ccdW - (slitWidth / 2.0);
+
+    // What will be written to the ODF if this slit is chosen
+    odf.ra = ra;
+    odf.dec = dec;
+    odf.ccdW = ccdW_orig;
+    odf.ccdL = ccdL_orig;
+    odf.offsetW = slitOffsetW_orig;
+    odf.offsetL = slitOffsetL_orig;
+    odf.width = slitWidth_orig;
+    odf.length = slitLength_orig;
+    odf.mag = mag;
+    odf.redshift = redshift;
+    odf.type = type;
+    if (dispDirection == DISP_HORIZONTAL) {
+      odf.specLeft = spec_begin;
+      odf.specRight = spec_end;
+      odf.specBottom = slitStart;
+      odf.specTop = slitEnd;
+    } else {
+      odf.specLeft = slitStart;
+      odf.specRight = slitEnd;
+      odf.specBottom = spec_begin;
+      odf.specTop = spec_end;
+    }
+
+    // Add the slit to the slit list.
+    // If in band shuffling mode make sure the slit is in a band.
+    if (!inBands || !banddef.bandShuffle || 
+	bandShuffleCheck(banddef.bandSize, slitLength, ccdL)) {
+      slits->insert(pair<int, Slit>(id, 
+				    Slit(id, priority, slitStart, slitEnd, slitLength, ccdL, 
+					 ccdW, slitWidth, slitTop, slitBottom, specPosL, 
+					 specPosW, angle, wiggleFactor, odf, spec_begin, spec_end)));
+    }
+  }
+
+  // Return microshuffle distance value if in microshuffle mode.
+  if (banddef.microShuffle) {
+    return banddef.shufflePix;
+  } 
+  else {
+    return 0;
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseCatalog
+*
+* RETURNS: The number of malformed lines.
+*
+* DESCRIPTION: Parses the 'size' bytes of the input catalogue at 'data'
+*              (named 'fileName' in messages) into 'rows', one row per 
+*              line of CATALOG_COLUMNS columns. Blank lines are skipped,
+*              malformed ones are reported with their line number and 
+*              skipped.
+*
+* [NOTES:]: The lines are split and their numbers parsed in place, 
+*           nothing is copied (see parseCatalogLine()). 'data' need not
+*           end in a newline or a null character.
+*-
+************************************************************************
+*/
+int parseCatalog(const char *data, size_t size, const char *fileName, 
+		 vector<_catrow_> *rows) {
+  const char *line, *lineEnd, *end = data + size;
+  _catrow_ row;
+  string error;
+  int number = 0, bad = 0;
+
+  rows->clear();
+  rows->reserve(count(data, end, '\n') + 1);
+
+  for (line = data; line < end; line = lineEnd + 1) {
+    lineEnd = (const char *) memchr(line, '\n', end - line);
+    if (lineEnd == 0) lineEnd = end;
+    number++;
+
+    if (parseCatalogLine(line, lineEnd, &row, &error)) {
+      rows->push_back(row);
+    }
+    else if (!error.empty()) {
+      if (++bad <= MAX_BAD_LINES_SHOWN) {
+	printf("WARNING: Skipping line %d of %s: %s\n", number, fileName, error.c_str());
+      }
+    }
+  }
+
+  if (bad > MAX_BAD_LINES_SHOWN) {
+    printf("WARNING: Skipped %d more malformed lines of %s.\n", 
+	   bad - MAX_BAD_LINES_SHOWN, fileName);
+  }
+
+  return bad;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseCatalogLine
+*
+* RETURNS: True if the line [begin, end) holds a slit.
+*
+* DESCRIPTION: Splits a line of the input catalogue at blanks and tabs
+*              and reads its columns into 'row': id, RA, Dec, x, y, slit
+*              offsets, slit sizes, tilt, magnitude, priority, type, 
+*              redshift and the spectrum footprint. 
+*
+* [NOTES:]: Returns false with an empty 'error' for blank lines, and 
+*           with the reason in 'error' for malformed lines: a wrong 
+*           number of columns, or a column that is not a number.
+*-
+************************************************************************
+*/
+bool parseCatalogLine(const char *begin, const char *end, _catrow_ *row, string *error) {
+  const char *field[CATALOG_COLUMNS], *fieldEnd[CATALOG_COLUMNS];
+  float *value[CATALOG_COLUMNS] = {0, &row->ra, &row->dec, &row->x, &row->y, 
+				   &row->offsetX, &row->offsetY, &row->sizeX, &row->sizeY,
+				   &row->angle, &row->mag, 0, 0, &row->redshift,
+				   &row->specBegin, &row->specEnd};
+  const char *c = begin;
+  char text[32];
+  int n = 0, i;
+
+  error->clear();
+
+  while (true) {
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) c++;
+    if (c == end) break;
+    if (n == CATALOG_COLUMNS) {
+      n++;
+      break;
+    }
+    field[n] = c;
+    while (c < end && *c != ' ' && *c != '\t' && *c != '\r') c++;
+    fieldEnd[n++] = c;
+  }
+
+  if (n == 0) return false;
+  if (n != CATALOG_COLUMNS) {
+    if (n > CATALOG_COLUMNS) {
+      sprintf(text, "more than %d", CATALOG_COLUMNS);
+    }
+    else {
+      sprintf(text, "%d", n);
+    }
+    *error = "expected " + to_string(CATALOG_COLUMNS) + " columns, found " + text;
+    return false;
+  }
+
+  for (i = 0; i < CATALOG_COLUMNS; i++) {
+    if (i == 0 ? parseNumber(field[i], fieldEnd[i], row->id) :
+	value[i] == 0 || parseNumber(field[i], fieldEnd[i], *value[i])) continue;
+    *error = "column " + to_string(i + 1) + " is not a number: '" + 
+      string(field[i], fieldEnd[i]) + "'";
+    return false;
+  }
+  row->priority = *field[11];
+  row->type = *field[12];
+
+  return true;
+}
+
+//****************************************************************************
+// Parses the whole field [begin, end) as a number. False if it is not 
+// one, or has trailing characters. The field is copied to terminate it: 
+// the last one may end the mapped file.
+//****************************************************************************
+bool parseNumber(const char *begin, const char *end, int &value) {
+  char text[64], *stop;
+  long l;
+
+  if (begin < end && *begin == '+') begin++;
+  if (begin == end || end - begin >= int(sizeof(text))) return false;
+  memcpy(text, begin, end - begin);
+  text[end - begin] = 0;
+  l = strtol(text, &stop, 10);
+  value = int(l);
+  return *stop == 0 && !isspace((unsigned char) text[0]) && l == value;
+}
+
+bool parseNumber(const char *begin, const char *end, float &value) {
+  char text[64], *stop;
+
+  if (begin < end && *begin == '+') begin++;
+  if (begin == end || end - begin >= int(sizeof(text))) return false;
+  memcpy(text, begin, end - begin);
+  text[end - begin] = 0;
+  value = strtof(text, &stop);
+  return *stop == 0 && !isspace((unsigned char) text[0]);
+}
+
+//****************************************************************************
+// Maps a file into memory, read-only. Returns its start and sets 'size', 
+// or returns 0 if it cannot be mapped (missing, empty or not a regular
+// file). Unmap with munmap().
+//****************************************************************************
+const char * mapFile(const char *fileName, size_t *size) {
+  struct stat info;
+  void *data;
+  int fd;
+
+  fd = open(fileName, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  *size = info.st_size;
+  data = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+  madvise(data, *size, MADV_SEQUENTIAL);
+
+  return (const char *) data;
+}
+
+//****************************************************************************
+// The catalogue parser loadSlits() had before parseCatalog(): getline(), 
+// stringclean(), stringSplit() and a stream per number. Kept to compare
+// with in benchmarkParse().
+//****************************************************************************
+void parseCatalogStreams(const string &text, vector<_catrow_> *rows) {
+  istringstream stream(text);
+  vector<string> lineData;
+  string line;
+  _catrow_ row;
+
+  rows->clear();
+  while (getline(stream, line)) {
+    stringclean(line);
+    lineData = stringSplit(line, " ");
+    if (lineData.size() != 16) continue;
+
+    stringToInt(lineData[0], row.id);
+    stringToFloat(lineData[1], row.ra);
+    stringToFloat(lineData[2], row.dec);
+    stringToFloat(lineData[3], row.x);
+    stringToFloat(lineData[4], row.y);
+    stringToFloat(lineData[5], row.offsetX);
+    stringToFloat(lineData[6], row.offsetY);
+    stringToFloat(lineData[7], row.sizeX);
+    stringToFloat(lineData[8], row.sizeY);
+    stringToFloat(lineData[9], row.angle);
+    stringToFloat(lineData[10], row.mag);
+    row.priority = lineData[11][0];
+    row.type = lineData[12][0];
+    stringToFloat(lineData[13], row.redshift);
+    stringToFloat(lineData[14], row.specBegin);
+    stringToFloat(lineData[15], row.specEnd);
+    rows->push_back(row);
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: benchmarkParse
+*
+* RETURNS: n/a
+*
+* DESCRIPTION: Writes a synthetic catalogue of 'lines' lines, in the 
+*              format of gmmps_fov and append_specdims, to a temporary 
+*              file, and times reading it into rows, once as loadSlits()
+*              does (mapFile() and parseCatalog()) and once with the 
+*              stream parser it replaced (parseCatalogStreams()). Prints
+*              the throughput of both in MB/s (--parse-benchmark).
+*
+* [NOTES:]: Both parsers must read the same rows, a difference is 
+*           reported as an error. The best of PARSE_RUNS runs counts.
+*-
+************************************************************************
+*/
+void benchmarkParse(int lines) {
+  const int PARSE_RUNS = 5;
+  char fileName[] = "/tmp/gmMakeMasks_catalogXXXXXX";
+  chrono::steady_clock::time_point begin;
+  vector<_catrow_> rows[2];
+  double seconds[2] = {1e30, 1e30};
+  mt19937 rng(1);
+  uniform_real_distribution<float> unit(0., 1.);
+  ostringstream catalog;
+  string text;
+  const char *data;
+  size_t size;
+  int fd, r, i;
+  bool same;
+
+  for (i = 0; i < lines; i++) {
+    catalog << " " << i + 1 << " " << 150. + unit(rng) << " " << -30. + unit(rng) << " "
+	    << 6000. * unit(rng) << " " << 4500. * unit(rng) << " 0 " << unit(rng) - 0.5 
+	    << " 1 " << 3. + 3. * unit(rng) << " 0 " << 18. + 6. * unit(rng) << " "
+	    << int(4. * unit(rng)) << " A 0 " << 1000. * unit(rng) << " " 
+	    << 2000. + 1000. * unit(rng) << " \n";
+  }
+  text = catalog.str();
+
+  fd = mkstemp(fileName);
+  if (fd < 0 || write(fd, text.data(), text.size()) != ssize_t(text.size())) {
+    printf("ERROR: Cannot write the benchmark catalogue %s.\n", fileName);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  close(fd);
+
+  for (r = 0; r < PARSE_RUNS; r++) {
+    begin = chrono::steady_clock::now();
+    data = mapFile(fileName, &size);
+    parseCatalog(data, size, fileName, &rows[0]);
+    munmap(const_cast<char *>(data), size);
+    seconds[0] = min(seconds[0], chrono::duration<double>(chrono::steady_clock::now() - 
+							  begin).count());
+
+    begin = chrono::steady_clock::now();
+    readFile(fileName, &text);
+    parseCatalogStreams(text, &rows[1]);
+    seconds[1] = min(seconds[1], chrono::duration<double>(chrono::steady_clock::now() - 
+							  begin).count());
+  }
+  unlink(fileName);
+
+  same = rows[0].size() == rows[1].size();
+  for (i = 0; same && i < int(rows[0].size()); i++) {
+    const _catrow_ &a = rows[0][i], &b = rows[1][i];
+    same = a.id == b.id && a.ra == b.ra && a.dec == b.dec && a.x == b.x && a.y == b.y &&
+      a.offsetX == b.offsetX && a.offsetY == b.offsetY && a.sizeX == b.sizeX && 
+      a.sizeY == b.sizeY && a.angle == b.angle && a.mag == b.mag && 
+      a.priority == b.priority && a.type == b.type && a.redshift == b.redshift &&
+      a.specBegin == b.specBegin && a.specEnd == b.specEnd;
+  }
+
+  printf("Benchmark: %d lines, %.2f MB, best of %d runs\n", lines, text.size() / 1e6, 
+	 PARSE_RUNS);
+  printf("  parseCatalog():        %8.3f s, %8.1f MB/s\n", seconds[0], 
+	 text.size() / max(seconds[0], 1e-9) / 1e6);
+  printf("  parseCatalogStreams(): %8.3f s, %8.1f MB/s\n", seconds[1], 
+	 text.size() / max(seconds[1], 1e-9) / 1e6);
+  if (!same) {
+    printf("ERROR: parseCatalog() and parseCatalogStreams() read different rows.\n");
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: getSlits
+*
+* RETURNS: A vector<Slit> of Slit objects
+*
+* DESCRIPTION: Scans vector<Slit> 'slitData' for slits of 'priority',
+*               and returns a vector<Slit> of those found objects.
+*
+* [NOTES:]: O(n)
+*-
+************************************************************************
+*/
+map<int, Slit> getSlits(const map<int, Slit> &slitData, char priority) {
+  char prioCur;
+  map<int, Slit> foundSlits;
+  map<int, Slit>::const_iterator it; // Iterator object.
+
+  // Loop through 'slit' container to find slits of the given prio.
+  for (it = slitData.begin(); it != slitData.end(); it++) {
+    prioCur = (*it).second.priority;
+
+    if (prioCur == priority) {
+      // Found a slit, insert into 'foundSlits' container. 
+      foundSlits.insert(pair<int, Slit>((*it).first, Slit((*it).second)));
+    }
+  }
+
+  return foundSlits;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: mapConflicts
+*
+* RETURNS: A Graph object conflict map.
+*
+* DESCRIPTION: Maps all conflicts in 'slitData' into 'conflicts' Graph.
+*
+* [NOTES:]: Two slits conflict when the spectra of these two slits 
+*            overlap. Conflicts between slits are represented in the 
+*            graph edges between the conflicting slits.
+*            Only slits that are close along the slit length axis (found
+*            with a sweep over the SlitTable) are tested, in blocks with
+*            conflictMask(), hence O(n log n + k) for k candidate pairs.
+*-
+************************************************************************
+*/
+void mapConflicts(Graph * slitConflicts, const map<int, Slit> &slitData,
+		  float microshufflePix, DispDirection dispDirection, float pixelScale) {
+
+  map<int, Slit>::const_iterator slitOne; // Iterator object.
+  vector<int> ids;
+  vector< pair<int, int> > edges;
+  float limit;
+  unsigned mask;
+  int i, j, k, last;
+
+  // Nodes of the conflict graph.
+  ids.reserve(slitData.size());
+  for (slitOne = slitData.begin(); slitOne != slitData.end(); slitOne++) {
+    ids.push_back((*slitOne).first);
+  }
+
+  SlitTable table(slitData, conflictReach(microshufflePix, pixelScale));
+
+  // Sweep along the slit length axis. Only the slits starting before the
+  // padded end of the current slit can overlap with it.
+  for (i = 0; i < table.size(); i++) {
+    limit = table.end[i] + table.reach;
+
+    last = upper_bound(table.start.begin() + i + 1, table.start.end(), limit) - 
+      table.start.begin();
+
+    for (j = i + 1; j < last; j += BLOCK_SLITS) {
+      mask = conflictMask(*table.rows[i], table.columns(j), min(BLOCK_SLITS, last - j),
+			  microshufflePix, dispDirection, pixelScale);
+      for (k = 0; mask != 0; k++, mask >>= 1) {
+	if (mask & 1) {
+	  edges.push_back(pair<int, int>(min(table.keys[i], table.keys[j + k]), 
+					 max(table.keys[i], table.keys[j + k])));
+	}
+      }
     }
+  }
 
-    // Bandshuffling
-    if (banddef.bandShuffle) {
-      sprintf(temp, "#fits BANDSIZE= %d / Height of the science band [unbinned pixel]\n", 
-	      int(banddef.bandSize * banddef.binning));
-      outStream.write(temp, strlen(temp));
-      sprintf(temp, "#fits YOFFSET = %d / Band offset [unbinned pixel]\n", banddef.yoffset);
-      outStream.write(temp, strlen(temp));
+  slitConflicts->build(ids, edges);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: selectSlits
+*
+* RETURNS: none.
+*
+* DESCRIPTION: One greedy pass over a mask: places the acquisition slits
+*              and then the slits of priority 1, 2 and 3, starting from 
+*              the slits available in 'selection'.
+*
+* [NOTES:]: 'allSlitsG' may hold slits that are no longer available. The
+*           graph of each priority is a copy of it restricted to the 
+*           available slits of that priority. Without 'rng' the pass is 
+*           deterministic. 'timeBudget' is the local search time (ms).
+*-
+************************************************************************
+*/
+void selectSlits(_selection_ *selection, const Graph &allSlitsG,
+		 float microshufflePix, DispDirection dispDirection, float pixelScale,
+		 bool wiggle, long timeBudget, mt19937 *rng) {
+  Graph graph;
+  map<int, Slit> current;
+  int p, total;
+
+  stats.updateTestsSaved = 0;
+  stats.updated = false;
+  stats.exactComponents = 0;
+  stats.exactGain = 0;
+  stats.searchSwaps = 0;
+  stats.searchGain = 0;
+  stats.wiggleGain = 0;
+  stats.stopped = false;
+
+  // Place as many acquisition slits as we can.
+  subGraph(&graph, allSlitsG, selection->acqSlits);
+  placeSlits(&selection->acqSlits, &selection->placed, &selection->removed, 
+	     &selection->acqSlits, &graph, microshufflePix, dispDirection, pixelScale, rng);
+  selection->numberPlaced[0] = total = selection->placed.size();
+
+  // Remove any slits from "slits" which have been placed and add them to "removed".
+  removeConflicts(&selection->slits, &selection->placed, &selection->removed, allSlitsG);
+
+  for (p = 1; p <= 3; p++) {
+    // Place as many slits of this priority as we can.
+    current = getSlits(selection->slits, '0' + p);
+    subGraph(&graph, allSlitsG, current);
+    if (!placeSlits(&selection->slits, &selection->placed, &selection->removed, &current, 
+		    &graph, microshufflePix, dispDirection, pixelScale, rng)) stats.stopped = true;
+    selection->numberPlaced[p] = selection->placed.size() - total;
+    total = selection->placed.size();
+
+    // Remove slits which now cannot be placed from consideration.
+    removeConflicts(&selection->slits, &selection->placed, &selection->removed, allSlitsG);
+  }
+
+  // Revisit the greedy choices while there is time.
+  if (timeBudget > 0) {
+    mt19937 perturbations(options.seed);
+    improveSelection(selection, microshufflePix, dispDirection, pixelScale, 
+		     timeBudget, rng != 0 ? rng : &perturbations);
+  }
+
+  if (wiggle) {
+    stats.wiggleGain = wiggleUnplaced(&selection->slits, &selection->placed, &selection->removed, 
+				      microshufflePix, dispDirection, pixelScale);
+    if (pastDeadline()) stats.stopped = true;
+    for (p = 0; p <= 3; p++) {
+      selection->numberPlaced[p] = 0;
+    }
+    for (map<int, Slit>::iterator it = selection->placed.begin(); 
+	 it != selection->placed.end(); it++) {
+      selection->numberPlaced[(*it).second.priority - '0']++;
     }
   }
+
+  selection->stats = stats;
 }
 
 /*
 ************************************************************************
 *+
-* FUNCTION: loadSlits
+* FUNCTION: improveSelection
 *
-* RETURNS: Zero if not in microShuffle mode, the microShuffle distance
-*          (in arcseconds) otherwise.
+* RETURNS: none.
 *
-* DESCRIPTION: Loads all slit data from the input file.
+* DESCRIPTION: Local search on the slits placed by a greedy pass, for at
+*              most 'timeBudget' milliseconds. Moves place free 
+*              slits and swap a placed slit for one or two of its 
+*              neighbours (see LocalSearch). When no move is left, a 
+*              random unplaced slit is forced in and the search goes on;
+*              results placing fewer slits are undone. The best selection
+*              found replaces the one in 'selection'.
 *
-* [NOTES:]:
+* [NOTES:]: The conflict graph is mapped anew, as placed slits may have 
+*           been wiggled. Placed acquisition slits are never removed.
 *-
 ************************************************************************
 */
-float loadSlits(map<int, Slit> *slits, char *inFileName, 
-		string bandConfig, float pixelScale, string dispDirection,
-		float wiggleFactor, bool pack_spectra) {
+void improveSelection(_selection_ *selection, float microshufflePix,
+		      DispDirection dispDirection, float pixelScale, long timeBudget,
+		      mt19937 *rng) {
+  map<int, Slit> pool;
+  map<int, Slit>::iterator it;
+  Graph graph;
+  vector<int> priority;
+  vector<char> placed, best;
+  int bestCounts[4];
+  int v, p, n, initial = selection->placed.size();
+
+  // All slits that could be placed on this mask
+  for (it = selection->placed.begin(); it != selection->placed.end(); it++) {
+    pool.insert(*it);
+  }
+  for (it = selection->removed.begin(); it != selection->removed.end(); it++) {
+    if ((*it).second.priority >= '0' && (*it).second.priority <= '3') pool.insert(*it);
+  }
+  for (it = selection->slits.begin(); it != selection->slits.end(); it++) {
+    if ((*it).second.priority >= '0' && (*it).second.priority <= '3') pool.insert(*it);
+  }
 
-  ifstream inFile;
+  mapConflicts(&graph, pool, microshufflePix, dispDirection, pixelScale);
+  n = graph.nodes();
+  if (n == 0) return;
 
-  // Nod and Shuffle variables.
-  banddef.binning = 0;      // Image binning value. 
-  banddef.bandSize = 0.0; // The size of each band in pixels.
-  banddef.shuffleAmt = 0.0;
-  banddef.shufflePix = 0.0; // The magnitude of the shuffling, in pixels. 
-  banddef.msSlitLen = 0.0;
-  banddef.yoffset = 0;
-  banddef.bandShuffle = false;  // bandShuffle mode flag.
-  banddef.microShuffle = false; // microShuffle mode flag. 
-  banddef.numBands = 1;
+  priority.resize(n);
+  placed.resize(n);
+  for (v = 0; v < n; v++) {
+    priority[v] = pool[graph.ids[v]].priority - '0';
+    placed[v] = selection->placed.count(graph.ids[v]);
+  }
 
-  // Slit data variables.
+  LocalSearch search(&graph, priority, placed);
+  search.deadline = chrono::steady_clock::now() + chrono::milliseconds(timeBudget);
 
-  // Useful vars for calculations:
-  int id, j;
-  float ccdW, ccdL;            // width-wise and length-wise ccd slit position
-  float slitOffsetW, slitOffsetL;
-  float slitLength, slitWidth;
-  float ccdW_orig, ccdL_orig;            // backups
-  float slitOffsetW_orig, slitOffsetL_orig;
-  float slitLength_orig, slitWidth_orig;
-  char priority;
-  float slitStart; // The length-wise pixel coordinate of the start of the slit
-  float slitEnd;   // The length-wise pixel coordinate of the end of the slit
-  float slitTop, slitBottom;
-  float bandPos;
-  string line;
-  char lineChar[512];
+  search.pushAll();
+  search.improve();
+  search.accept();
+  best = search.in;
+  for (p = 0; p < 4; p++) bestCounts[p] = search.counts[p];
 
-  // These we only need because we need to output them later:
-  float ra, dec, angle, mag, redshift;
-  char type;
-  float specPosW, specPosL; // need to be calculated 
-  //  float wlambdac, lambda1, lambda2;
-  float spec_begin; // starting position of spectrum (lower value, pixels)
-  float spec_end; // end position of spectrum (higher value, pixels)
-  
-  vector<string>bandArgs;
+  while (!search.expired()) {
+    if (!search.perturb((*rng)() % n)) continue;
+    search.improve();
 
-  // Disentangle the Nod & Shuffle parameters
-  if (bandConfig.compare("") != 0) {
-    // Split the string into words
-    bandArgs = getword(bandConfig,' ');
-    
-    banddef.binning    = atof(bandArgs[0].c_str());
-    banddef.bandSize   = atof(bandArgs[2].c_str());   // if in bandshuffle mode
-    banddef.msSlitLen  = atof(bandArgs[2].c_str());   // if in microshuffle mode
-    banddef.shufflePix = atof(bandArgs[3].c_str());
-    banddef.shuffleAmt = atof(bandArgs[4].c_str());
-    banddef.shuffleMode = bandArgs[1];
+    if (search.compare(bestCounts) < 0) {
+      search.undo();
+      continue;
+    }
 
-    if (bandArgs[1].compare("microShuffle") == 0) 
-      banddef.microShuffle = true;
-    else
-      banddef.bandShuffle = true;
+    // Equally good selections are kept, to move on from there.
+    if (search.compare(bestCounts) > 0) {
+      best = search.in;
+      for (p = 0; p < 4; p++) bestCounts[p] = search.counts[p];
+    }
+    search.accept();
+  }
 
-    if (banddef.bandShuffle) {
-      banddef.numBands = atoi(bandArgs.back().c_str());
-      j = 0;
-      while (j<banddef.numBands) {
-	bandPos = atof(bandArgs[j+5].c_str()) / banddef.binning;
-	banddef.shuffleBands.push_back(bandPos);
-	j++;
-      }
-      banddef.yoffset = atoi(bandArgs[bandArgs.size()-2].c_str());
+  // Move the slits that changed between the maps.
+  for (v = 0; v < n; v++) {
+    if (best[v] == placed[v]) continue;
+    if (best[v]) {
+      selection->placed[graph.ids[v]] = pool[graph.ids[v]];
+      selection->removed.erase(graph.ids[v]);
+      selection->slits.erase(graph.ids[v]);
     }
+    else {
+      selection->removed[graph.ids[v]] = pool[graph.ids[v]];
+      selection->placed.erase(graph.ids[v]);
+    }
+  }
 
-    banddef.shuffleUnbPx = banddef.shufflePix;
-      
-    // Convert to _binned_ pixels
-    banddef.shufflePix = banddef.shuffleAmt / pixelScale;
-    // Set shuffle magnitude for access in 'main' function;
-    banddef.shuffleMagnitude = banddef.shufflePix;
-    // shufflePix = shufflePix / binning;
-    banddef.bandSize /= banddef.binning;
+  for (p = 0; p < 4; p++) selection->numberPlaced[p] = bestCounts[p];
+  stats.searchSwaps = search.swaps;
+  stats.searchGain = selection->placed.size() - initial;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: selectMask
+*
+* RETURNS: The index of the best pass.
+*
+* DESCRIPTION: Runs options.restarts greedy passes over a mask, starting 
+*              from the slits available in 'selection', and replaces 
+*              'selection' by the best of them. The first pass is 
+*              deterministic, the others break ties at random.
+*
+* [NOTES:]: Passes are not started past the deadline (--deadline-ms),
+*           the first one always runs.
+*-
+************************************************************************
+*/
+int selectMask(_selection_ *selection, const Graph &allSlitsG, float microshufflePix,
+	       DispDirection dispDirection, float pixelScale, bool wiggle) {
+  _restarts_ restarts;
+  int best, r;
+
+  restarts.input = selection;
+  restarts.allSlitsG = &allSlitsG;
+  restarts.microshufflePix = microshufflePix;
+  restarts.dispDirection = dispDirection;
+  restarts.pixelScale = pixelScale;
+  restarts.wiggle = wiggle;
+  restarts.results.resize(options.restarts);
+  restarts.done = 0;
+  fill(restarts.best, restarts.best + 4, 0);
+
+  runParallel(options.restarts, runRestart, &restarts);
+
+  best = 0;
+  for (r = 1; r < options.restarts; r++) {
+    if (betterSelection(restarts.results[r], restarts.results[best])) best = r;
   }
 
+  swap(*selection, restarts.results[best]);
+  selection->stats.passes = restarts.done;
+
+  return best;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: runRestart
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): greedy pass 'r' over the mask in 
+*              the _restarts_ in 'context'. Pass 0 is deterministic, pass
+*              r > 0 breaks ties at random with seed options.seed + r - 1.
+*              Band shuffle masks are solved band by band (selectBands()).
+*
+* [NOTES:]: Only writes to the result of pass 'r', and under the lock
+*           to the pass count and the best counts so far, which are 
+*           reported with --progress. A pass r > 0 past the deadline is left 
+*           empty, which never beats another pass.
+*-
+************************************************************************
+*/
+void runRestart(int r, void *context) {
+  _restarts_ *work = (_restarts_ *) context;
+  _selection_ &selection = work->results[r];
+  mt19937 rng;
+  char fields[64];
 
-  inFile.open(inFileName, ios::in);
-  if (inFile.is_open()) {
-    // File has been opened correctly, begin data processing.
+  if (r > 0 && pastDeadline()) return;
 
-    vector <string> lineData;
+  selection.slits = work->input->slits;
+  selection.acqSlits = work->input->acqSlits;
 
-    // Read slits from input file.
-    while (getline(inFile, line)) {
-      // Remove leading and trailing white space, tabs, and multiple blanks:
-      stringclean(line);
-      // Parse line data.
-      lineData = stringSplit(line, " ");
-      // For some reason it seems to read beyond the end of the file producing
-      // a line with zero length, that's why there is this if condition:
-      if (lineData.size() == 16) {
-	stringToInt(lineData[0], id);
-	stringToFloat(lineData[1], ra);
-	stringToFloat(lineData[2], dec);
-	stringToFloat(lineData[9], angle);
-	stringToFloat(lineData[10], mag);
-	priority = lineData[11][0];
-	type = lineData[12][0];
-	stringToFloat(lineData[13], redshift);
-	stringToFloat(lineData[14], spec_begin);
-	stringToFloat(lineData[15], spec_end);
-
-	// Dependency on dispersion direction
-	if (dispDirection == "horizontal") {
-	  stringToFloat(lineData[3], ccdW);
-	  stringToFloat(lineData[4], ccdL);
-	  stringToFloat(lineData[5], slitOffsetW);
-	  stringToFloat(lineData[6], slitOffsetL);
-	  stringToFloat(lineData[7], slitWidth);
-	  stringToFloat(lineData[8], slitLength);
-	} else {
-	  stringToFloat(lineData[3], ccdL);
-	  stringToFloat(lineData[4], ccdW);
-	  stringToFloat(lineData[5], slitOffsetL);
-	  stringToFloat(lineData[6], slitOffsetW);
-	  stringToFloat(lineData[7], slitLength);
-	  stringToFloat(lineData[8], slitWidth);
-	}
+  if (r > 0) rng.seed(options.seed + r - 1);
 
-	// Slits have a constant length if we are in microshuffle mode.
-	if (banddef.microShuffle && priority != '0') {
-	  slitLength = banddef.msSlitLen;
-	}
+  if (banddef.bandShuffle) {
+    selectBands(&selection, *work->allSlitsG, work->microshufflePix,
+		work->dispDirection, work->pixelScale, work->wiggle, r > 0 ? &rng : 0);
+  }
+  else {
+    selectSlits(&selection, *work->allSlitsG, work->microshufflePix, work->dispDirection, 
+		work->pixelScale, work->wiggle, options.timeBudget, r > 0 ? &rng : 0);
+  }
+
+  lock_guard<mutex> guard(work->lock);
+  work->done++;
+  if (lexicographical_compare(work->best, work->best + 4, 
+			      selection.numberPlaced, selection.numberPlaced + 4)) {
+    copy(selection.numberPlaced, selection.numberPlaced + 4, work->best);
+  }
+  if (progressMask > 0) {
+    sprintf(fields, "mask=%d passes=%d/%d", progressMask, work->done, options.restarts);
+    printProgress("pass", fields, work->best);
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: selectBands
+*
+* RETURNS: none.
+*
+* DESCRIPTION: selectSlits() for band shuffle masks: the slits are split
+*              by science band (see slitBand()), and the bands are solved
+*              on their own threads, each with the conflict graph of its
+*              slits. The results are merged into 'selection'.
+*
+* [NOTES:]: Slits only conflict within a band, bands holding slits that
+*           do conflict, or that wiggling could move into conflict or 
+*           towards each other, are solved together. The greedy choices 
+*           within a band then do not depend on the other bands, so the 
+*           deterministic pass places the same slits as selectSlits() on
+*           the whole mask.
+*           Randomized passes seed each band from 'rng', in band order.
+*           The local search time is split between the bands that cannot
+*           run at the same time.
+*-
+************************************************************************
+*/
+void selectBands(_selection_ *selection, const Graph &allSlitsG,
+		 float microshufflePix, DispDirection dispDirection, float pixelScale,
+		 bool wiggle, mt19937 *rng) {
+  _bands_ work;
+  map<int, Slit>::iterator it;
+  map<int, int> group;
+  map<int, int>::iterator found;
+  vector< vector<int> > ids;
+  UnionFind sets(banddef.shuffleBands.size() + 1);
+  vector<const Slit*> rows;
+  vector< pair<float, int> > order;
+  const int *nb;
+  float maxWiggle = 0, reach;
+  int v, b, g, p, i, j, k, l, threads;
+
+  // The band of every slit still available, and the bands linked by 
+  // conflicts between their slits
+  for (it = selection->slits.begin(); it != selection->slits.end(); it++) {
+    group[(*it).first] = slitBand((*it).second);
+  }
+  for (it = selection->acqSlits.begin(); it != selection->acqSlits.end(); it++) {
+    group[(*it).first] = slitBand((*it).second);
+  }
+  for (found = group.begin(); found != group.end(); found++) {
+    v = allSlitsG.index((*found).first);
+    for (nb = allSlitsG.neighboursBegin(v); nb != allSlitsG.neighboursEnd(v); nb++) {
+      if (group.count(allSlitsG.ids[*nb]) == 1) {
+	sets.unite((*found).second, group[allSlitsG.ids[*nb]]);
+      }
+    }
+  }
 
-	// Acq Objects have to be 2.0 x 2.0 arcseconds.
-	if (priority == '0') {
-	  slitLength = 2.0;
-	  slitWidth = 2.0;
+  // Wiggling moves slits towards placed slits of any band, and a moved
+  // slit may then conflict with slits of another band. Bands holding 
+  // slits that close to each other are solved together too.
+  for (it = selection->slits.begin(); it != selection->slits.end(); it++) {
+    order.push_back(pair<float, int>((*it).second.slitStart, int(rows.size())));
+    rows.push_back(&(*it).second);
+    maxWiggle = max(maxWiggle, (*it).second.wiggleRoom);
+  }
+  for (it = selection->acqSlits.begin(); it != selection->acqSlits.end(); it++) {
+    order.push_back(pair<float, int>((*it).second.slitStart, int(rows.size())));
+    rows.push_back(&(*it).second);
+  }
+  if (maxWiggle > 0) {
+    sort(order.begin(), order.end());
+    reach = conflictReach(microshufflePix, pixelScale);
+    for (k = 0; k < int(order.size()); k++) {
+      i = order[k].second;
+      for (l = k + 1; l < int(order.size()) && 
+	     order[l].first <= rows[i]->slitEnd + rows[i]->wiggleRoom + maxWiggle + reach; l++) {
+	j = order[l].second;
+	if (rows[j]->slitStart <= rows[i]->slitEnd + rows[i]->wiggleRoom + rows[j]->wiggleRoom + reach) {
+	  sets.unite(group[rows[i]->id], group[rows[j]->id]);
 	}
+      }
+    }
+  }
+
+  // Number the groups of linked bands in band order.
+  vector<int> number(banddef.shuffleBands.size() + 1, -1);
+  for (found = group.begin(); found != group.end(); found++) {
+    b = sets.find((*found).second);
+    if (number[b] < 0) {
+      number[b] = ids.size();
+      ids.push_back(vector<int>());
+    }
+    (*found).second = number[b];
+    ids[number[b]].push_back((*found).first);
+  }
+
+  if (ids.size() < 2) {
+    selectSlits(selection, allSlitsG, microshufflePix, dispDirection, pixelScale, wiggle,
+		options.timeBudget, rng);
+    return;
+  }
+
+  work.results.resize(ids.size());
+  work.graphs.resize(ids.size());
+  work.seeds.resize(ids.size());
+  for (g = 0; g < int(ids.size()); g++) {
+    subGraph(&work.graphs[g], allSlitsG, ids[g]);
+    if (rng != 0) work.seeds[g] = (*rng)();
+  }
+  for (it = selection->slits.begin(); it != selection->slits.end(); it++) {
+    work.results[group[(*it).first]].slits.insert(*it);
+  }
+  for (it = selection->acqSlits.begin(); it != selection->acqSlits.end(); it++) {
+    work.results[group[(*it).first]].acqSlits.insert(*it);
+  }
+
+  work.microshufflePix = microshufflePix;
+  work.dispDirection = dispDirection;
+  work.pixelScale = pixelScale;
+  work.wiggle = wiggle;
+  work.randomized = rng != 0;
+
+  // The bands share the time budget of the pass: those that cannot run
+  // at the same time split it.
+  threads = (workerThread || numThreads < 1) ? 1 : min(numThreads, int(ids.size()));
+  work.timeBudget = options.timeBudget / ((ids.size() + threads - 1) / threads);
+  if (options.timeBudget > 0 && work.timeBudget == 0) work.timeBudget = 1;
+
+  runParallel(ids.size(), selectBand, &work);
+
+  // Merge the bands, in band order.
+  selection->slits.clear();
+  selection->acqSlits.clear();
+  for (p = 0; p < 4; p++) selection->numberPlaced[p] = 0;
+  memset(&selection->stats, 0, sizeof(_stats_));
+  for (g = 0; g < int(ids.size()); g++) {
+    _selection_ &band = work.results[g];
+    selection->slits.insert(band.slits.begin(), band.slits.end());
+    selection->acqSlits.insert(band.acqSlits.begin(), band.acqSlits.end());
+    selection->placed.insert(band.placed.begin(), band.placed.end());
+    selection->removed.insert(band.removed.begin(), band.removed.end());
+    for (p = 0; p < 4; p++) selection->numberPlaced[p] += band.numberPlaced[p];
+    selection->stats.updateTestsSaved += band.stats.updateTestsSaved;
+    selection->stats.updated = selection->stats.updated || band.stats.updated;
+    selection->stats.exactComponents += band.stats.exactComponents;
+    selection->stats.exactGain += band.stats.exactGain;
+    selection->stats.searchSwaps += band.stats.searchSwaps;
+    selection->stats.searchGain += band.stats.searchGain;
+    selection->stats.wiggleGain += band.stats.wiggleGain;
+    selection->stats.stopped = selection->stats.stopped || band.stats.stopped;
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: selectBand
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): selectSlits() on the slits of band
+*              (group) 'g' of the _bands_ in 'context'.
+*
+* [NOTES:]: Only writes to the result of band 'g'.
+*-
+************************************************************************
+*/
+void selectBand(int g, void *context) {
+  _bands_ *work = (_bands_ *) context;
+  mt19937 rng(work->seeds[g]);
+
+  selectSlits(&work->results[g], work->graphs[g], work->microshufflePix,
+	      work->dispDirection, work->pixelScale, work->wiggle, work->timeBudget,
+	      work->randomized ? &rng : 0);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: betterSelection
+*
+* RETURNS: True if selection 'one' is better than selection 'two'.
+*
+* DESCRIPTION: Compares the numbers of placed acquisition, priority 1, 2 
+*              and 3 slits, in that order.
+*
+* [NOTES:]: 
+*-
+************************************************************************
+*/
+bool betterSelection(const _selection_ &one, const _selection_ &two) {
+  int p;
+
+  for (p = 0; p < 4; p++) {
+    if (one.numberPlaced[p] != two.numberPlaced[p]) {
+      return one.numberPlaced[p] > two.numberPlaced[p];
+    }
+  }
+
+  return false;
+}
+
+//****************************************************************************
+// Builds the conflict graph of the slits 'ids' (sorted) from the one of
+// all slits. The graph only holds these slits, its arrays are sized by 
+// them and not by the graph of all slits.
+//****************************************************************************
+void subGraph(Graph *sub, const Graph &graph, const vector<int> &ids) {
+  vector< pair<int, int> > edges;
+  vector<int>::const_iterator id;
+  const int *nb;
+  int v;
+
+  for (id = ids.begin(); id != ids.end(); id++) {
+    v = graph.index(*id);
+    for (nb = graph.neighboursBegin(v); nb != graph.neighboursEnd(v); nb++) {
+      if (graph.ids[*nb] > *id && binary_search(ids.begin(), ids.end(), graph.ids[*nb])) {
+	edges.push_back(pair<int, int>(*id, graph.ids[*nb]));
+      }
+    }
+  }
+
+  sub->clear();
+  sub->build(ids, edges);
+}
+
+//****************************************************************************
+// subGraph() of the slits in 'slits' that are in the graph of all slits.
+//****************************************************************************
+void subGraph(Graph *sub, const Graph &graph, const map<int, Slit> &slits) {
+  map<int, Slit>::const_iterator it;
+  vector<int> ids;
+
+  ids.reserve(slits.size());
+  for (it = slits.begin(); it != slits.end(); it++) {
+    if (graph.index((*it).first) >= 0) ids.push_back((*it).first);
+  }
+  subGraph(sub, graph, ids);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: assignMasks
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Assigns the objects to 'numMasks' masks at once, by 
+*              colouring the conflict graph with one colour per mask. The
+*              acquisition slits are placed once and shared by all masks.
+*              The other objects are coloured by priority, and within a 
+*              priority in DSATUR order: the object with conflicts on the
+*              most masks first. Unlike DSATUR, ties go to the object with 
+*              the fewest conflicts, which places more objects. An object
+*              goes to the free mask with the fewest objects of its 
+*              priority. Objects without a free mask are not placed.
+*
+* [NOTES:]: 'allSlitsG' is the conflict graph of all objects. 'masks' 
+*           receives the placed slits of each mask. Past the deadline
+*           (see pastDeadline()) no more objects are coloured.
+*-
+************************************************************************
+*/
+void assignMasks(vector< map<int, Slit> > *masks, int numMasks, map<int, Slit> *slits,
+		 map<int, Slit> *acqSlits, const Graph &allSlitsG, float microshufflePix, 
+		 DispDirection dispDirection, float pixelScale) {
+  typedef pair< pair<int, int>, pair<int, int> > _key_;
+  Graph acqSlitsG;
+  map<int, Slit> placed, removed;
+  map<int, Slit>::iterator found;
+  vector<int> colour, degree, priority;
+  vector<unsigned long long> used;
+  vector< vector<int> > count;
+  set<_key_> queue;
+  unsigned long long all, free;
+  const int *nb;
+  int v, c, k, n;
+
+  // Place the acquisition slits, then drop the objects conflicting with them.
+  subGraph(&acqSlitsG, allSlitsG, *acqSlits);
+  placeSlits(acqSlits, &placed, &removed, acqSlits, &acqSlitsG,
+	     microshufflePix, dispDirection, pixelScale, 0);
+  removeConflicts(slits, &placed, &removed, allSlitsG);
+
+  n = allSlitsG.nodes();
+  colour.assign(n, -1);
+  degree.assign(n, 0);
+  priority.assign(n, 0);
+  used.assign(n, 0);
+  count.assign(numMasks, vector<int>(4, 0));
+  all = numMasks == 64 ? ~0ULL : (1ULL << numMasks) - 1;
+
+  // Objects to colour: the slits of priority 1 to 3 still available
+  for (v = 0; v < n; v++) {
+    found = slits->find(allSlitsG.ids[v]);
+    if (found == slits->end()) continue;
+    if ((*found).second.priority < '1' || (*found).second.priority > '3') continue;
+    priority[v] = (*found).second.priority - '0';
+  }
+  for (v = 0; v < n; v++) {
+    if (priority[v] == 0) continue;
+    for (nb = allSlitsG.neighboursBegin(v); nb != allSlitsG.neighboursEnd(v); nb++) {
+      if (priority[*nb] > 0) degree[v]++;
+    }
+    queue.insert(_key_(pair<int, int>(priority[v], 0), pair<int, int>(degree[v], v)));
+  }
 
-	// Make the spectra as long as the detector array to prevent packing
-	if (!pack_spectra) {
-	  spec_begin = 1.;
-	  spec_end = fov.totalwidth_spectral;
-	}
+  while (!queue.empty() && !pastDeadline()) {
+    v = (*queue.begin()).second.second;
+    queue.erase(queue.begin());
 
-	// Center of spectrum footprint (only used in the print function for debugging purposes)
-	specPosW = (spec_begin + spec_end) / 2.;
-
-	// Only used to find the slit that is most central to the mask
-	specPosL = slitOffsetL / pixelScale;
-
-	// make a backup copy (for the ODF output)
-	slitOffsetL_orig = slitOffsetL;
-	slitOffsetW_orig = slitOffsetW;
-	slitLength_orig  = slitLength;
-	slitWidth_orig   = slitWidth;
-	ccdL_orig        = ccdL;
-	ccdW_orig        = ccdW;
-
-	// Convert slit dimensions into pixels.
-	slitOffsetL /= pixelScale;
-	slitOffsetW /= pixelScale;
-	slitLength  /= pixelScale;
-	slitWidth   /= pixelScale;
-
-	// Calculate slit centers and dimensions (in pixels)
-	ccdL += slitOffsetL;
-	ccdW += slitOffsetW;
-	slitStart  = ccdL - (slitLength / 2.0);
-	slitEnd    = ccdL + (slitLength / 2.0);
-	slitTop    = ccdW + (slitWidth / 2.0);
-	slitBottom = ccdW - (slitWidth / 2.0);
-
-	if (dispDirection == "horizontal") {
-	  sprintf(lineChar,
-		  "%6d\t%10.5f\t%10.5f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%c\t%c\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\n",
-		  id, ra, dec, ccdW_orig, ccdL_orig, slitOffsetW_orig, slitOffsetL_orig, slitWidth_orig, slitLength_orig,
-		  angle, mag, priority, type, redshift, spec_begin, spec_end, slitStart, slitEnd);
-	} else {
-	  sprintf(lineChar,
-		  "%6d\t%10.5f\t%10.5f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%c\t%c\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\n",
-		  id, ra, dec, ccdL_orig, ccdW_orig, slitOffsetL_orig, slitOffsetW_orig, slitLength_orig, slitWidth_orig,
-		  angle, mag, priority, type, redshift, slitStart, slitEnd, spec_begin, spec_end);
-	}
+    free = all & ~used[v];
+    if (!free) continue;
 
-	// convert char* to string for storage.
-	// 'line' is what will be written to the ODF if this slit is chosen
-	line = lineChar;
-
-	// Add the slit to the slit list.
-	// If in band shuffling mode make sure the slit is in a band.
-	if (!banddef.bandShuffle || bandShuffleCheck(banddef.bandSize, slitLength, ccdL)) {
-	  slits->insert(pair<int, Slit>(id, 
-					Slit(id, priority, slitStart, slitEnd, slitLength, ccdL, 
-					     ccdW, slitWidth, slitTop, slitBottom, specPosL, 
-					     specPosW, angle, wiggleFactor, line, spec_begin, spec_end)));
-	}
-      }
+    // The free mask with the fewest objects of this priority
+    c = -1;
+    for (k = 0; k < numMasks; k++) {
+      if (!((free >> k) & 1ULL)) continue;
+      if (c < 0 || count[k][priority[v]] < count[c][priority[v]]) c = k;
+    }
+    colour[v] = c;
+    count[c][priority[v]]++;
+
+    // The neighbours can no longer go to this mask.
+    for (nb = allSlitsG.neighboursBegin(v); nb != allSlitsG.neighboursEnd(v); nb++) {
+      if (priority[*nb] == 0 || colour[*nb] >= 0 || ((used[*nb] >> c) & 1ULL)) continue;
+      queue.erase(_key_(pair<int, int>(priority[*nb], -__builtin_popcountll(used[*nb])),
+			pair<int, int>(degree[*nb], *nb)));
+      used[*nb] |= 1ULL << c;
+      queue.insert(_key_(pair<int, int>(priority[*nb], -__builtin_popcountll(used[*nb])),
+			 pair<int, int>(degree[*nb], *nb)));
     }
-
-    inFile.close();
-    
-    //    printf("Total number of objects available: %d\n", int(slits->size()));
-  } 
-  else {
-    printf("Unable to open input file. Exiting.\n");
-    exit(1);
   }
 
-  // Return microshuffle distance value if in microshuffle mode.
-  if (banddef.microShuffle) {
-    return banddef.shufflePix;
-  } 
-  else {
-    return 0;
+  masks->assign(numMasks, placed);
+  for (v = 0; v < n; v++) {
+    if (colour[v] >= 0) (*masks)[colour[v]][allSlitsG.ids[v]] = (*slits)[allSlitsG.ids[v]];
   }
 }
 
 /*
 ************************************************************************
 *+
-* FUNCTION: getSlits
+* FUNCTION: refineMasks
 *
-* RETURNS: A vector<Slit> of Slit objects
+* RETURNS: none.
 *
-* DESCRIPTION: Scans vector<Slit> 'slitData' for slits of 'priority',
-*               and returns a vector<Slit> of those found objects.
+* DESCRIPTION: The local search (--time-budget-ms) and the wiggling of 
+*              selectSlits() for the masks of a joint assignment, one 
+*              mask after the other. The candidates are the objects of 
+*              'slits' on no mask; those placed on a mask are no longer
+*              offered to the following ones, those the local search 
+*              takes off a mask are.
 *
-* [NOTES:]: O(n)
+* [NOTES:]: Stops at the deadline (see pastDeadline()).
 *-
 ************************************************************************
 */
-map<int, Slit> getSlits(map<int, Slit> slitData, char priority) {
-  char prioCur;
-  map<int, Slit> foundSlits;
-  map<int, Slit>::iterator it; // Iterator object.
+void refineMasks(vector< map<int, Slit> > *masks, const map<int, Slit> &slits,
+		 float microshufflePix, DispDirection dispDirection, float pixelScale,
+		 bool wiggle) {
+  _selection_ selection;
+  map<int, Slit> free, before;
+  map<int, Slit>::const_iterator it;
+  mt19937 perturbations(options.seed);
+  int k;
+
+  if (options.timeBudget <= 0 && !wiggle) return;
+
+  for (it = slits.begin(); it != slits.end(); it++) {
+    if ((*it).second.priority >= '1' && (*it).second.priority <= '3') free.insert(*it);
+  }
+  for (k = 0; k < int(masks->size()); k++) {
+    for (it = (*masks)[k].begin(); it != (*masks)[k].end(); it++) free.erase((*it).first);
+  }
 
-  // Loop through 'slit' container to find slits of the given prio.
-  for (it = slitData.begin(); it != slitData.end(); it++) {
-    prioCur = (*it).second.priority;
+  for (k = 0; k < int(masks->size()) && !pastDeadline(); k++) {
+    before = (*masks)[k];
+    selection.slits.clear();
+    selection.placed.swap((*masks)[k]);
+    selection.removed = free;
 
-    if (prioCur == priority) {
-      // Found a slit, insert into 'foundSlits' container. 
-      foundSlits.insert(pair<int, Slit>((*it).first, Slit((*it).second)));
+    if (options.timeBudget > 0) {
+      improveSelection(&selection, microshufflePix, dispDirection, pixelScale,
+		       options.timeBudget, &perturbations);
+    }
+    if (wiggle) {
+      wiggleUnplaced(&selection.slits, &selection.placed, &selection.removed,
+		     microshufflePix, dispDirection, pixelScale);
     }
-  }
 
-  return foundSlits;
+    for (it = before.begin(); it != before.end(); it++) {
+      if (selection.placed.count((*it).first) == 0) free.insert(*it);
+    }
+    for (it = selection.placed.begin(); it != selection.placed.end(); it++) {
+      free.erase((*it).first);
+    }
+    (*masks)[k].swap(selection.placed);
+  }
 }
 
 /*
 ************************************************************************
 *+
-* FUNCTION: mapConflicts
+* FUNCTION: writeMask
 *
-* RETURNS: A Graph object conflict map.
+* RETURNS: none.
 *
-* DESCRIPTION: Maps all conflicts in 'slitData' into 'conflicts' Graph.
+* DESCRIPTION: Task for runParallel(): expands the slits of mask 'k' of 
+*              the _masks_ in 'context' (Max-Sky mode) and writes its ODF.
 *
-* [NOTES:]: Two slits conflict when the spectra of these two slits 
-*            overlap. Conflicts between slits are represented in the 
-*            graph edges between the conflicting slits.
-*            O(n^2) <
+* [NOTES:]: Only changes mask 'k'.
 *-
 ************************************************************************
 */
-void mapConflicts(Graph * slitConflicts, map<int, Slit> slitData,
-		  float microshufflePix, string dispDirection, float pixelScale) {
+void writeMask(int k, void *context) {
+  _masks_ *work = (_masks_ *) context;
+  map<int, Slit> &placed = (*work->masks)[k];
+  char outFile[256];
+  ofstream outStream;
 
-  map<int, Slit>::iterator slitOne; // Iterator object.
-  map<int, Slit>::iterator slitTwo;
+  maskFileName(outFile, sizeof(outFile), work->outFileRoot, 0, k + 1);
+  outStream.open(outFile);
+  initOutputFile(outFile, outStream, work->dispDirection, work->pixelScale, 
+		 work->det_img, work->det_spec, work->ra_imag, work->dec_imag);
 
-  // Add nodes to conflict graph.
-  for (slitOne = slitData.begin(); slitOne != slitData.end(); slitOne++) {
-    slitConflicts->addNode((*slitOne).second.id);
+  if (work->slitMode == 'M' && work->microshufflePix == 0) {
+    maxSlitMode(placed, work->pixelScale);
   }
 
-  // Search for conflicts between slits.
-  for (slitOne = slitData.begin(); 1; slitOne++) {
-
-    // Point slitTwo iterator at the position after slitOne.
-    slitTwo = slitData.begin();
-    while ((*slitTwo).first <= (*slitOne).first && slitTwo != slitData.end()) {
-      slitTwo++;
-    }
-
-    // This means we're at the end of the data, exit loop.
-    if (slitTwo == slitData.end())
-      break;
-
-    // See if data at slitOne conflicts with the remaining slits.
-    for (; slitTwo != slitData.end(); slitTwo++) {
-      if (conflicts((*slitOne).second, (*slitTwo).second, 
-		    microshufflePix, dispDirection, pixelScale)) {
-	slitConflicts->addEdge(slitConflicts->getNode((*slitOne).first), 
-			       slitConflicts->getNode((*slitTwo).first));
-      }
-    }
-  }
+  writeSlits(placed, outStream, work->dispDirection);
+  outStream.close();
 }
 
 /*
@@ -942,57 +3900,88 @@ void mapConflicts(Graph * slitConflicts, map<int, Slit> slitData,
 *+
 * FUNCTION: placeSlits
 *
-* RETURNS: none.
+* RETURNS: False if the deadline stopped the placement, true otherwise.
 *
 * DESCRIPTION: Select slits to place on the ODF. 
 *
-* [NOTES:]:
+* [NOTES:]: Of the slits with the least conflicts, the one closest to the
+*           center of the field of view is placed first. If 'rng' is given
+*           the choice among them is random instead. Past the deadline
+*           (see pastDeadline()) no more slits are placed, except 
+*           acquisition objects; the slits placed so far do not conflict.
 *-
 ************************************************************************
 */
 
-void placeSlits(map<int, Slit> *slits, map<int, Slit> *placed,
+bool placeSlits(map<int, Slit> *slits, map<int, Slit> *placed,
 		map<int, Slit> *removed, map<int, Slit> *current,
 		Graph *conflictGraph, float microshufflePix,
-		string dispDirection, float pixelScale) {
+		DispDirection dispDirection, float pixelScale, mt19937 *rng) {
 
-  GraphNode *slitNode;
-
-  vector<int> conflictList;
-  vector<int> minDegSlits;
+  vector<int> distance;
+  vector<int> moved;
+  vector<int> excluded;
   vector<int>::iterator it;
+  const int *nb;
   map<int, Slit>::iterator slitIterator;
   Slit slit;
-  int sid;
+  long rebuildTests = -1;
+  int sid, node, i;
+
+  // Distance of each slit's spectrum from the center of the field of view.
+  // Only placed slits are wiggled, so these do not change while placing.
+  // Randomized passes use random keys instead.
+  distance.assign(conflictGraph->nodes(), 0);
+  for (i = 0; i < conflictGraph->nodes(); i++) {
+    if (!conflictGraph->alive[i]) continue;
+    if (rng != 0)
+      distance[i] = (*rng)() >> 1;
+    else
+      distance[i] = spectrumDistance((*slits)[conflictGraph->ids[i]], 
+				     fov.illumarea_spatial_center);
+  }
+
+  // The next slit to place is the one with the least conflicts, and of
+  // those the one with the smallest key.
+  DegreeQueue queue(*conflictGraph, distance);
+
+  // Solve the small connected sub-graphs exactly, and drop the slits that
+  // are not part of their best selection.
+  solveComponents(*conflictGraph, distance, &excluded);
+  for (it = excluded.begin(); it != excluded.end(); it++) {
+    queue.removeNode(*conflictGraph, *it);
+    removeSlit(conflictGraph->ids[*it], slits, removed);
+  }
+
+  // Finds the slits that may conflict with a wiggled slit
+  SlitTable index((*current), conflictReach(microshufflePix, pixelScale));
 
   // Place slits until conflict graph is empty.
-  // NOTE: this could be more efficient. 
   while (!conflictGraph->empty()) {
-    // Gather cardinality list.
-    minDegSlits = conflictGraph->getMinDegree();
-
-    // Find slit with max spectrum.
-    sid = findMaxSpectrumSid(&minDegSlits, slits, fov.illumarea_spatial_center);
+    node = queue.top();
+    sid = conflictGraph->ids[node];
+    if ((*slits)[sid].priority != '0' && pastDeadline()) return false;
 
     (*placed)[sid] = (*slits)[sid];
 
     // Remove conflicting slits.
-    slitNode = conflictGraph->getNode(sid);
-    conflictList = (*slitNode).getList();
-
-    // Only remove slits if not acquisition stars
-    for (it = conflictList.begin(); it != conflictList.end(); it++) {
-      conflictGraph->removeNode((*it));
-      removeSlit((*it), slits, removed);
+    for (nb = conflictGraph->neighboursBegin(node); nb != conflictGraph->neighboursEnd(node); nb++) {
+      if (!conflictGraph->alive[*nb]) continue;
+      queue.removeNode(*conflictGraph, *nb);
+      removeSlit(conflictGraph->ids[*nb], slits, removed);
     }
 
-    // Remove references to the placed node within the conflictGraph.
-    conflictGraph->removeNode(sid);
+    // Remove the placed node from the conflictGraph.
+    queue.removeNode(*conflictGraph, node);
 
     // Try to cozy the placed slit into its neighbors, if allowed.    
-    if (wiggleNear(sid, slits, placed, pixelScale, dispDirection)) {
-      // If we've wiggled then update the conflict graph.
-      mapConflicts(conflictGraph, (*current), microshufflePix, dispDirection, pixelScale);
+    moved.clear();
+    if (wiggleNear(sid, slits, placed, pixelScale, &moved)) {
+      // If we've wiggled then update the conflict graph. Counted once: 
+      // what mapConflicts() would test to rebuild it.
+      if (rebuildTests < 0) rebuildTests = index.pairs();
+      updateConflicts(conflictGraph, &queue, index, rebuildTests, moved, slits, placed, 
+		      removed, microshufflePix, dispDirection, pixelScale);
     }
   }
 
@@ -1000,11 +3989,310 @@ void placeSlits(map<int, Slit> *slits, map<int, Slit> *placed,
   for (slitIterator = (*placed).begin(); slitIterator != (*placed).end();
        slitIterator++) {
     slit = (*slitIterator).second;
-    wiggleNear(slit.id, slits, placed, pixelScale, dispDirection);
+    wiggleNear(slit.id, slits, placed, pixelScale, 0);
   }
-  
+
+  return true;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: updateConflicts
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Updates a conflict graph after the placed slits in 'moved'
+*              have been wiggled. Only the candidates the index finds close
+*              to the new positions are re-tested; those that now conflict
+*              with a moved slit cannot be placed any more and are removed,
+*              which patches the degrees of their neighbours in place.
+*              'rebuildTests' is the number of pairs a rebuild with 
+*              mapConflicts() would test, for the statistics.
+*
+* [NOTES:]: wiggleNear only moves placed slits, so the candidates in the
+*           graph keep the positions the index was built from.
+*-
+************************************************************************
+*/
+void updateConflicts(Graph *conflictGraph, DegreeQueue *queue, const SlitTable &index,
+		     long rebuildTests, const vector<int> &moved, map<int, Slit> *slits, map<int, Slit> *placed,
+		     map<int, Slit> *removed, float microshufflePix, DispDirection dispDirection,
+		     float pixelScale) {
+  vector<int> found;
+  vector<int>::const_iterator it, other;
+  map<int, Slit>::iterator one, two;
+  SlitBlock block;
+  long tests = 0;
+  int node, k;
+  unsigned mask;
+
+  for (it = moved.begin(); it != moved.end(); it++) {
+    one = (*placed).find(*it);
+    if (one == (*placed).end()) continue;
+
+    // A moved slit may stand anywhere in the index, so re-evaluate it
+    // against its new neighbourhood.
+    found.clear();
+    index.query((*one).second.slitStart, (*one).second.slitEnd, found);
+
+    for (other = found.begin(); other != found.end(); other++) {
+      if (*other != *it) {
+	node = conflictGraph->index(*other);
+	two = (*slits).find(*other);
+	if (node >= 0 && conflictGraph->alive[node] && two != (*slits).end()) {
+	  block.add((*two).second);
+	}
+      }
+      if (!block.full() && other + 1 != found.end()) continue;
+      if (block.size == 0) continue;
+
+      // Test the block, and drop the candidates that now conflict
+      tests += block.size;
+      mask = conflictMask((*one).second, block.columns(), block.size, 
+			  microshufflePix, dispDirection, pixelScale);
+      for (k = 0; k < block.size; k++) {
+	if (mask & (1u << k)) {
+	  queue->removeNode(*conflictGraph, conflictGraph->index(block.id[k]));
+	  removeSlit(block.id[k], slits, removed);
+	}
+      }
+      block.size = 0;
+    }
+  }
+
+  // A rebuild tests the pairs the sweep of mapConflicts() finds
+  stats.updateTestsSaved += max(0L, rebuildTests - tests);
+  stats.updated = true;
+}
+
+// Work shared between the threads solving conflict sub-graphs
+typedef struct {
+  const Graph *graph;
+  const vector<int> *key;
+  vector< vector<int> > components;
+  // Per sub-graph: the nodes left out of the exact selection, and how many
+  // more slits it holds than the greedy one
+  vector< vector<int> > excluded;
+  vector<int> gain;
+} _components_;
+
+/*
+************************************************************************
+*+
+* FUNCTION: solveComponents
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Splits the alive part of a conflict graph into connected
+*              sub-graphs, and solves those with 2 to EXACT_MAX_NODES nodes
+*              exactly, in parallel. For every sub-graph where the exact 
+*              selection holds more slits than the greedy one, the nodes 
+*              left out of it are returned in 'excluded'.
+*
+* [NOTES:]: The greedy selection of a sub-graph is the one placeSlits() 
+*           makes, given the same distance 'key'. Where it is already 
+*           optimal nothing is excluded, so the placement is unchanged.
+*-
+************************************************************************
+*/
+void solveComponents(const Graph &graph, const vector<int> &key, vector<int> *excluded) {
+  _components_ work;
+  map<int, int> component;
+  map<int, int>::iterator found;
+  UnionFind sets(graph.nodes());
+  const int *nb;
+  int i, c, root;
+
+  excluded->clear();
+
+  for (i = 0; i < graph.nodes(); i++) {
+    if (!graph.alive[i]) continue;
+    for (nb = graph.neighboursBegin(i); nb != graph.neighboursEnd(i); nb++) {
+      if (*nb > i && graph.alive[*nb]) sets.unite(i, *nb);
+    }
+  }
+
+  // Group the nodes by sub-graph, in order of their lowest node.
+  for (i = 0; i < graph.nodes(); i++) {
+    if (!graph.alive[i]) continue;
+    root = sets.find(i);
+    found = component.find(root);
+    if (found == component.end()) {
+      found = component.insert(pair<int, int>(root, work.components.size())).first;
+      work.components.push_back(vector<int>());
+    }
+    work.components[(*found).second].push_back(i);
+  }
+
+  // Single slits and large sub-graphs are left to the greedy selection.
+  for (c = work.components.size() - 1; c >= 0; c--) {
+    if (work.components[c].size() < 2 || 
+	work.components[c].size() > (size_t) EXACT_MAX_NODES) {
+      work.components.erase(work.components.begin() + c);
+    }
+  }
+
+  work.graph = &graph;
+  work.key = &key;
+  work.excluded.resize(work.components.size());
+  work.gain.assign(work.components.size(), 0);
+
+  runParallel(work.components.size(), solveComponent, &work);
+
+  // Collect the results in sub-graph order, independent of the threads.
+  stats.exactComponents += work.components.size();
+  for (c = 0; c < (int) work.components.size(); c++) {
+    stats.exactGain += work.gain[c];
+    excluded->insert(excluded->end(), work.excluded[c].begin(), work.excluded[c].end());
+  }
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: solveComponent
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Task for runParallel(): solves sub-graph 'c' of the 
+*              _components_ in 'context' exactly.
+*
+* [NOTES:]: Only writes to the results of sub-graph 'c'.
+*-
+************************************************************************
+*/
+void solveComponent(int c, void *context) {
+  _components_ *work = (_components_ *) context;
+  const vector<int> &members = work->components[c];
+  unsigned long long greedy;
+  int i, greedySize;
+
+  IndependentSet set(*work->graph, members, *work->key);
+
+  greedy = set.greedy();
+  greedySize = __builtin_popcountll(greedy);
+  set.exact();
+
+  if (set.bestSize <= greedySize) return;
+
+  work->gain[c] = set.bestSize - greedySize;
+  for (i = 0; i < set.n; i++) {
+    if (!((set.best >> i) & 1ULL)) work->excluded[c].push_back(members[i]);
+  }
+}
+
+// Shared by the threads of runParallel()
+static void parallelWorker(atomic<int> *next, int count, float minSpecDist,
+			   atomic<long> *tests, void (*task)(int, void*), void *context) {
+  int i;
+
+  workerThread = true;
+  MIN_SPEC_DIST = minSpecDist;
+  while ((i = (*next)++) < count) {
+    task(i, context);
+  }
+  (*tests) += conflictTests;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: runParallel
+*
+* RETURNS: none.
+*
+* DESCRIPTION: Runs task(i, context) for i = 0 ... count-1 on up to 
+*              numThreads threads. Returns when all tasks are done.
+*              Called from a worker thread, the tasks run in that thread.
+*
+* [NOTES:]: Tasks are handed out in order, but may finish in any order; 
+*           they must not write to shared data. The threads start with
+*           the MIN_SPEC_DIST of the caller, and their conflict tests are
+*           counted as the caller's (conflictTests).
+*-
+************************************************************************
+*/
+void runParallel(int count, void (*task)(int, void*), void *context) {
+  vector<thread> workers;
+  atomic<int> next(0);
+  atomic<long> tests(0);
+  int i, threads;
+
+  threads = numThreads < count ? numThreads : count;
+
+  if (threads <= 1 || workerThread) {
+    for (i = 0; i < count; i++) task(i, context);
+    return;
+  }
+
+  for (i = 0; i < threads; i++) {
+    workers.push_back(thread(parallelWorker, &next, count, MIN_SPEC_DIST, &tests, 
+			     task, context));
+  }
+  for (i = 0; i < threads; i++) {
+    workers[i].join();
+  }
+  conflictTests += tests;
+}
+
+//****************************************************************************
+// True once the run is past its deadline (--deadline-ms), or was asked to
+// stop with SIGUSR1.
+//****************************************************************************
+bool pastDeadline() {
+  if (stopRequested) return true;
+  return options.deadline > 0 && chrono::steady_clock::now() >= runDeadline;
+}
+
+//****************************************************************************
+// SIGUSR1 handler: the run stops searching and writes the masks placed so
+// far (e.g. the 'Stop' button of gmmps_spoc.tcl).
+//****************************************************************************
+void requestStop(int) {
+  stopRequested = true;
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: printProgress
+*
+* RETURNS: none.
+*
+* DESCRIPTION: With --progress, prints a line 
+*              '@PROGRESS <phase> <fields> placed=a,p1,p2,p3 score=S ms=T'
+*              and flushes stdout, for gmmps_spoc.tcl to show while the 
+*              masks are designed. 'numberPlaced' holds the slits placed 
+*              per priority 0-3, or is 0 to leave out placed and score.
+*              The score weighs priorities 1-3 by PRIORITY_WEIGHTS, T is 
+*              the time since the start of the run.
+*
+* [NOTES:]: Phases: 'conflicts' (the conflict graph is ready), 'pass' (a 
+*           greedy pass is done, with the best counts of the mask so far),
+*           'mask' (a mask is done) and 'done'.
+*-
+************************************************************************
+*/
+void printProgress(const char *phase, const string &fields, const int *numberPlaced) {
+  long ms;
+
+  if (!options.progress) return;
+
+  ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - 
+						   runStart).count();
+  printf("@PROGRESS %s", phase);
+  if (!fields.empty()) printf(" %s", fields.c_str());
+  if (numberPlaced != 0) {
+    printf(" placed=%d,%d,%d,%d score=%g", numberPlaced[0], numberPlaced[1], 
+	   numberPlaced[2], numberPlaced[3], PRIORITY_WEIGHTS[0] * numberPlaced[1] +
+	   PRIORITY_WEIGHTS[1] * numberPlaced[2] + PRIORITY_WEIGHTS[2] * numberPlaced[3]);
+  }
+  printf(" ms=%ld\n", ms);
+  fflush(stdout);
 }
 
+
 /*
 ************************************************************************
 *+
@@ -1018,21 +4306,22 @@ void placeSlits(map<int, Slit> *slits, map<int, Slit> *placed,
 *-
 ************************************************************************
 */
-bool checkConflicts(Slit test, Slit except, map<int, Slit> slits,
-		    float msPix, string dispDirection, float pixelScale) {
-  map<int, Slit>::iterator slitIterator;
-  Slit test2;
+bool checkConflicts(const Slit &test, const Slit &except, const map<int, Slit> &slits,
+		    float msPix, DispDirection dispDirection, float pixelScale) {
+  map<int, Slit>::const_iterator slitIterator;
+  SlitBlock block;
 
   for (slitIterator = slits.begin(); slitIterator != slits.end();
        slitIterator++) {
-    test2 = (*slitIterator).second;
-    if (test2.id != except.id &&
-	conflicts(test, test2, msPix, dispDirection, pixelScale)) {
-      return true;
+    if ((*slitIterator).second.id != except.id) block.add((*slitIterator).second);
+    if (block.full()) {
+      if (conflictMask(test, block.columns(), block.size, msPix, dispDirection, pixelScale))
+	return true;
+      block.size = 0;
     }
   }
 
-  return false;
+  return conflictMask(test, block.columns(), block.size, msPix, dispDirection, pixelScale) != 0;
 }
 
 
@@ -1046,14 +4335,17 @@ bool checkConflicts(Slit test, Slit except, map<int, Slit> slits,
 * DESCRIPTION: If in 'Max_Opt' mode, we expand slits to fill empty 
 *              space, this is what this function does. 
 *
-* [NOTES:]:
+* [NOTES:]: The slits grow by 1 pixel per round until they lock, but only
+*           the rounds in which a slit can lock are made one at a time 
+*           (see safeRounds()). Each slit is only compared with the slits
+*           whose spectra overlap with its own. Past the deadline (see 
+*           pastDeadline()) the slits stop growing after the current round.
 *-
 ************************************************************************
 */
-void maxSlitMode(map<int, Slit> &placed, float pixelScale, string dispDirection) {
+void maxSlitMode(map<int, Slit> &placed, float pixelScale) {
 
   map<int, Slit>::iterator slit1;
-  map<int, Slit>::iterator slit2;
 
   // Initiate the lock flags
   for (slit1 = placed.begin(); slit1 != placed.end(); slit1++) {
@@ -1073,99 +4365,125 @@ void maxSlitMode(map<int, Slit> &placed, float pixelScale, string dispDirection)
   }
 
   // Slits must be contained within science bands
-  // Calculate more restrictive boundaries than the slit placement area
-  if (banddef.shuffleBands.size() != 0) {
-    // loop over slits
-    for (slit1 = placed.begin(); slit1 != placed.end(); slit1++) {
-      // loop over bands
-      for (unsigned int bandIndex = 0; bandIndex < banddef.shuffleBands.size(); bandIndex++) {
-	float bandStart = banddef.shuffleBands[bandIndex];
-	float bandEnd = bandStart + banddef.shuffleMagnitude;
-	// slitStart and slitEnd must obey the band
-	// At this point, slits are definitely within a science band,
-	// so case distinctions are easy:
-	if ((*slit1).second.slitStart >= bandStart && (*slit1).second.slitEnd <= bandEnd) {
-	  // slit within band.
-	  // Pick whatever is more conservative (slit placement area border or band, diagonal GMOS cutoffs, barcode)
-	  (*slit1).second.slitFovMin = ((*slit1).second.slitFovMin > bandStart) ? (*slit1).second.slitFovMin : bandStart;
-	  (*slit1).second.slitFovMax = ((*slit1).second.slitFovMax < bandEnd) ? (*slit1).second.slitFovMax : bandEnd;
-	}
+  for (slit1 = placed.begin(); slit1 != placed.end(); slit1++) {
+    limitSlitToBand((*slit1).second);
+  }
+  
+  // The spectral neighbours of each slit (sorted by specStart, so that
+  // only overlapping spectra are visited), split into those above and
+  // below it. Gaps between slits only shrink, so slits that are not 
+  // clear of slit1 now can never lock it.
+  vector<Slit*> rows;
+  vector< pair<float, int> > order;
+  vector< vector<int> > above, below;
+  int i, j, k, n;
+
+  for (slit1 = placed.begin(); slit1 != placed.end(); slit1++) {
+    order.push_back(pair<float, int>((*slit1).second.specStart, int(rows.size())));
+    rows.push_back(&(*slit1).second);
+  }
+  n = int(rows.size());
+  above.resize(n);
+  below.resize(n);
+  sort(order.begin(), order.end());
+  for (k = 0; k < n; k++) {
+    i = order[k].second;
+    for (int l = k + 1; l < n && order[l].first <= rows[i]->specEnd; l++) {
+      j = order[l].second;
+      if (rows[j]->slitStart - rows[i]->slitEnd > 0) {
+	above[i].push_back(j);
+	below[j].push_back(i);
+      }
+      else if (rows[i]->slitStart - rows[j]->slitEnd > 0) {
+	below[i].push_back(j);
+	above[j].push_back(i);
       }
     }
   }
-  
-  // Compare each slit with all other slits, to see if it can be expanded.
-  // If yes, expand.
-  float d1, d2;
-  bool expanded1 = true, expanded2 = true;
-  int counter = 1;
-  while (expanded1 || expanded2) {
-    expanded1 = false;
-    expanded2 = false;
-
-    for (slit1 = placed.begin(); slit1 != placed.end(); slit1++) {
-      // skip this slit if already fully locked
-      if ((*slit1).second.locked_up && (*slit1).second.locked_down) continue;
-
-      for (slit2 = placed.begin(); slit2 != placed.end(); slit2++) {
-
-	// Do not compare slit with itself
-	if (slit1 == slit2) continue;
-
-	// Does the spectrum of slit2 overlap in the spatial direction with the
-	// spectrum of slit1, i.e. does it constrain the expansion of slit1?
-	// If not, skip slit2
-	if ((*slit1).second.specEnd < (*slit2).second.specStart || 
-	    (*slit2).second.specEnd < (*slit1).second.specStart) continue;
-	
-	// Check if space between slit1 and slit2 is sufficient to expand slit 1
-	d1 = (*slit2).second.slitStart - (*slit1).second.slitEnd; // > 0: slit2 above slit1
-	d2 = (*slit1).second.slitStart - (*slit2).second.slitEnd; // > 0: slit1 above slit2
-	//	if ((*slit1).first == 34 && (*slit2).first == 35) 
-	//  cout << d1 << " " << d2 << endl;
-
-	// Lock slit1 upwards/downwards if within 1 pixel of the min separation
-	// or the slit placement area boundary (or storage bands)
-	if ((d1 > 0 && d1 < MIN_SPEC_DIST / pixelScale + 1.) ||
-	    (*slit1).second.slitEnd >= (*slit1).second.slitFovMax - 1.) {
-	  (*slit1).second.locked_up = true;
+
+  // Each slit grows by 1 pixel per round in each direction that is not
+  // locked. It locks within 1 pixel of the min separation to a neighbour
+  // or of the slit placement area boundary (or storage bands). 
+  // Rounds in which no slit can lock are skipped in one go; the others are
+  // made one by one, in the order of the slit ids, as they decide how the
+  // space between two slits is shared.
+  double minGap = MIN_SPEC_DIST / pixelScale + 1.;
+  bool expanded = true;
+  int rounds = 0, skip;
+
+  while (expanded) {
+    // Rounds until the first lock can happen (one less, for rounding)
+    skip = MAX_EXPAND_ROUNDS - 1 - rounds;
+    for (i = 0; i < n; i++) {
+      if (!rows[i]->locked_up) {
+	skip = min(skip, safeRounds(rows[i]->slitFovMax - 1. - rows[i]->slitEnd, 1));
+	for (k = 0; k < int(above[i].size()); k++) {
+	  j = above[i][k];
+	  skip = min(skip, safeRounds(rows[j]->slitStart - rows[i]->slitEnd - minGap,
+				      rows[j]->locked_down ? 1 : 2));
 	}
-	if ((d2 > 0 && d2 < MIN_SPEC_DIST / pixelScale + 1.) ||
-	    (*slit1).second.slitStart <= (*slit1).second.slitFovMin + 1.) {
-	  (*slit1).second.locked_down = true;
+      }
+      if (!rows[i]->locked_down) {
+	skip = min(skip, safeRounds(rows[i]->slitStart - rows[i]->slitFovMin - 1., 1));
+	for (k = 0; k < int(below[i].size()); k++) {
+	  j = below[i][k];
+	  skip = min(skip, safeRounds(rows[i]->slitStart - rows[j]->slitEnd - minGap,
+				      rows[j]->locked_up ? 1 : 2));
 	}
+      }
+    }
+    for (i = 0; i < n; i++) {
+      for (k = 0; k < skip; k++) {
+	if (!rows[i]->locked_up)   rows[i]->slitEnd   += 1.;
+	if (!rows[i]->locked_down) rows[i]->slitStart -= 1.;
+      }
+    }
+    rounds += skip;
 
-	// Leave inner for loop when both directions are locked
-	if ((*slit1).second.locked_up == true && (*slit1).second.locked_down == true &&
-	    ((*slit1).first == 34 || (*slit1).first == 35)) {
-	  //	  cout << (*slit1).first << " locked in counter " << counter << endl;
-	  break;
+    // One round
+    expanded = false;
+    for (i = 0; i < n; i++) {
+      Slit &slit = *rows[i];
+
+      // skip this slit if already fully locked
+      if (slit.locked_up && slit.locked_down) continue;
+
+      if (!slit.locked_up) {
+	if (slit.slitEnd >= slit.slitFovMax - 1.) slit.locked_up = true;
+	for (k = 0; k < int(above[i].size()) && !slit.locked_up; k++) {
+	  float d1 = rows[above[i][k]]->slitStart - slit.slitEnd;
+	  if (d1 > 0 && d1 < minGap) slit.locked_up = true;
+	}
+      }
+      if (!slit.locked_down) {
+	if (slit.slitStart <= slit.slitFovMin + 1.) slit.locked_down = true;
+	for (k = 0; k < int(below[i].size()) && !slit.locked_down; k++) {
+	  float d2 = slit.slitStart - rows[below[i][k]]->slitEnd;
+	  if (d2 > 0 && d2 < minGap) slit.locked_down = true;
 	}
       }
 
-      // Expand slit1 by 1 pixel if not locked
-      if (!(*slit1).second.locked_up) {
-	(*slit1).second.slitEnd += 1.;
-	expanded1 = true;
-	//	cout << "expanding " << (*slit1).first << " up" << endl;
+      // Expand slit by 1 pixel if not locked
+      if (!slit.locked_up) {
+	slit.slitEnd += 1.;
+	expanded = true;
       }
-      if (!(*slit1).second.locked_down) {
-	(*slit1).second.slitStart -= 1.;
-	expanded2 = true;
-	// cout << "expanding " << (*slit1).first << " down" << endl;
+      if (!slit.locked_down) {
+	slit.slitStart -= 1.;
+	expanded = true;
       }
     }
 
     // Failsafe, we certainly don't have more than 10000 pixel available
-    if (counter++ == 10000) {
-      expanded1 = false;
-      expanded2 = false;
-    }
+    if (++rounds >= MAX_EXPAND_ROUNDS) break;
+
+    // Past the deadline the slits keep the length they have
+    if (pastDeadline()) break;
   }
   
-  // Update the output lines
+  // Update the output values
   for (slit1 = placed.begin(); slit1 != placed.end(); slit1++) {
-    maxOptProcessLine(placed, (*slit1).first, dispDirection, pixelScale);
+    maxOptResize((*slit1).second, pixelScale);
   }
 }
 
@@ -1186,162 +4504,95 @@ void maxSlitMode(map<int, Slit> &placed, float pixelScale, string dispDirection)
 */
 
 void expandSlitToFOV(Slit &slit) {
-  
-  float obj_spec_pos = slit.ccdW;
-  float obj_spat_pos = slit.ccdL;
-
-  // Calculate all possible intercepts with the bounding fov polygon
-  vector<float> intercept = calc_intercept(obj_spec_pos);
-
-  int i;
-  int nvert = intercept.size();
-  vector<float> diff(nvert,0);
-  vector<float> tmp;
-
-  // For vertical slits (horizontal dispersion), and a start (end) slit, the relevant
-  // intercepts are all below (above) the spatial position of the slit. We just need to find the 
-  // one that is closest. Likewise for horizontal start (end) slits, we must find the closest
-  // intercept to the left (right). The code is symmetric and we don't need to distinguish
-  // between dispersion direction.
-
-  for (i=0; i<nvert; i++) {
-    diff[i] = intercept[i] - obj_spat_pos;
-  }
+  // The field of view boundaries closest to the object along the slit,
+  // at its position along the dispersion direction. The code is the same
+  // for both dispersion directions.
+  slit.slitFovMin = fov.illumarea_spatial_min;
+  slit.slitFovMax = fov.illumarea_spatial_max;
+  fov.slabs.limits(slit.ccdW, slit.ccdL, &slit.slitFovMin, &slit.slitFovMax);
+}
 
-  // Lower limit: keep negative numbers only and find the largest thereof
-  float max = -1.e9;
-  int max_index = 0;
-  for (i=0; i<nvert; i++) {
-    if (diff[i] < 0. && diff[i] > max) {
-      max = diff[i];
-      max_index = i;
-    }
-  }
-  slit.slitFovMin = intercept[max_index];
 
-  // Upper limit: keep positive numbers only and find the smallest thereof
-  float min = 1.e9;
-  int min_index = 0;
-  for (i=0; i<nvert; i++) {
-    if (diff[i] > 0. && diff[i] < min) {
-      min = diff[i];
-      min_index = i;
+/*
+************************************************************************
+*+
+* FUNCTION: limitSlitToBand
+*
+* RETURNS: none.
+*
+* DESCRIPTION: In band shuffle mode, restricts the limits set by 
+* expandSlitToFOV() to the science band holding the slit.
+*
+* [NOTES:]: Used in Max Mode and when wiggling.
+*-
+************************************************************************
+*/
+void limitSlitToBand(Slit &slit) {
+  // loop over bands
+  for (unsigned int bandIndex = 0; bandIndex < banddef.shuffleBands.size(); bandIndex++) {
+    float bandStart = banddef.shuffleBands[bandIndex];
+    float bandEnd = bandStart + banddef.shuffleMagnitude;
+    // slitStart and slitEnd must obey the band
+    // At this point, slits are definitely within a science band,
+    // so case distinctions are easy:
+    if (slit.slitStart >= bandStart && slit.slitEnd <= bandEnd) {
+      // slit within band.
+      // Pick whatever is more conservative (slit placement area border or band, diagonal GMOS cutoffs, barcode)
+      slit.slitFovMin = (slit.slitFovMin > bandStart) ? slit.slitFovMin : bandStart;
+      slit.slitFovMax = (slit.slitFovMax < bandEnd) ? slit.slitFovMax : bandEnd;
     }
   }
-  slit.slitFovMax = intercept[min_index];
 }
 
 
 //************************************************************************
-// Calculates all possible intercepts of a slit with the boundary 
+// The science band holding the slit (band shuffle mode), or the number 
+// of bands if there is none.
 //************************************************************************
-vector<float> calc_intercept(float obj_spec_pos) {
+int slitBand(const Slit &slit) {
+  int bandIndex;
 
-  int nvert = fov.vertx.size(); // The number of vertices in the fov polygon.
-
-  vector<float> intercept(nvert,0.);
-  float cut, slope, numerator, denominator;
-  int i, k1 = 0, k2 = 0;
-
-  // Calculate the intercepts for all boundary lines
-  for (i=0; i<nvert; i++) {
-    if (i<nvert-1) {
-      k1 = i;
-      k2 = i+1;
-    }
-    // For the last boundary line, we need to "wrap around"
-    if (i==nvert-1) {
-      k1 = i;
-      k2 = 0;
-    }
-
-    numerator = fov.vert_spatial[k1] - fov.vert_spatial[k2];
-    denominator = fov.vert_spectral[k1] - fov.vert_spectral[k2];
-
-    if (denominator != 0.) {
-      slope = numerator / denominator;
-      cut = slope * (obj_spec_pos - fov.vert_spectral[k1]) + fov.vert_spatial[k1];
-      // ignore the intercept if the finite boundary line does not overlap with the slit
-      // e.g. bar code
-      if ((obj_spec_pos < fov.vert_spectral[k1] && obj_spec_pos < fov.vert_spectral[k2]) ||
-	  (obj_spec_pos > fov.vert_spectral[k1] && obj_spec_pos > fov.vert_spectral[k2])) {
-	cut = 1.e9;
-      }	
-    }
-    else {
-      // No intercept, just put very large number:
-      cut = 1.e9;
+  for (bandIndex = 0; bandIndex < int(banddef.shuffleBands.size()); bandIndex++) {
+    if (slit.slitStart >= banddef.shuffleBands[bandIndex] && 
+	slit.slitEnd <= banddef.shuffleBands[bandIndex] + banddef.bandSize) {
+      return bandIndex;
     }
-    intercept.push_back(cut);
   }
 
-  return intercept;
+  return banddef.shuffleBands.size();
 }
 
+//****************************************************************************
+// The number of Max-Sky expansion rounds that can be skipped before a slit
+// can lock, if 'space' pixels are left before the lock and the gap closes 
+// by 'rate' pixels per round. One round less, against rounding.
+//****************************************************************************
+int safeRounds(double space, int rate) {
+  double rounds = floor(space / rate) - 1.;
+
+  if (rounds <= 0.) return 0;
+  if (rounds >= MAX_EXPAND_ROUNDS) return MAX_EXPAND_ROUNDS;
+  return int(rounds);
+}
 
 /*
 ************************************************************************
 *+
-* FUNCTION: maxOptProcessLine
+* FUNCTION: maxOptResize
 *
 * RETURNS: n/a
 *
-* DESCRIPTION: Process a line that has been expanded. 'ccdL', as well as 
-*              'slitLength' need to be recalculated. 
+* DESCRIPTION: Updates the ODF slit length and offset of a slit that has 
+*              been expanded.
 *
 * [NOTES:]:
 *-
 ************************************************************************
 */
-void maxOptProcessLine(map<int, Slit> &placed, int id1, string dispDirection,
-		       float pixelScale) {
-  // Unpack 'line'; recalc 'ccdL' and 'slitLength'; repack 'line'
-
-  // Used for packing/unpacking each slit's line.
-  string id, ra, dec, ccdW;
-  string slitWidth, angle, mag, prio, type, redshift, specLeft, specRight, specBottom, specTop;
-  string slitOffsetW;
-  float ccdL = 0.0, slitLength = 0.0, slitOffsetL = 0.0;
-  vector < string > lD; // (formerly "lineData")
-
-  // Unpack line.
-  lD = stringSplit(placed[id1].line, "\t");
-
-  // Clean up last entry
-  lD[17].erase(lD[17].find_last_not_of(" \t\r\n") + 1);
-
-  // Some fields are different based on dispDirection.
-  if (dispDirection == "horizontal") {
-    stringToFloat(lD[4], ccdL);
-  } 
-  else {
-    stringToFloat(lD[3], ccdL);
-  }
-
-  // Done unpacking line. 
+void maxOptResize(Slit &slit, float pixelScale) {
   // Recalc slitlength and slitoffset (because of wiggling and auto-expansion)
-  slitLength = (placed[id1].slitEnd - placed[id1].slitStart) * pixelScale;
-  slitOffsetL = ((placed[id1].slitEnd + placed[id1].slitStart) / 2. - ccdL) * pixelScale;
-
-  // Repack line. 
-  char lineChar[512];
-
-  if (dispDirection == "horizontal") {
-    sprintf(lineChar,
-	    "%s\t%s\t%s\t%s\t%s\t%s\t%8.6f\t%s\t%8.6f\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
-	    lD[0].c_str(), lD[1].c_str(), lD[2].c_str(), lD[3].c_str(), lD[4].c_str(), lD[5].c_str(), slitOffsetL,
-	    lD[7].c_str(), slitLength, lD[9].c_str(), lD[10].c_str(), lD[11].c_str(), lD[12].c_str(),
-	    lD[13].c_str(), lD[14].c_str(), lD[15].c_str(), lD[16].c_str(), lD[17].c_str());
-  } 
-  else {
-    sprintf(lineChar,
-	    "%s\t%s\t%s\t%s\t%s\t%8.6f\t%s\t%8.6f\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
-	    lD[0].c_str(), lD[1].c_str(), lD[2].c_str(), lD[3].c_str(), lD[4].c_str(), slitOffsetL, lD[6].c_str(),
-	    slitLength, lD[8].c_str(), lD[9].c_str(), lD[10].c_str(), lD[11].c_str(), lD[12].c_str(),
-	    lD[13].c_str(), lD[14].c_str(), lD[15].c_str(), lD[16].c_str(), lD[17].c_str());
-  }
-
-  placed[id1].line = lineChar;
+  slit.odf.length = (slit.slitEnd - slit.slitStart) * pixelScale;
+  slit.odf.offsetL = ((slit.slitEnd + slit.slitStart) / 2. - slit.odf.ccdL) * pixelScale;
 }
 
 /*
@@ -1349,271 +4600,265 @@ void maxOptProcessLine(map<int, Slit> &placed, int id1, string dispDirection,
 *+
 * FUNCTION: wiggleUnplaced
 *
-* RETURNS: Sucess code.
+* RETURNS: The number of slits placed.
 *
 * DESCRIPTION: Tries to fit more slits on the mask by moving slits up or down.
 *
-* [NOTES:]:
+* [NOTES:]: Moving slits along the slit length axis only changes how far
+*           apart they are along that axis, so keeping two slits whose 
+*           spectra (or slits) are close along the dispersion axis apart is
+*           a difference constraint  x_lower - x_upper <= gap - sep  on 
+*           their moves x. For each unplaced slit, in order of priority,
+*           the placed slits it may push (directly or through others) and
+*           their constraints are solved at once (Bellman-Ford), within the
+*           wiggle room of each slit and the slit placement area. Of all 
+*           solutions the one moving the slits least is taken; it is 
+*           re-tested with conflicts() before the slit is placed. Stops 
+*           at the deadline (see pastDeadline()).
 *-
 ************************************************************************
 */
 int wiggleUnplaced(map<int, Slit> * slits, map<int, Slit> * placed,
-		   map<int, Slit> * removed, float microshufflePix,
-		   string dispDirection, float pixelScale) {
-  // Conflict graph between all slits.
-  Graph conflictGraph;
-
-  // The slits (placed and unplaced).
-  map<int, Slit> allSlits;
-  map<int, Slit>::iterator placedIterator;
-
-  // The number of placed slits each removed slits conflicts with.
-  map<int, int> conflictNum;
-
-  // Used for holding conflict lists of loaded placed slits.
-  vector<int> slitConflictList;
-
-  Slit placedSlit;
-  Slit cur;
-  unsigned int i;
-  int remId;
+		   map<int, Slit> * removed, float microshufflePix,
+		   DispDirection dispDirection, float pixelScale) {
+  // The slits (placed and unplaced), at their current positions.
+  map<int, Slit> allSlits;
+  map<int, Slit>::iterator it;
+  map<int, int> row;
+  vector<Slit> node;
+  vector<char> isPlaced;
+
+  // Wiggle room of each slit, and how far it has been moved so far.
+  vector<float> room;
+  vector<double> shift;
+  float maxRoom = 0;
+
+  // Pairs of slits that may conflict when moved.
+  vector<_spacing_> spacing;
+  vector< vector<int> > incident;
+  _spacing_ space;
+
+  // The slits moved to place one more, their moves and the constraints
+  vector<int> comp, local;
+  vector<double> lo, hi, least, move;
+  vector<Slit> trial;
+  vector<int> cons;
+  vector< std::pair<char, int> > candidates;
+  SlitBlock block;
+
+  float specPad = MIN_SPEC_DIST / pixelScale;
+  float lengthPad = microshufflePix + specPad;
+  float gap, limit;
+  double bound;
+  int n, i, j, k, l, c, u, v, e, placedNum = 0;
+  bool spectral, laser, feasible, changed;
 
-  // Possible wiggle room for the already placed slit.
-  float placedWiggleRoom = 0;
+  allSlits.insert((*placed).begin(), (*placed).end());
+  allSlits.insert((*removed).begin(), (*removed).end());
 
-  // Possible wiggle room for the unplaced slit.
-  float curWiggleRoom = 0;
+  for (it = allSlits.begin(); it != allSlits.end(); it++) {
+    row[(*it).first] = node.size();
+    node.push_back((*it).second);
+    isPlaced.push_back((*placed).count((*it).first) == 1);
+    room.push_back((*it).second.wiggleUsed ? 0 : (*it).second.wiggleRoom);
+    if (room.back() > maxRoom) maxRoom = room.back();
 
-  // How much a placed slit has wiggled.
-  float placedWiggleMag = 0;
-  float curWiggleMag = 0;
+    // The limits of the slit placement area (and storage bands)
+    expandSlitToFOV(node.back());
+    limitSlitToBand(node.back());
+  }
+  n = node.size();
+  shift.assign(n, 0);
+  incident.resize(n);
+  local.assign(n, -1);
 
-  // True if each respective slits can be wiggled successfully.
-  bool placedMove = false;
-  bool curMove = false;
+  // Find the pairs of slits that can get close enough to conflict.
+  SlitTable table(allSlits, conflictReach(microshufflePix, pixelScale) + 2 * maxRoom);
 
-  allSlits.insert((*placed).begin(), (*placed).end());
-  allSlits.insert((*removed).begin(), (*removed).end());
+  for (i = 0; i < table.size(); i++) {
+    limit = table.end[i] + table.reach;
 
-  // Map conflicts between all slits.
-  mapConflicts(&conflictGraph, allSlits, microshufflePix, dispDirection, pixelScale);
+    for (j = i + 1; j < table.size() && table.start[j] <= limit; j++) {
+      if (table.priority[i] == '0' && table.priority[j] == '0') continue;
 
-  // Count how many times each removed slit conflicts with a placed slit.
-  // We need to keep track of this because we are not going to place removed
-  // slits that conflict with more than one placed slit.
-  for (placedIterator = (*placed).begin(); placedIterator != (*placed).end();
-       placedIterator++) {
-    placedSlit = (*placedIterator).second;
-    slitConflictList = (*conflictGraph.getNode(placedSlit.id)).getList();
+      u = row[table.keys[i]];
+      v = row[table.keys[j]];
+      if (node[u].ccdL > node[v].ccdL || (node[u].ccdL == node[v].ccdL && u > v)) {
+	k = u; u = v; v = k;
+      }
+      const Slit &one = node[u], &two = node[v];
+
+      // Spectra overlap (with the minimum separation), or slits overlap
+      // width-wise (with the laser padding)
+      spectral = (two.specStart <= one.specEnd + specPad + INDEX_MARGIN && 
+		  two.specEnd >= one.specStart - specPad - INDEX_MARGIN);
+      laser = (two.slitBottom < one.slitTop + MAX_LASER_PAD + INDEX_MARGIN &&
+	       two.slitTop > one.slitBottom - MAX_LASER_PAD - INDEX_MARGIN &&
+	       lengthPad < MAX_LASER_PAD);
+      if (!spectral && !laser) continue;
+
+      gap = two.slitStart - one.slitEnd;
+      space.lower = u;
+      space.upper = v;
+      space.sep = spectral ? lengthPad : 0;
+      space.bound = true;
+      if (laser) {
+	if (spectral || gap > lengthPad) space.sep = max(space.sep, MAX_LASER_PAD);
+	else space.bound = spectral;
+      }
+      space.sep += WIGGLE_MARGIN;
 
-    for (i = 0; i < slitConflictList.size(); i++) {
-      remId = slitConflictList[i];
+      if (gap > space.sep + room[u] + room[v] + INDEX_MARGIN) continue;
 
-      if (conflictNum.count(remId) == 1) {
-	conflictNum[remId]++;
-      } 
-      else {
-	conflictNum[remId] = 1;
-      }
+      incident[u].push_back(spacing.size());
+      incident[v].push_back(spacing.size());
+      spacing.push_back(space);
     }
   }
 
-  // Search for slits that can be moved, and move them.
-  // NOTE: Only two slits are considered at a time.
-  for (placedIterator = (*placed).begin(); placedIterator != (*placed).end();
-       placedIterator++) {
-
-    placedSlit = (*placedIterator).second;
-
-    // Find valid wiggle amount for this slit.
-    if (placedSlit.wiggleUsed == false) {
-      placedWiggleRoom = placedSlit.wiggleRoom;
-    } 
-    else {
-      // We can only wiggle once, so no dice.
-      placedWiggleRoom = 0;
+  // Place the unplaced slits in order of priority.
+  for (i = 0; i < n; i++) {
+    if (!isPlaced[i]) candidates.push_back(std::pair<char, int>(node[i].priority, i));
+  }
+  sort(candidates.begin(), candidates.end());
+
+  for (l = 0; l < int(candidates.size()) && !pastDeadline(); l++) {
+    c = candidates[l].second;
+
+    // The slits that may have to move: the placed slits bound to the 
+    // candidate, directly or through other placed slits.
+    comp.assign(1, c);
+    local[c] = 0;
+    feasible = true;
+    for (k = 0; k < int(comp.size()) && feasible; k++) {
+      for (j = 0; j < int(incident[comp[k]].size()); j++) {
+	_spacing_ &sp = spacing[incident[comp[k]][j]];
+	u = sp.lower == comp[k] ? sp.upper : sp.lower;
+	if (!sp.bound || !isPlaced[u] || local[u] >= 0) continue;
+	if (int(comp.size()) == WIGGLE_MAX_NODES) {
+	  feasible = false;
+	  break;
+	}
+	local[u] = comp.size();
+	comp.push_back(u);
+      }
     }
 
-    // Find list of slits excluded by this slit.
-    slitConflictList = (*conflictGraph.getNode(placedSlit.id)).getList();
-
-    // Try to place this slit if possible.
-    // NOTE: Should be taking priority into account here?
-    for (i = 0; i < slitConflictList.size(); i++) {
-      remId = slitConflictList[i];
+    // Bounds on the moves
+    lo.resize(comp.size());
+    hi.resize(comp.size());
+    for (k = 0; k < int(comp.size()) && feasible; k++) {
+      const Slit &slit = node[comp[k]];
+      lo[k] = -room[comp[k]] - shift[comp[k]];
+      hi[k] =  room[comp[k]] - shift[comp[k]];
+      lo[k] = max(lo[k], min(0., double(slit.slitFovMin) - slit.slitStart));
+      hi[k] = min(hi[k], max(0., double(slit.slitFovMax) - slit.slitEnd));
+      if (lo[k] > hi[k]) feasible = false;
+    }
 
-      if (conflictNum[remId] > 1) {
-	// Can't add slits with more than one conflict.
-	continue;
+    // The constraints between them
+    cons.clear();
+    for (k = 0; k < int(comp.size()) && feasible; k++) {
+      for (j = 0; j < int(incident[comp[k]].size()); j++) {
+	e = incident[comp[k]][j];
+	if (spacing[e].bound && spacing[e].lower == comp[k] && local[spacing[e].upper] >= 0) {
+	  cons.push_back(e);
+	}
       }
+    }
 
-      cur = (*removed)[remId];
-      curWiggleRoom = cur.wiggleRoom;
-
-      // Determine how the removed slit conflicts with the placed slit.
-      if (placedSlit.slitEnd < cur.slitEnd &&
-	  placedSlit.slitEnd > cur.slitStart && 
-	  cur.slitStart > placedSlit.slitStart) {
-	// Removed slit conflicts with the 'end' edge of the placed slit.
-
-	// Test if it can be wiggled.
-	if (placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST / pixelScale < curWiggleRoom) {
-	  // Can fit while wiggling only removed slit.
-	  curWiggleMag = placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST / pixelScale;
-	  cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-
-	  // Make sure mask is still valid.
-	  if (checkConflicts(cur, placedSlit, (*placed), microshufflePix, dispDirection, pixelScale)) {
-	    // Movement causes conflict, undo wiggle.
-	    curWiggleMag *= -1;
-	    cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-	  } 
-	  else {
-	    // Movement does not cause conflict, flag for placement.
-	    curMove = true;
-	  }
-	} 
-	else if (placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST / pixelScale 
-		 < curWiggleRoom + placedWiggleRoom) {
-	  // Must wiggle both slits to fit.
-
-	  // Determine relative wiggle magnitudes over both slits.
-	  if (curWiggleRoom / 2.0 >= (placedSlit.slitEnd - cur.slitStart
-				      + MIN_SPEC_DIST / pixelScale) / 2.0) {
-	    if (placedWiggleRoom >= (placedSlit.slitEnd - cur.slitStart
-				     + MIN_SPEC_DIST / pixelScale) / 2.0) {
-	      // Can wiggle in equal parts.
-	      curWiggleMag = (placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST / pixelScale) / 2.0;
-	      placedWiggleMag = (placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST) / 2.0 * -1;
-	    } 
-	    else {
-	      // Need more cur wiggle.
-	      placedWiggleMag = placedWiggleRoom * -1;
-	      curWiggleMag = placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST / pixelScale -
-		placedWiggleRoom;
-	    }
-	  } 
-	  else {
-	    // Need more placed wiggle.
-	    curWiggleMag = curWiggleRoom;
-	    placedWiggleMag = (placedSlit.slitEnd - cur.slitStart + MIN_SPEC_DIST / 
-			       pixelScale - curWiggleRoom) * -1;
-	  }
-	  
-	  placedSlit.changePosition(0, placedWiggleMag, pixelScale, dispDirection);
-	  cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-
-	  // Make sure mask is still valid.
-	  if (checkConflicts(cur, placedSlit, (*placed), microshufflePix, dispDirection, pixelScale) ||
-	      checkConflicts(placedSlit, placedSlit, (*placed), microshufflePix, dispDirection, pixelScale)) {
-	    curWiggleMag *= -1;
-	    cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-	    placedWiggleMag *= -1;
-	    placedSlit.changePosition(0, placedWiggleMag, pixelScale, dispDirection);
-	  } 
-	  else {
-	    curMove = true;
-	    placedMove = true;
-	  }
+    // Least moves satisfying all constraints
+    least = lo;
+    changed = true;
+    for (k = 0; k <= int(comp.size()) && changed && feasible; k++) {
+      changed = false;
+      for (j = 0; j < int(cons.size()); j++) {
+	_spacing_ &sp = spacing[cons[j]];
+	bound = least[local[sp.lower]] - (node[sp.upper].slitStart - node[sp.lower].slitEnd - sp.sep);
+	if (least[local[sp.upper]] < bound) {
+	  least[local[sp.upper]] = bound;
+	  changed = true;
 	}
-      } 
-      else if (placedSlit.slitStart > cur.slitStart &&
-	       placedSlit.slitStart < cur.slitEnd &&
-	       cur.slitEnd < placedSlit.slitEnd) {
-	// Removed slit conflicts with the 'start' edge of the placed slit.
-
-	// Test if slit can be wiggled.
-	if (cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale < curWiggleRoom) {
-	  // Can fit while wiggling only removed slit.
-
-	  curWiggleMag = (cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale) * -1;
-	  cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-
-	  // Make sure mask is still valid.
-	  if (checkConflicts(cur, placedSlit, (*placed), microshufflePix, dispDirection, pixelScale)) {
-	    // Movement causes conflict, undo wiggle.
-	    
-	    curWiggleMag *= -1;
-	    cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-	  } 
-	  else {
-	    // Movement does not cause conflict, flag for placement.
-	    curMove = true;
-	  }
+      }
+    }
+    for (k = 0; k < int(comp.size()) && feasible; k++) {
+      if (changed || least[k] > hi[k]) feasible = false;
+    }
 
-	} 
-	else if (cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale <
-		 curWiggleRoom + placedWiggleRoom) {
-	  // Need to wiggle both slits to fit.
-
-	  /*
-	   * Determine relative wiggle magnitudes for the placed and
-	   * unplaced slits.
-	   */
-	  if (curWiggleRoom / 2.0 >= 
-	      (cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale) / 2.0) {
-
-	    if (placedWiggleRoom >= 
-		(cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale) / 2.0) {
-	      // Can wiggle in equal parts.
-	      curWiggleMag = (cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale) / 2.0 * (-1.);
-	      placedWiggleMag = (cur.slitEnd - placedSlit.slitStart + MIN_SPEC_DIST / pixelScale) / 2.0;
-	    }
-	    else {
-	      // Need more cur wiggle.
-	      placedWiggleMag = placedWiggleRoom;
-	      curWiggleMag = (cur.slitEnd - placedSlit.slitStart
-			      + MIN_SPEC_DIST / pixelScale - placedWiggleRoom) * -1;
-	    }
-	  } 
-	  else {
-	    // Need more placed wiggle.
-	    curWiggleMag = curWiggleRoom * -1;
-	    placedWiggleMag = cur.slitEnd - placedSlit.slitStart
-	      + MIN_SPEC_DIST / pixelScale - curWiggleRoom;
+    if (feasible) {
+      // Greatest solution below max(least, 0): no slit moves further 
+      // than it has to, or the wrong way.
+      move.resize(comp.size());
+      for (k = 0; k < int(comp.size()); k++) {
+	move[k] = min(hi[k], max(least[k], 0.));
+      }
+      changed = true;
+      for (k = 0; k <= int(comp.size()) && changed; k++) {
+	changed = false;
+	for (j = 0; j < int(cons.size()); j++) {
+	  _spacing_ &sp = spacing[cons[j]];
+	  bound = move[local[sp.upper]] + (node[sp.upper].slitStart - node[sp.lower].slitEnd - sp.sep);
+	  if (move[local[sp.lower]] > bound) {
+	    move[local[sp.lower]] = bound;
+	    changed = true;
 	  }
+	}
+      }
 
-	  placedSlit.changePosition(0, placedWiggleMag, pixelScale, dispDirection);
-	  cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-
-	  // Make sure mask is still valid.
-	  if (checkConflicts(cur, placedSlit, (*placed), microshufflePix, dispDirection, pixelScale)
-	      || checkConflicts(placedSlit, placedSlit, (*placed), microshufflePix, dispDirection, pixelScale)) {
-	    curWiggleMag *= -1;
-	    cur.changePosition(0, curWiggleMag, pixelScale, dispDirection);
-	    placedWiggleMag *= -1;
-	    placedSlit.changePosition(0, placedWiggleMag, pixelScale, dispDirection);
-	  } 
-	  else {
-	    curMove = true;
-	    placedMove = true;
+      // Re-test the moved slits and the candidate
+      feasible = !changed;
+      trial.resize(comp.size());
+      for (k = 0; k < int(comp.size()); k++) {
+	trial[k] = node[comp[k]];
+	if (move[k] != 0) trial[k].changePosition(0, move[k], pixelScale);
+      }
+      for (k = 0; k < int(comp.size()) && feasible; k++) {
+	if (k > 0 && move[k] == 0) continue;
+	for (j = 0; j < int(incident[comp[k]].size()); j++) {
+	  _spacing_ &sp = spacing[incident[comp[k]][j]];
+	  u = sp.lower == comp[k] ? sp.upper : sp.lower;
+	  if (!isPlaced[u] && u != c) continue;
+	  block.add(local[u] >= 0 ? trial[local[u]] : node[u]);
+	  if (block.full()) {
+	    feasible = conflictMask(trial[k], block.columns(), block.size, microshufflePix,
+				    dispDirection, pixelScale) == 0;
+	    block.size = 0;
+	    if (!feasible) break;
 	  }
 	}
-      } 
-      else {
-	// Other cases, ignore.
-	continue;
+	if (feasible && block.size > 0) {
+	  feasible = conflictMask(trial[k], block.columns(), block.size, microshufflePix,
+				  dispDirection, pixelScale) == 0;
+	}
+	block.size = 0;
       }
+    }
 
-      // Save changes into slit maps.
-      if (curMove) {
-	cur.wiggleUsed = true;
-	(*removed).erase(cur.id);
-	(*placed)[cur.id] = cur;
-	(*slits)[cur.id] = cur;
-      }
-      if (placedMove) {
-	placedSlit.wiggleUsed = true;
-	(*placed)[placedSlit.id] = placedSlit;
-	(*slits)[placedSlit.id] = placedSlit;
+    // Save changes into slit maps.
+    if (feasible) {
+      for (k = 0; k < int(comp.size()); k++) {
+	if (k > 0 && move[k] == 0) continue;
+	v = comp[k];
+	shift[v] += move[k];
+	node[v] = trial[k];
+	if (move[k] != 0) node[v].wiggleUsed = true;
+
+	Slit &slit = (*placed)[node[v].id];
+	slit = trial[k];
+	slit.wiggleUsed = node[v].wiggleUsed;
+	(*slits)[slit.id] = slit;
       }
+      isPlaced[c] = true;
+      (*removed).erase(node[c].id);
+      placedNum++;
+    }
 
-      curMove = false;
-      placedMove = false;
+    for (k = 0; k < int(comp.size()); k++) {
+      local[comp[k]] = -1;
     }
   }
 
-  return 0;
+  return placedNum;
 }
 
 /*
@@ -1621,32 +4866,38 @@ int wiggleUnplaced(map<int, Slit> * slits, map<int, Slit> * placed,
 *+
 * FUNCTION: wiggleNear
 *
-* RETURNS: None.
+* RETURNS: True if any slit was moved.
 *
 * DESCRIPTION: Create more space by moving placed slits closer to each other
 *               (within the permitted wiggle space)
 *
-* [NOTES:]:
+* [NOTES:]: The ids of the moved slits are appended to 'moved', if given.
+*           Acquisition objects are never moved: the slit alone moves 
+*           toward them, by up to its own wiggle room.
 *-
 ************************************************************************
 */
 bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
-		float pixelScale, string dispDirection) {
+		float pixelScale, vector<int> *moved) {
   map<int, Slit>::iterator slitIterator;
 
-  // Gather information on slit to wiggle.
-  Slit slit = (*slits)[sid];
+  // Gather information on slit to wiggle. Take it from 'placed': the 
+  // acquisition objects of later masks are no longer in 'slits'.
+  Slit slit = (*placed)[sid];
 
   Slit cur;
   float curWiggleRoom;
+  bool fixed;
 
   float wiggleMag = 0;
   float wiggleMagSlit = 0;
   float wiggleMagCur = 0;
 
+  bool wiggled = false;
+
   // If wiggle has been used then don't wiggle.
   if (slit.wiggleUsed) {
-    return 0;
+    return false;
   }
 
   // Try to wiggle.
@@ -1658,8 +4909,12 @@ bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
       continue;
     }
 
+    // Acquisition objects are not moved: they are re-used on every mask,
+    // at the positions the conflict graph of all objects was mapped with.
+    fixed = cur.priority == '0';
+
     // If this cur hasn't been wiggled already then we can wiggle it here.
-    if (cur.wiggleUsed == true) curWiggleRoom = 0;
+    if (cur.wiggleUsed == true || fixed) curWiggleRoom = 0;
     else curWiggleRoom = cur.wiggleRoom;
 
     // Detect and execute wiggle, if able.
@@ -1670,7 +4925,12 @@ bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
       wiggleMag = cur.slitStart - slit.slitEnd - MIN_SPEC_DIST / pixelScale;
 
       // Determine slit movement magnitudes.
-      if (curWiggleRoom >= wiggleMag / 2.0 && slit.wiggleRoom >= wiggleMag / 2.0) {
+      if (fixed) {
+	// Only slit moves, within its wiggle room as tested above.
+	wiggleMagCur  = 0;
+	wiggleMagSlit = wiggleMag;
+      }
+      else if (curWiggleRoom >= wiggleMag / 2.0 && slit.wiggleRoom >= wiggleMag / 2.0) {
 	// Both slits can meet in the middle.
 	wiggleMagCur  = wiggleMag / 2.0;
 	wiggleMagSlit = wiggleMag / 2.0;
@@ -1689,15 +4949,20 @@ bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
       wiggleMagCur *= -1;
 
       // Apply changes to slit objects.
-      slit.changePosition(0, wiggleMagSlit, pixelScale, dispDirection);
-      cur.changePosition(0, wiggleMagCur, pixelScale, dispDirection);
+      slit.changePosition(0, wiggleMagSlit, pixelScale);
       slit.wiggleUsed = true;
-      cur.wiggleUsed = true;
-
       (*slits)[slit.id]  = slit;
       (*placed)[slit.id] = slit;
-      (*slits)[cur.id]   = cur;
-      (*placed)[cur.id]  = cur;
+
+      if (!fixed) {
+	cur.changePosition(0, wiggleMagCur, pixelScale);
+	cur.wiggleUsed = true;
+	(*slits)[cur.id]   = cur;
+	(*placed)[cur.id]  = cur;
+	if (moved != 0) moved->push_back(cur.id);
+      }
+
+      wiggled = true;
     } 
     else if (slit.slitStart > cur.slitEnd && 
 	     slit.slitStart - slit.wiggleRoom < cur.slitEnd + curWiggleRoom) {
@@ -1706,8 +4971,13 @@ bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
       wiggleMag = slit.slitStart - cur.slitEnd - MIN_SPEC_DIST / pixelScale;
 
       // Determine slit movement magnitudes.
-      if (curWiggleRoom >= wiggleMag / 2.0 && 
-	  slit.wiggleRoom >= wiggleMag / 2.0) {
+      if (fixed) {
+	// Only slit moves, within its wiggle room as tested above.
+	wiggleMagCur  = 0;
+	wiggleMagSlit = wiggleMag;
+      }
+      else if (curWiggleRoom >= wiggleMag / 2.0 && 
+	       slit.wiggleRoom >= wiggleMag / 2.0) {
 	// Both slits can meet in the middle.
 	wiggleMagCur  = wiggleMag / 2.0;
 	wiggleMagSlit = wiggleMag / 2.0;
@@ -1726,19 +4996,26 @@ bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
       wiggleMagSlit *= -1;
 
       // Apply changes to slit objects.
-      slit.changePosition(0, wiggleMagSlit, pixelScale, dispDirection);
-      cur.changePosition(0, wiggleMagCur, pixelScale, dispDirection);
+      slit.changePosition(0, wiggleMagSlit, pixelScale);
       slit.wiggleUsed = true;
-      cur.wiggleUsed = true;
-
       (*slits)[slit.id] = slit;
       (*placed)[slit.id] = slit;
-      (*slits)[cur.id] = cur;
-      (*placed)[cur.id] = cur;
+
+      if (!fixed) {
+	cur.changePosition(0, wiggleMagCur, pixelScale);
+	cur.wiggleUsed = true;
+	(*slits)[cur.id] = cur;
+	(*placed)[cur.id] = cur;
+	if (moved != 0) moved->push_back(cur.id);
+      }
+
+      wiggled = true;
     }
   }
 
-  return 0;
+  if (wiggled && moved != 0) moved->push_back(sid);
+
+  return wiggled;
 }
 
 /*
@@ -1754,10 +5031,12 @@ bool wiggleNear(int sid, map<int, Slit> * slits, map<int, Slit> * placed,
 *-
 ************************************************************************
 */
-bool conflicts(Slit slitOne, Slit slitTwo, float msPix,
-	       string dispDirection, float pixelScale) {
+bool conflicts(const Slit &slitOne, const Slit &slitTwo, float msPix,
+	       DispDirection dispDirection, float pixelScale) {
   float laserPad;
 
+  conflictTests++;
+
   // Uncomment the following line if you need to switch off conflict resolution for whatever purpose.
   // return false;
 
@@ -1768,59 +5047,394 @@ bool conflicts(Slit slitOne, Slit slitTwo, float msPix,
   }
 
   // Set minimum slit separation based on instrument type. (in pixels)
-  if (dispDirection == "vertical") 
+  if (dispDirection == DISP_VERTICAL) 
     laserPad = 2.685; // For F2. Not sure why!
   else 
     laserPad = 2.7;
 
+  return conflictTest(slitOne.slitStart, slitOne.slitEnd, slitOne.slitTop, slitOne.slitBottom,
+		      slitOne.specStart, slitOne.specEnd,
+		      slitTwo.slitStart, slitTwo.slitEnd, slitTwo.slitTop, slitTwo.slitBottom,
+		      slitTwo.specStart, slitTwo.specEnd,
+		      msPix, MIN_SPEC_DIST / pixelScale, laserPad);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: conflictTest
+*
+* RETURNS: true or false
+*
+* DESCRIPTION: The geometric test of conflicts() on the slit edges
+* (s: slitStart, e: slitEnd, t: slitTop, b: slitBottom) and the spectrum
+* edges (ss: specStart, se: specEnd) of the two slits, all in pixels.
+*
+* [NOTES:]: specPad is MIN_SPEC_DIST in pixels. The SIMD kernels of
+* conflictMask() evaluate the very same float expressions, in the same
+* order, so that they agree with this function bit for bit.
+*-
+************************************************************************
+*/
+bool conflictTest(float s1, float e1, float t1, float b1, float ss1, float se1,
+		  float s2, float e2, float t2, float b2, float ss2, float se2,
+		  float msPix, float specPad, float laserPad) {
 
   // Test spectra overlap in slitLength-wise direction.
-  if ((slitTwo.slitEnd   >= slitOne.slitStart - msPix - MIN_SPEC_DIST / pixelScale &&
-       slitTwo.slitEnd   <= slitOne.slitEnd   + msPix + MIN_SPEC_DIST / pixelScale) ||     
-      (slitTwo.slitStart >= slitOne.slitStart - msPix - MIN_SPEC_DIST / pixelScale &&
-       slitTwo.slitStart <= slitOne.slitEnd   + msPix + MIN_SPEC_DIST / pixelScale) || 
-      (slitTwo.slitStart <= slitOne.slitStart + msPix + MIN_SPEC_DIST / pixelScale && 
-       slitTwo.slitEnd   >= slitOne.slitEnd   - msPix - MIN_SPEC_DIST / pixelScale)) {
+  if ((e2 >= s1 - msPix - specPad && e2 <= e1 + msPix + specPad) ||     
+      (s2 >= s1 - msPix - specPad && s2 <= e1 + msPix + specPad) || 
+      (s2 <= s1 + msPix + specPad && e2 >= e1 - msPix - specPad)) {
     
     // The slits overlap length-wise, now test if the spectra overlap width-wise.
-    float s1SpectraEdge2 = slitOne.specEnd;
-    float s1SpectraEdge1 = slitOne.specStart;
-    float s2SpectraEdge2 = slitTwo.specEnd;
-    float s2SpectraEdge1 = slitTwo.specStart;
-    
-    if ((s2SpectraEdge1 <= s1SpectraEdge2 + MIN_SPEC_DIST / pixelScale &&
-	 s2SpectraEdge1 >= s1SpectraEdge1 - MIN_SPEC_DIST / pixelScale) ||   // slit 2 (right) overlaps with slit 1 (left)
-	(s2SpectraEdge2 >= s1SpectraEdge1 - MIN_SPEC_DIST / pixelScale && 
-	 s2SpectraEdge2 <= s1SpectraEdge2 + MIN_SPEC_DIST / pixelScale) ||   // slit 2 (left) overlaps with slit 1 (right)
-	(s2SpectraEdge1 <= s1SpectraEdge1 + MIN_SPEC_DIST / pixelScale && 
-	 s2SpectraEdge2 >= s1SpectraEdge2 - MIN_SPEC_DIST / pixelScale) ||   // slit 1 entirely contained in slit 2
-	(s2SpectraEdge1 >= s1SpectraEdge1 + MIN_SPEC_DIST / pixelScale && 
-	 s2SpectraEdge2 <= s1SpectraEdge2 - MIN_SPEC_DIST / pixelScale)) {   // slit 2 entirely contained in slit 1; probably unnecessary
-      
-      //      cout << "CONFLICT_______: " << slitOne.ccdW << " " << slitOne.ccdL << " " << slitTwo.ccdW << " " << slitTwo.ccdL << " " << s1SpectraEdge1 << " " << s1SpectraEdge2 << " " << s2SpectraEdge1 << " " << s2SpectraEdge2 << endl;
-      
-      // These slits conflict with eachother! 
-      return true;
-      
-      // why not check that slit 2 is entirely contained in slit 1? -mischa
-    } else {
-      //cout << "NO_____CONFLICT: " << slitOne.ccdW << " " << slitOne.ccdL << " " << slitTwo.ccdW << " " << slitTwo.ccdL << " " << s1SpectraEdge1 << " " << s1SpectraEdge2 << " " << s2SpectraEdge1 << " " << s2SpectraEdge2 << endl;
+    return ((ss2 <= se1 + specPad && ss2 >= ss1 - specPad) ||   // slit 2 (right) overlaps with slit 1 (left)
+	    (se2 >= ss1 - specPad && se2 <= se1 + specPad) ||   // slit 2 (left) overlaps with slit 1 (right)
+	    (ss2 <= ss1 + specPad && se2 >= se1 - specPad) ||   // slit 1 entirely contained in slit 2
+	    (ss2 >= ss1 + specPad && se2 <= se1 - specPad));    // slit 2 entirely contained in slit 1; probably unnecessary
+  }
+
+  // why is this a problem? this should not be flagged if the spectra don't overlap in wavelengths -mischa
+  return (((e2 < s1 && s1 - laserPad < e2) || 
+	   (s2 > e1 && e1 + laserPad > s2)) && 
+	  ((t2 < t1 + laserPad || b2 < t1 + laserPad) &&
+	   (t2 > b1 - laserPad || b2 > b1 - laserPad)));
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: conflictMask
+*
+* RETURNS: A bit mask, bit k set if 'slit' conflicts with slit k of the 
+*          block
+*
+* DESCRIPTION: conflicts() of 'slit' against 'count' (at most BLOCK_SLITS)
+* slits given by their columns. Each pair is tested with the lower id as
+* the first slit, as conflicts() is not symmetric under float rounding.
+* On x86-64 the pairs are tested 8 at a time, with AVX2 when the cpu has
+* it (decided once, at the first call) and SSE2 otherwise; one by one on
+* other cpus.
+*
+* [NOTES:]: The kernels read BLOCK_SLITS entries of every column; shorter
+* blocks are copied into a padded SlitBlock first.
+*-
+************************************************************************
+*/
+unsigned conflictMask(const Slit &slit, const _columns_ &cols, int count, float msPix,
+		      DispDirection dispDirection, float pixelScale) {
+  static const _kernel_ kernel = conflictKernel();
+  SlitBlock block;
+  _columns_ padded;
+  float laserPad, specPad;
+  unsigned mask;
+  int k;
+
+  if (count <= 0) return 0;
+
+  conflictTests += count;
+
+  // Same padding as in conflicts()
+  laserPad = (dispDirection == DISP_VERTICAL) ? 2.685 : 2.7;
+  specPad  = MIN_SPEC_DIST / pixelScale;
+
+  if (count < BLOCK_SLITS) {
+    block.add(cols, count);
+    padded = block.columns();
+    mask = kernel(slit, padded, msPix, specPad, laserPad);
+    mask &= (1u << count) - 1;
+  }
+  else {
+    mask = kernel(slit, cols, msPix, specPad, laserPad);
+  }
+
+  // The spectra of acquisition objects may overlap
+  if (slit.priority == '0') {
+    for (k = 0; k < count; k++) {
+      if (cols.priority[k] == '0') mask &= ~(1u << k);
     }
   }
-  else if (((slitTwo.slitEnd   < slitOne.slitStart && slitOne.slitStart - laserPad < slitTwo.slitEnd) || 
-	    (slitTwo.slitStart > slitOne.slitEnd   && slitOne.slitEnd   + laserPad > slitTwo.slitStart)) && 
-	   ((slitTwo.slitTop   < slitOne.slitTop + laserPad || slitTwo.slitBottom < slitOne.slitTop + laserPad) &&
-	    (slitTwo.slitTop   > slitOne.slitBottom - laserPad || slitTwo.slitBottom > slitOne.slitBottom - laserPad))) {
-    //cout << "LaserPad conflict" << slitOne.ccdW << " " << slitOne.ccdL << " " << slitTwo.ccdW << " " << slitTwo.ccdL << endl;
-    // why is this a problem? this should not be flagged if the spectra don't overlap in wavelengths -mischa
-    return true;
-  } else {
-    //cout << "NO_SLIT_OVERLAP: " << slitOne.ccdW << " " << slitOne.ccdL << " " << slitTwo.ccdW << " " << slitTwo.ccdL << " " << slitOne.slitStart << " " << slitOne.slitEnd << " " << slitTwo.slitStart << " " << slitTwo.slitEnd << endl;
+
+  return mask;
+}
+
+//****************************************************************************
+// The fastest conflictMask() kernel the cpu supports, and its name.
+//****************************************************************************
+_kernel_ conflictKernel(string *name) {
+#ifdef CONFLICT_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    if (name != 0) *name = "avx2";
+    return conflictMaskAvx2;
   }
-  
-  return false;
+  if (name != 0) *name = "sse2";
+  return conflictMaskSse;
+#else
+  if (name != 0) *name = "scalar";
+  return conflictMaskScalar;
+#endif
+}
+
+//****************************************************************************
+// The conflictMask() kernel without SIMD: conflictTest() on each of the
+// BLOCK_SLITS slits of the block.
+//****************************************************************************
+unsigned conflictMaskScalar(const Slit &slit, const _columns_ &cols, float msPix, 
+			    float specPad, float laserPad) {
+  unsigned mask = 0;
+  int k;
+
+  for (k = 0; k < BLOCK_SLITS; k++) {
+    if (slit.id < cols.id[k]) {
+      if (conflictTest(slit.slitStart, slit.slitEnd, slit.slitTop, slit.slitBottom,
+		       slit.specStart, slit.specEnd,
+		       cols.start[k], cols.end[k], cols.top[k], cols.bottom[k],
+		       cols.specStart[k], cols.specEnd[k], msPix, specPad, laserPad))
+	mask |= 1u << k;
+    }
+    else {
+      if (conflictTest(cols.start[k], cols.end[k], cols.top[k], cols.bottom[k],
+		       cols.specStart[k], cols.specEnd[k],
+		       slit.slitStart, slit.slitEnd, slit.slitTop, slit.slitBottom,
+		       slit.specStart, slit.specEnd, msPix, specPad, laserPad))
+	mask |= 1u << k;
+    }
+  }
+
+  return mask;
+}
+
+#ifdef CONFLICT_SIMD
+//****************************************************************************
+// The conflictMask() kernel with SSE2, which x86-64 always has: two
+// halves of 4 lanes. Lanes where the block slit has the lower id swap the
+// roles of the two slits, as conflictMaskScalar() does.
+//****************************************************************************
+unsigned conflictMaskSse(const Slit &slit, const _columns_ &cols, float msPix, 
+			 float specPad, float laserPad) {
+  __m128 ms = _mm_set1_ps(msPix), sp = _mm_set1_ps(specPad), lp = _mm_set1_ps(laserPad);
+  __m128 sS = _mm_set1_ps(slit.slitStart), sE = _mm_set1_ps(slit.slitEnd);
+  __m128 sT = _mm_set1_ps(slit.slitTop), sB = _mm_set1_ps(slit.slitBottom);
+  __m128 sSS = _mm_set1_ps(slit.specStart), sSE = _mm_set1_ps(slit.specEnd);
+  __m128i sId = _mm_set1_epi32(slit.id);
+  __m128 swap, cS, cE, cT, cB, cSS, cSE;
+  __m128 s1, e1, t1, b1, ss1, se1, s2, e2, t2, b2, ss2, se2;
+  __m128 length, spectra, laser;
+  unsigned mask = 0;
+  int h;
+
+  for (h = 0; h < BLOCK_SLITS; h += 4) {
+    cS  = _mm_loadu_ps(cols.start + h);
+    cE  = _mm_loadu_ps(cols.end + h);
+    cT  = _mm_loadu_ps(cols.top + h);
+    cB  = _mm_loadu_ps(cols.bottom + h);
+    cSS = _mm_loadu_ps(cols.specStart + h);
+    cSE = _mm_loadu_ps(cols.specEnd + h);
+
+    // All ones where the block slit comes first
+    swap = _mm_castsi128_ps(_mm_cmpgt_epi32(sId, _mm_loadu_si128((const __m128i *) (cols.id + h))));
+
+#define SELECT(a, b) _mm_or_ps(_mm_and_ps(swap, a), _mm_andnot_ps(swap, b))
+    s1  = SELECT(cS, sS);   s2  = SELECT(sS, cS);
+    e1  = SELECT(cE, sE);   e2  = SELECT(sE, cE);
+    t1  = SELECT(cT, sT);   t2  = SELECT(sT, cT);
+    b1  = SELECT(cB, sB);   b2  = SELECT(sB, cB);
+    ss1 = SELECT(cSS, sSS); ss2 = SELECT(sSS, cSS);
+    se1 = SELECT(cSE, sSE); se2 = SELECT(sSE, cSE);
+#undef SELECT
+
+    length = _mm_or_ps(_mm_or_ps(
+      _mm_and_ps(_mm_cmpge_ps(e2, _mm_sub_ps(_mm_sub_ps(s1, ms), sp)), 
+		 _mm_cmple_ps(e2, _mm_add_ps(_mm_add_ps(e1, ms), sp))),
+      _mm_and_ps(_mm_cmpge_ps(s2, _mm_sub_ps(_mm_sub_ps(s1, ms), sp)), 
+		 _mm_cmple_ps(s2, _mm_add_ps(_mm_add_ps(e1, ms), sp)))),
+      _mm_and_ps(_mm_cmple_ps(s2, _mm_add_ps(_mm_add_ps(s1, ms), sp)), 
+		 _mm_cmpge_ps(e2, _mm_sub_ps(_mm_sub_ps(e1, ms), sp))));
+
+    spectra = _mm_or_ps(_mm_or_ps(
+      _mm_and_ps(_mm_cmple_ps(ss2, _mm_add_ps(se1, sp)), _mm_cmpge_ps(ss2, _mm_sub_ps(ss1, sp))),
+      _mm_and_ps(_mm_cmpge_ps(se2, _mm_sub_ps(ss1, sp)), _mm_cmple_ps(se2, _mm_add_ps(se1, sp)))),
+      _mm_or_ps(
+      _mm_and_ps(_mm_cmple_ps(ss2, _mm_add_ps(ss1, sp)), _mm_cmpge_ps(se2, _mm_sub_ps(se1, sp))),
+      _mm_and_ps(_mm_cmpge_ps(ss2, _mm_add_ps(ss1, sp)), _mm_cmple_ps(se2, _mm_sub_ps(se1, sp)))));
+
+    laser = _mm_and_ps(
+      _mm_or_ps(_mm_and_ps(_mm_cmplt_ps(e2, s1), _mm_cmplt_ps(_mm_sub_ps(s1, lp), e2)),
+		_mm_and_ps(_mm_cmpgt_ps(s2, e1), _mm_cmpgt_ps(_mm_add_ps(e1, lp), s2))),
+      _mm_and_ps(
+	_mm_or_ps(_mm_cmplt_ps(t2, _mm_add_ps(t1, lp)), _mm_cmplt_ps(b2, _mm_add_ps(t1, lp))),
+	_mm_or_ps(_mm_cmpgt_ps(t2, _mm_sub_ps(b1, lp)), _mm_cmpgt_ps(b2, _mm_sub_ps(b1, lp)))));
+
+    mask |= unsigned(_mm_movemask_ps(_mm_or_ps(_mm_and_ps(length, spectra), 
+					       _mm_andnot_ps(length, laser)))) << h;
+  }
+
+  return mask;
 }
 
+//****************************************************************************
+// The conflictMask() kernel with AVX2: all 8 lanes at once. Only called
+// when the cpu supports AVX2 (see conflictMask()).
+//****************************************************************************
+__attribute__((target("avx2")))
+unsigned conflictMaskAvx2(const Slit &slit, const _columns_ &cols, float msPix, 
+			  float specPad, float laserPad) {
+  __m256 ms = _mm256_set1_ps(msPix), sp = _mm256_set1_ps(specPad), lp = _mm256_set1_ps(laserPad);
+  __m256 sS = _mm256_set1_ps(slit.slitStart), sE = _mm256_set1_ps(slit.slitEnd);
+  __m256 sT = _mm256_set1_ps(slit.slitTop), sB = _mm256_set1_ps(slit.slitBottom);
+  __m256 sSS = _mm256_set1_ps(slit.specStart), sSE = _mm256_set1_ps(slit.specEnd);
+  __m256 cS, cE, cT, cB, cSS, cSE, swap;
+  __m256 s1, e1, t1, b1, ss1, se1, s2, e2, t2, b2, ss2, se2;
+  __m256 length, spectra, laser;
+  unsigned mask;
+
+  cS  = _mm256_loadu_ps(cols.start);
+  cE  = _mm256_loadu_ps(cols.end);
+  cT  = _mm256_loadu_ps(cols.top);
+  cB  = _mm256_loadu_ps(cols.bottom);
+  cSS = _mm256_loadu_ps(cols.specStart);
+  cSE = _mm256_loadu_ps(cols.specEnd);
+
+  // All ones where the block slit comes first
+  swap = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(slit.id), 
+						_mm256_loadu_si256((const __m256i *) cols.id)));
+
+  s1  = _mm256_blendv_ps(sS, cS, swap);   s2  = _mm256_blendv_ps(cS, sS, swap);
+  e1  = _mm256_blendv_ps(sE, cE, swap);   e2  = _mm256_blendv_ps(cE, sE, swap);
+  t1  = _mm256_blendv_ps(sT, cT, swap);   t2  = _mm256_blendv_ps(cT, sT, swap);
+  b1  = _mm256_blendv_ps(sB, cB, swap);   b2  = _mm256_blendv_ps(cB, sB, swap);
+  ss1 = _mm256_blendv_ps(sSS, cSS, swap); ss2 = _mm256_blendv_ps(cSS, sSS, swap);
+  se1 = _mm256_blendv_ps(sSE, cSE, swap); se2 = _mm256_blendv_ps(cSE, sSE, swap);
+
+#define GE(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define LE(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define GT(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define LT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+  length = _mm256_or_ps(_mm256_or_ps(
+    _mm256_and_ps(GE(e2, _mm256_sub_ps(_mm256_sub_ps(s1, ms), sp)), 
+		  LE(e2, _mm256_add_ps(_mm256_add_ps(e1, ms), sp))),
+    _mm256_and_ps(GE(s2, _mm256_sub_ps(_mm256_sub_ps(s1, ms), sp)), 
+		  LE(s2, _mm256_add_ps(_mm256_add_ps(e1, ms), sp)))),
+    _mm256_and_ps(LE(s2, _mm256_add_ps(_mm256_add_ps(s1, ms), sp)), 
+		  GE(e2, _mm256_sub_ps(_mm256_sub_ps(e1, ms), sp))));
+
+  spectra = _mm256_or_ps(_mm256_or_ps(
+    _mm256_and_ps(LE(ss2, _mm256_add_ps(se1, sp)), GE(ss2, _mm256_sub_ps(ss1, sp))),
+    _mm256_and_ps(GE(se2, _mm256_sub_ps(ss1, sp)), LE(se2, _mm256_add_ps(se1, sp)))),
+    _mm256_or_ps(
+    _mm256_and_ps(LE(ss2, _mm256_add_ps(ss1, sp)), GE(se2, _mm256_sub_ps(se1, sp))),
+    _mm256_and_ps(GE(ss2, _mm256_add_ps(ss1, sp)), LE(se2, _mm256_sub_ps(se1, sp)))));
+
+  laser = _mm256_and_ps(
+    _mm256_or_ps(_mm256_and_ps(LT(e2, s1), LT(_mm256_sub_ps(s1, lp), e2)),
+		 _mm256_and_ps(GT(s2, e1), GT(_mm256_add_ps(e1, lp), s2))),
+    _mm256_and_ps(
+      _mm256_or_ps(LT(t2, _mm256_add_ps(t1, lp)), LT(b2, _mm256_add_ps(t1, lp))),
+      _mm256_or_ps(GT(t2, _mm256_sub_ps(b1, lp)), GT(b2, _mm256_sub_ps(b1, lp)))));
+#undef GE
+#undef LE
+#undef GT
+#undef LT
+
+  mask = unsigned(_mm256_movemask_ps(_mm256_blendv_ps(laser, spectra, length)));
+
+  // The callers are SSE code: leave no dirty upper halves behind, which
+  // would slow down every SSE instruction after the call
+  _mm256_zeroupper();
+
+  return mask;
+}
+#endif
+
+/*
+************************************************************************
+*+
+* FUNCTION: benchmarkConflicts
+*
+* RETURNS: n/a
+*
+* DESCRIPTION: Times 'sweeps' sweeps over the candidate pairs of 
+*              mapConflicts(), once with conflicts() on each pair and once
+*              with conflictMask() on blocks, and prints the number of
+*              tests per second of both (--benchmark).
+*
+* [NOTES:]: Both sweeps must find the same conflicts, a difference is
+*           reported as an error.
+*-
+************************************************************************
+*/
+void benchmarkConflicts(const map<int, Slit> &slitData, float microshufflePix,
+			DispDirection dispDirection, float pixelScale, int sweeps) {
+  SlitTable table(slitData, conflictReach(microshufflePix, pixelScale));
+  chrono::steady_clock::time_point begin;
+  double seconds[2];
+  long found[2] = {0, 0};
+  long pairs = 0;
+  vector<int> last(table.size());
+  string kernelName;
+  unsigned mask;
+  int r, i, j;
+
+  conflictKernel(&kernelName);
+
+  for (i = 0; i < table.size(); i++) {
+    last[i] = upper_bound(table.start.begin() + i + 1, table.start.end(), 
+			  table.end[i] + table.reach) - table.start.begin();
+    pairs += last[i] - i - 1;
+  }
+
+  // One pair at a time
+  begin = chrono::steady_clock::now();
+  for (r = 0; r < sweeps; r++) {
+    for (i = 0; i < table.size(); i++) {
+      for (j = i + 1; j < last[i]; j++) {
+	if (table.keys[i] < table.keys[j] ? 
+	    conflicts(*table.rows[i], *table.rows[j], microshufflePix, dispDirection, pixelScale) :
+	    conflicts(*table.rows[j], *table.rows[i], microshufflePix, dispDirection, pixelScale)) 
+	  found[0]++;
+      }
+    }
+  }
+  seconds[0] = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+  // BLOCK_SLITS pairs at a time
+  begin = chrono::steady_clock::now();
+  for (r = 0; r < sweeps; r++) {
+    for (i = 0; i < table.size(); i++) {
+      for (j = i + 1; j < last[i]; j += BLOCK_SLITS) {
+	mask = conflictMask(*table.rows[i], table.columns(j), min(BLOCK_SLITS, last[i] - j),
+			    microshufflePix, dispDirection, pixelScale);
+	found[1] += __builtin_popcount(mask);
+      }
+    }
+  }
+  seconds[1] = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+  printf("Benchmark: %d slits, %ld candidate pairs, %d sweeps\n", table.size(), pairs, sweeps);
+  printf("  conflicts():             %8.3f s, %8.2f Mtests/s\n", seconds[0], 
+	 pairs * double(sweeps) / max(seconds[0], 1e-9) / 1e6);
+  printf("  conflictMask() (%-6s): %8.3f s, %8.2f Mtests/s\n", kernelName.c_str(), seconds[1], 
+	 pairs * double(sweeps) / max(seconds[1], 1e-9) / 1e6);
+  printf("  Conflicts found: %ld\n", found[0] / sweeps);
+  if (found[0] != found[1]) {
+    printf("ERROR: conflictMask() found %ld conflicts, conflicts() %ld.\n", 
+	   found[1] / sweeps, found[0] / sweeps);
+  }
+}
+
+//****************************************************************************
+// The distance (in pixels) along the slit length axis within which two
+// slits can conflict: the spectral padding of conflicts(), or the laser
+// padding, whichever is larger.
+//****************************************************************************
+float conflictReach(float msPix, float pixelScale) {
+  float pad = msPix + MIN_SPEC_DIST / pixelScale;
+
+  if (pad < MAX_LASER_PAD) pad = MAX_LASER_PAD;
+
+  return pad + INDEX_MARGIN;
+}
+
+
 /*
 ************************************************************************
 *+
@@ -1831,25 +5445,31 @@ bool conflicts(Slit slitOne, Slit slitTwo, float msPix,
 * DESCRIPTION: Scan conflictGraph for Slits that conflict with slits in 
 *               placedSlits, remove those slits from slitData.
 *
-* [NOTES:]: O(n*m)
+* [NOTES:]: O(sum of the degrees of the placed slits)
 *-
 ************************************************************************
 */
 void removeConflicts(map<int, Slit> * slits, map<int, Slit> * placed,
-		     map<int, Slit> * removed, Graph conflictGraph) {
+		     map<int, Slit> * removed, const Graph &conflictGraph) {
   map<int, Slit>::iterator it;
-  vector<int>::iterator conIt;
-  vector<int> conflictList;
+  const int *nb;
+  int node;
+
+  // Work on a copy of the node states only, the graph itself is kept.
+  vector<char> alive = conflictGraph.alive;
 
   // Loop through placed slits, removing conflicts.
   for (it = placed->begin(); it != placed->end(); it++) {
-    // Retreive list of slits (their ID's really) conflicting with placed slit.
-    conflictList = conflictGraph.getNode((*it).first)->getList();
-
-    // Loop through slits and remove. 
-    for (conIt = conflictList.begin(); conIt != conflictList.end(); conIt++) {
-      conflictGraph.removeNode((*conIt));
-      removeSlit((*conIt), slits, removed);
+    node = conflictGraph.index((*it).first);
+    if (node < 0 || !alive[node]) continue;
+
+    // Loop through slits (their ID's really) conflicting with placed slit and remove. 
+    for (nb = conflictGraph.neighboursBegin(node); nb != conflictGraph.neighboursEnd(node); nb++) {
+      if (!alive[*nb]) continue;
+      alive[*nb] = 0;
+      // The graph may hold slits that are no longer available.
+      if (slits->count(conflictGraph.ids[*nb]) == 0) continue;
+      removeSlit(conflictGraph.ids[*nb], slits, removed);
     }
   }
 }
@@ -1867,7 +5487,7 @@ void removeConflicts(map<int, Slit> * slits, map<int, Slit> * placed,
 *-
 ************************************************************************
 */
-void loadFov(char *fovFile, float pixelScale, float crpix1, float crpix2, string dispDirection) {
+void loadFov(char *fovFile, float pixelScale, float crpix1, float crpix2, DispDirection dispDirection) {
 
   int num_fov = 0; // how many vertices for the field of view
   int num_dim = 0; // how many vertices for the overall dimensions (must be 4) 
@@ -1876,6 +5496,18 @@ void loadFov(char *fovFile, float pixelScale, float crpix1, float crpix2, string
   string line;
   vector<string> values;
 
+  // The extent of each detector gap in x and y
+  vector<float> gapxmin, gapxmax, gapymin, gapymax;
+  float x, y;
+  size_t gap;
+
+  fov.vertx.clear();
+  fov.verty.clear();
+  fov.dimx.clear();
+  fov.dimy.clear();
+  fov.gapStart.clear();
+  fov.gapEnd.clear();
+
   file.open(fovFile);
   if (!file.is_open()) {
     cout << "ERROR: Could not open file with FoV vertices: " << fovFile << endl; 
@@ -1900,6 +5532,24 @@ void loadFov(char *fovFile, float pixelScale, float crpix1, float crpix2, string
 	fov.verty.push_back( atof( values[2].c_str()) / pixelScale + crpix2);
 	num_fov++;
       }
+      // GAPn_CORNERm
+      if (line.compare(0, 3, "GAP") == 0 && line.find("_CORNER") != string::npos) {
+	values = stringSplit(line, " ");
+	gap = atoi(values[0].c_str() + 3);
+	if (gap < 1 || values.size() < 3) continue;
+	x = atof( values[1].c_str()) / pixelScale + crpix1;
+	y = atof( values[2].c_str()) / pixelScale + crpix2;
+	if (gap > gapxmin.size()) {
+	  gapxmin.resize(gap, x);
+	  gapxmax.resize(gap, x);
+	  gapymin.resize(gap, y);
+	  gapymax.resize(gap, y);
+	}
+	gapxmin[gap-1] = x < gapxmin[gap-1] ? x : gapxmin[gap-1];
+	gapxmax[gap-1] = x > gapxmax[gap-1] ? x : gapxmax[gap-1];
+	gapymin[gap-1] = y < gapymin[gap-1] ? y : gapymin[gap-1];
+	gapymax[gap-1] = y > gapymax[gap-1] ? y : gapymax[gap-1];
+      }
     }
   }
 
@@ -1936,7 +5586,7 @@ void loadFov(char *fovFile, float pixelScale, float crpix1, float crpix2, string
   float illumcenter_x  = (illumarea_xmin + illumarea_xmax) / 2.;
   float illumcenter_y  = (illumarea_ymin + illumarea_ymax) / 2.;
 
-  if (dispDirection == "horizontal") {
+  if (dispDirection == DISP_HORIZONTAL) {
     fov.vert_spatial  = fov.verty;
     fov.vert_spectral = fov.vertx;
     fov.totalwidth_spectral = (fov.dimx[3] + fov.dimx[2] - fov.dimx[1] - fov.dimx[0]) / 2.; // "average"
@@ -1958,6 +5608,20 @@ void loadFov(char *fovFile, float pixelScale, float crpix1, float crpix2, string
     fov.illumarea_spatial_center  = illumcenter_x;
     fov.illumarea_spectral_center = illumcenter_y;
   }
+  fov.slabs = FovSlabs(fov.vert_spectral, fov.vert_spatial);
+
+  // Only gaps narrower along the dispersion direction than across it
+  // cut the spectra
+  for (gap = 0; gap < gapxmin.size(); gap++) {
+    if (dispDirection == DISP_HORIZONTAL && gapxmax[gap] - gapxmin[gap] < gapymax[gap] - gapymin[gap]) {
+      fov.gapStart.push_back(gapxmin[gap]);
+      fov.gapEnd.push_back(gapxmax[gap]);
+    }
+    if (dispDirection == DISP_VERTICAL && gapymax[gap] - gapymin[gap] < gapxmax[gap] - gapxmin[gap]) {
+      fov.gapStart.push_back(gapymin[gap]);
+      fov.gapEnd.push_back(gapymax[gap]);
+    }
+  }
 }
 
 
@@ -1997,11 +5661,13 @@ void removeSlit(int sid, map<int, Slit> * slits, map<int, Slit> * removed) {
 *-
 ************************************************************************
 */
-void writeSlits(map<int, Slit> &placed, ofstream &outStream) {
+void writeSlits(map<int, Slit> &placed, ofstream &outStream, 
+		DispDirection dispDirection) {
 
   map<int, Slit>::iterator itSlits;
-  string line;
+  string rows;
   char temp[1024];
+  int n;
 
   // check if slits are tilted
   if (checkTilt(placed)) {
@@ -2009,23 +5675,37 @@ void writeSlits(map<int, Slit> &placed, ofstream &outStream) {
   } else {
     sprintf(temp, "#fits TILTSLIT= 0 / Non-zero if tilted slits are present\n");
   }
-  outStream.write(temp, strlen(temp));
+  rows += temp;
 
   // write the rest of the header
-  outStream.write("# End fits keywords\n", strlen("# End fits keywords\n"));
-  outStream.write("# End config entry\n\n", strlen("# End config entry\n\n"));
-  sprintf(temp,
-	  "ID	RA	DEC	x_ccd	y_ccd	slitpos_x	slitpos_y	slitsize_x	slitsize_y	slittilt	MAG	priority	slittype	redshift	specleft	specright	specbottom	spectop\n");
-  outStream.write(temp, strlen(temp));
-  sprintf(temp,
-	  "------	---------	---------	---------	---------	------	------	---------	---------	--------	---	--------	--------	--------	--------	---------	----------	-------\n");
-  outStream.write(temp, strlen(temp));
+  rows += "# End fits keywords\n";
+  rows += "# End config entry\n\n";
+  rows += "ID	RA	DEC	x_ccd	y_ccd	slitpos_x	slitpos_y	slitsize_x	slitsize_y	slittilt	MAG	priority	slittype	redshift	specleft	specright	specbottom	spectop\n";
+  rows += "------	---------	---------	---------	---------	------	------	---------	---------	--------	---	--------	--------	--------	--------	---------	----------	-------\n";
   
-  // Write placed slits to file...
+  // Format the placed slits, and write them to file at once
+  rows.reserve(rows.size() + placed.size() * 192);
   for (itSlits = placed.begin(); itSlits != placed.end(); itSlits++) {
-    line = (*itSlits).second.line;
-    outStream.write(line.c_str(), strlen(line.c_str()));
+    const Slit &slit = (*itSlits).second;
+    const _odfrow_ &odf = slit.odf;
+
+    if (dispDirection == DISP_HORIZONTAL) {
+      n = snprintf(temp, sizeof(temp),
+		   "%6d\t%10.5f\t%10.5f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%c\t%c\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\n",
+		   slit.id, odf.ra, odf.dec, odf.ccdW, odf.ccdL, odf.offsetW, odf.offsetL, 
+		   odf.width, odf.length, slit.angle, odf.mag, slit.priority, odf.type, 
+		   odf.redshift, odf.specLeft, odf.specRight, odf.specBottom, odf.specTop);
+    } else {
+      n = snprintf(temp, sizeof(temp),
+		   "%6d\t%10.5f\t%10.5f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%c\t%c\t%8.6f\t%8.6f\t%8.6f\t%8.6f\t%8.6f\n",
+		   slit.id, odf.ra, odf.dec, odf.ccdL, odf.ccdW, odf.offsetL, odf.offsetW, 
+		   odf.length, odf.width, slit.angle, odf.mag, slit.priority, odf.type, 
+		   odf.redshift, odf.specLeft, odf.specRight, odf.specBottom, odf.specTop);
+    }
+    rows.append(temp, n < int(sizeof(temp)) ? n : sizeof(temp) - 1);
   }
+
+  outStream.write(rows.data(), rows.size());
 }
 
 // Check if any of the placed slits is tilted
@@ -2078,43 +5758,24 @@ bool bandShuffleCheck(float bandSize, float slitLength, float ccdL) {
 /*
 ************************************************************************
 *+
-* FUNCTION: findMaxSpectrumSid
+* FUNCTION: spectrumDistance
 *
-* RETURNS: The slit id of the slit with the most spectral coverage on the CCD.
+* RETURNS: The (truncated) distance of a slit's spectrum from 'fovMid'.
 *
-* DESCRIPTION: Given a list of slit ids and a vector of slit objects return
-*  the one which is most likely to have the most of its spectrum fall on the
-*  detector.
+* DESCRIPTION: Slits whose spectra are closest to the center of the
+*  field of view (in the spatial dimension, i.e. y-axis for GMOS) are the
+*  most likely to have most of their spectrum fall on the detector, and 
+*  are placed first amongst slits with the same number of conflicts.
 *
-* [NOTES:]:
+* [NOTES:]: Truncated to whole pixels, so that slits closer than one
+*  pixel to each other are placed in order of their id.
 *-
 ************************************************************************
 */
-int findMaxSpectrumSid(vector<int> *slitIds, map<int, Slit> *slits, float fovMid) {
-
-  int sid = 0;
-  unsigned int i;
-  float minDist = 32000;
-  Slit cur;
-  float curSpec;
-  float curDist;
-  int curId;
-
-  // Find the slit whose spectrum is closest to being in the center of the
-  // field of view (center refers to the spatial dimension, i.e. y-axis for GMOS)
-  for (i = 0; i < (*slitIds).size(); i++) {
-    curId = (*slitIds)[i];
-    cur = (*slits)[curId];
-    curSpec = cur.ccdL + cur.specPosL;
-    curDist = (int) abs(fovMid - curSpec);
-
-    if (curDist < minDist) {
-      minDist = curDist;
-      sid = curId;
-    }
-  }
+int spectrumDistance(const Slit &slit, float fovMid) {
+  float curSpec = slit.ccdL + slit.specPosL;
 
-  return sid;
+  return (int) abs(fovMid - curSpec);
 }
 
 /*
@@ -2142,41 +5803,173 @@ void printIntro(char slitMode) {
   else {
     printf("SLIT SELECTION MODE: Normal\n\n");
   }
-}
+}
+
+void printIntroError(int argc) {
+  //Invalid input params.
+  printf("----------------------------------------------------\n");
+  printf("SPOC: SLIT POSITIONING OPTIMIZATION CODE\n\n");
+  printf("ERROR: Invalid command line arguments: EXIT\n\n");
+  printf(
+	 "USAGE: gmMakeMasks <inFilename> <outFilename> <slitWidth> <specLen> <anamorphic>, argc=%d\n",
+	 argc);
+  printf(
+	 "\t<centralWavelength> <linear dispersion> <lambda1Max> <lambda2Min> \n");
+  printf("\t<pixelScale> <numMasks> <option> <debugLevel> \n");
+  printf("DETAILS:\nPARM 1: input file name\n");
+  printf("PARM 2: output file name without extention\n");
+  printf("PARM 3: field of view config filename\n");
+  printf("PARM 4: slitWidth(pix), 0 indicates used input file values\n");
+  printf("PARM 5: spectra length(pix)\n");
+  printf("PARM 6: spectra anamorphic factor\n");
+  printf("PARM 7: central wavelength\n");
+  printf("PARM 8: Linear dispersion\n");
+  printf("PARM 9: Lambda 1 max\n");
+  printf("PARM 10: Lambda 2 min\n");
+  printf("PARM 11: pixelScale conversion factor\n");
+  printf("PARM 12: number of masks\n");
+  printf("PARM 13: type of algorithm:N/n=Normal_Opt M/m=Max_Opt\n");
+  printf("    N=do not change object X-dimension distribution\n");
+  printf("    M=get more objects but small ones are favored\n");
+  printf("PARM 14: Debug level, 0=none, to 3=max\n");
+  printf("PARM 15: Dispersion direction (horizontal or vertical)\n");
+  printf("PARM 16: DET_IMG (detector ID)\n");
+  printf("PARM 17: DET_SPEC (detector ID)\n");
+  printf("PARM 18: RA of the preimage\n");
+  printf("PARM 19: DEC of the preimage\n");
+  printf("OPTIONS: --restarts N --threads T --seed S --time-budget-ms B\n");
+  printf("         --assign joint|sequential (joint: no --restarts) --benchmark R\n");
+  printf("         --sweep 'minpixsep=3,4 wiggle=0,0.2 mode=N,M pack=0,1 masks=1,2'\n");
+  printf("         --sweep-write none|best|all|1,4,...\n");
+  printf("         --optimize 'pa=-10:10:2 dx=-5:5:2.5 dy=-5:5:2.5 refine=2 weights=4,2,1'\n");
+  printf("         --optimize-catalog <catalog>.dat_all\n");
+  printf("         --cwl 'cwl=600:800:25 grating=R400 range=520,950'\n");
+  printf("         --deadline-ms D --progress 0|1 --parse-benchmark N\n");
+  printf("SERVICE: gmMakeMasks --serve (one request per line on stdin)\n");
+  printf("----------------------------------------------------\n");
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: parseOptions
+*
+* RETURNS: The number of arguments left in argv, -1 on error.
+*
+* DESCRIPTION: Reads the '--name value' options from argv into 'options'
+*              (and numThreads), and removes them from argv. 
+*
+* [NOTES:]: --restarts N  greedy passes per mask, the best one is kept
+*           --threads T   number of worker threads
+*           --seed S      seed of the first randomized pass
+*           --time-budget-ms B  milliseconds of local search per pass
+*           --assign joint|sequential  how objects are assigned to masks;
+*                          a joint assignment is made once, --restarts 
+*                          does not apply
+*           --benchmark R  time R sweeps of conflict tests, and exit
+*           --sweep G      design the masks of each parameter set of the 
+*                          grid G (see parseSweep()), print a table
+*           --sweep-write W  write the ODFs of the sweep sets W: none, 
+*                          best, all or a list like 1,4
+*           --optimize G   design the masks at each position angle and 
+*                          pointing of the grid G (see parseOptimize()), 
+*                          and report the best one
+*           --optimize-catalog F  the catalogue the optimizer moves, 
+*                          with the objects outside the field of view
+*                          (the <catalog>.dat_all of gmmps_spoc.tcl); 
+*                          the input catalogue if not given
+*           --cwl C        design the masks at each central wavelength of
+*                          C (see parseCwl()), print a table
+*           --deadline-ms D  milliseconds for the whole run: no more 
+*                          passes, local search, placement, wiggling or
+*                          slit expansion after it (see pastDeadline())
+*           --progress 0|1  print '@PROGRESS' lines (see printProgress())
+*           --parse-benchmark N  time the catalogue parser on N synthetic
+*                          lines, and exit
+*-
+************************************************************************
+*/
+int parseOptions(int argc, char *argv[]) {
+  int i, n = 1;
+  bool ok;
+  char *end;
+
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      argv[n++] = argv[i];
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      printf("ERROR: Option %s needs a value.\n", argv[i]);
+      return (-1);
+    }
+
+    if (strcmp(argv[i], "--restarts") == 0) {
+      ok = stringToInt(argv[i+1], options.restarts) && options.restarts >= 1;
+    }
+    else if (strcmp(argv[i], "--threads") == 0) {
+      ok = stringToInt(argv[i+1], numThreads) && numThreads >= 1;
+    }
+    else if (strcmp(argv[i], "--seed") == 0) {
+      options.seed = strtoul(argv[i+1], &end, 10);
+      ok = *argv[i+1] != 0 && *end == 0;
+    }
+    else if (strcmp(argv[i], "--assign") == 0) {
+      options.jointMasks = strcmp(argv[i+1], "joint") == 0;
+      ok = options.jointMasks || strcmp(argv[i+1], "sequential") == 0;
+    }
+    else if (strcmp(argv[i], "--time-budget-ms") == 0) {
+      options.timeBudget = strtol(argv[i+1], &end, 10);
+      ok = *argv[i+1] != 0 && *end == 0 && options.timeBudget >= 0;
+    }
+    else if (strcmp(argv[i], "--benchmark") == 0) {
+      ok = stringToInt(argv[i+1], options.benchmark) && options.benchmark >= 1;
+    }
+    else if (strcmp(argv[i], "--sweep") == 0) {
+      options.sweep = argv[i+1];
+      ok = !options.sweep.empty();
+    }
+    else if (strcmp(argv[i], "--sweep-write") == 0) {
+      options.sweepWrite = argv[i+1];
+      ok = !options.sweepWrite.empty();
+    }
+    else if (strcmp(argv[i], "--optimize") == 0) {
+      options.optimize = argv[i+1];
+      ok = !options.optimize.empty();
+    }
+    else if (strcmp(argv[i], "--optimize-catalog") == 0) {
+      options.optimizeCat = argv[i+1];
+      ok = !options.optimizeCat.empty();
+    }
+    else if (strcmp(argv[i], "--cwl") == 0) {
+      options.cwl = argv[i+1];
+      ok = !options.cwl.empty();
+    }
+    else if (strcmp(argv[i], "--deadline-ms") == 0) {
+      options.deadline = strtol(argv[i+1], &end, 10);
+      ok = *argv[i+1] != 0 && *end == 0 && options.deadline >= 0;
+    }
+    else if (strcmp(argv[i], "--progress") == 0) {
+      options.progress = strcmp(argv[i+1], "1") == 0;
+      ok = options.progress || strcmp(argv[i+1], "0") == 0;
+    }
+    else if (strcmp(argv[i], "--parse-benchmark") == 0) {
+      ok = stringToInt(argv[i+1], options.parseBenchmark) && options.parseBenchmark >= 1;
+    }
+    else {
+      printf("ERROR: Unknown option %s\n", argv[i]);
+      return (-1);
+    }
+
+    if (!ok) {
+      printf("ERROR: Invalid value '%s' for option %s\n", argv[i+1], argv[i]);
+      return (-1);
+    }
+    i++;
+  }
 
-void printIntroError(int argc) {
-  //Invalid input params.
-  printf("----------------------------------------------------\n");
-  printf("SPOC: SLIT POSITIONING OPTIMIZATION CODE\n\n");
-  printf("ERROR: Invalid command line arguments: EXIT\n\n");
-  printf(
-	 "USAGE: gmMakeMasks <inFilename> <outFilename> <slitWidth> <specLen> <anamorphic>, argc=%d\n",
-	 argc);
-  printf(
-	 "\t<centralWavelength> <linear dispersion> <lambda1Max> <lambda2Min> \n");
-  printf("\t<pixelScale> <numMasks> <option> <debugLevel> \n");
-  printf("DETAILS:\nPARM 1: input file name\n");
-  printf("PARM 2: output file name without extention\n");
-  printf("PARM 3: field of view config filename\n");
-  printf("PARM 4: slitWidth(pix), 0 indicates used input file values\n");
-  printf("PARM 5: spectra length(pix)\n");
-  printf("PARM 6: spectra anamorphic factor\n");
-  printf("PARM 7: central wavelength\n");
-  printf("PARM 8: Linear dispersion\n");
-  printf("PARM 9: Lambda 1 max\n");
-  printf("PARM 10: Lambda 2 min\n");
-  printf("PARM 11: pixelScale conversion factor\n");
-  printf("PARM 12: number of masks\n");
-  printf("PARM 13: type of algorithm:N/n=Normal_Opt M/m=Max_Opt\n");
-  printf("    N=do not change object X-dimension distribution\n");
-  printf("    M=get more objects but small ones are favored\n");
-  printf("PARM 14: Debug level, 0=none, to 3=max\n");
-  printf("PARM 15: Dispersion direction (horizontal or vertical)\n");
-  printf("PARM 16: DET_IMG (detector ID)\n");
-  printf("PARM 17: DET_SPEC (detector ID)\n");
-  printf("PARM 18: RA of the preimage\n");
-  printf("PARM 19: DEC of the preimage\n");
-  printf("----------------------------------------------------\n");
+  return n;
 }
 
 /*
@@ -2295,7 +6088,7 @@ Slit::Slit(int Id, char Priority, float start, float end) {
 
 Slit::Slit(int Id, char Priority, float start, float end, float len, float posL,
 	   float posW, float width, float top, float bottom, float specPL,
-	   float specPW, float Angle, float wiggleFact, string ln, float w1, float w2) {
+	   float specPW, float Angle, float wiggleFact, const _odfrow_ &row, float w1, float w2) {
   this->id = Id;
   this->priority = Priority;
   this->slitStart = start;
@@ -2304,7 +6097,8 @@ Slit::Slit(int Id, char Priority, float start, float end, float len, float posL,
   this->ccdL = posL;
   this->ccdW = posW;
   this->slitWidth = width;
-  this->line = ln;
+  this->odf = row;
+  this->redshift = row.redshift;
   this->slitTop = top;
   this->slitBottom = bottom;
   this->specPosL = specPL;
@@ -2331,8 +6125,7 @@ Slit::Slit(int Id, char Priority, float start, float end, float len, float posL,
  *  Change the position of this slit.
  *
  */
-int Slit::changePosition(float deltaW, float deltaL, float pixelScale,
-			 string dispDirection) {
+int Slit::changePosition(float deltaW, float deltaL, float pixelScale) {
   // Edit slit class values.
   this->ccdL += deltaL;
   this->ccdW += deltaW;
@@ -2340,245 +6133,797 @@ int Slit::changePosition(float deltaW, float deltaL, float pixelScale,
   this->slitEnd += deltaL;
   this->slitTop += deltaW;
   this->slitBottom += deltaW;
-  vector < string > lD;   // (formerly "lineData")
-  float slitPosW = 0.0;
-  float slitPosL = 0.0;
-
-  // Unpack, edit and repack 'line' string.
-
-  lD = stringSplit(this->line, "\t");
-
-  // lD[0];   ID
-  // lD[1];   RA
-  // lD[2];   DEC
-  // lD[3];   XCCD
-  // lD[4];   YCCD
-  // lD[7];   SIZEX
-  // lD[8];   SIZEY
-  // lD[9];   TILT
-  // lD[10];  MAG
-  // lD[11];  PRIO
-  // lD[12];  TYPE
-  // lD[13];  REDSHIFT
-  // lD[14];  SPECLEFT
-  // lD[15];  SPECRIGHT
-  // lD[16];  SPECBOTTOM
-  // lD[17];  SPECTOP
-
-  // cleanup last string
-  lD[17].erase(lD[17].find_last_not_of(" \t\r\n") + 1);
-
-  if (dispDirection == "horizontal") {
-    stringToFloat(lD[5], slitPosW);  // XOFFSET
-    stringToFloat(lD[6], slitPosL);  // YOFFSET
+
+  // The slit offsets written to the ODF (arcsec)
+  this->odf.offsetL += deltaL * pixelScale;
+  this->odf.offsetW += deltaW * pixelScale;
+
+  return 0;
+}
+
+/*
+************************************************************************
+*+
+* CLASS: SlitTable
+*
+* DESCRIPTION: Sweep-line index over the slit length axis. Slits are 
+* sorted by slitStart, so that all slits whose (padded) extent overlaps
+* a given interval are found with a binary search and a short scan.
+* The slit edges and priorities are held in contiguous columns (one
+* entry per row), which conflictMask() reads BLOCK_SLITS rows at a time.
+*
+*-
+************************************************************************
+*/
+
+// Builds the table. 'Reach' is the padding along the slit length axis.
+SlitTable::SlitTable(const map<int, Slit> &slitData, float Reach) {
+  map<int, Slit>::const_iterator it;
+  vector< pair<float, int> > order;
+  int i;
+
+  this->reach = Reach;
+  this->maxLength = 0;
+
+  // Order by slitStart, and by id for equal starts
+  order.reserve(slitData.size());
+  for (it = slitData.begin(); it != slitData.end(); it++) {
+    order.push_back(pair<float, int>((*it).second.slitStart, (*it).first));
+    if ((*it).second.slitEnd - (*it).second.slitStart > this->maxLength)
+      this->maxLength = (*it).second.slitEnd - (*it).second.slitStart;
   }
-  else {
-    stringToFloat(lD[5], slitPosL);  // XOFFSET
-    stringToFloat(lD[6], slitPosW);  // YOFFSET
+  sort(order.begin(), order.end());
+
+  this->keys.resize(order.size());
+  this->rows.resize(order.size());
+  this->priority.resize(order.size());
+  this->start.resize(order.size());
+  this->end.resize(order.size());
+  this->top.resize(order.size());
+  this->bottom.resize(order.size());
+  this->specStart.resize(order.size());
+  this->specEnd.resize(order.size());
+  for (i = 0; i < int(order.size()); i++) {
+    it = slitData.find(order[i].second);
+    const Slit &slit = (*it).second;
+    this->keys[i]      = (*it).first;
+    this->rows[i]      = &slit;
+    this->priority[i]  = slit.priority;
+    this->start[i]     = slit.slitStart;
+    this->end[i]       = slit.slitEnd;
+    this->top[i]       = slit.slitTop;
+    this->bottom[i]    = slit.slitBottom;
+    this->specStart[i] = slit.specStart;
+    this->specEnd[i]   = slit.specEnd;
   }
+}
 
-  slitPosL += deltaL * pixelScale;
-  slitPosW += deltaW * pixelScale;
+// Collects the ids of all slits whose extent, padded by 'reach', overlaps
+// with [Start, End].
+void SlitTable::query(float Start, float End, vector<int> &found) const {
+  int i, last;
 
-  char lineChar[512];
-  if (dispDirection == "horizontal") {
-    sprintf(lineChar,
-	    "%s\t%s\t%s\t%s\t%s\t%8.6f\t%8.6f\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
-	    lD[0].c_str(), lD[1].c_str(), lD[2].c_str(), lD[3].c_str(), lD[4].c_str(), 
-	    slitPosW, slitPosL, lD[7].c_str(), lD[8].c_str(), lD[9].c_str(), lD[10].c_str(),
-	    lD[11].c_str(), lD[12].c_str(), lD[13].c_str(), lD[14].c_str(), lD[15].c_str(),
-	    lD[16].c_str(), lD[17].c_str());
-  } 
-  else {
-    sprintf(lineChar,
-	    "%s\t%s\t%s\t%s\t%s\t%8.6f\t%8.6f\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
-	    lD[0].c_str(), lD[1].c_str(), lD[2].c_str(), lD[3].c_str(), lD[4].c_str(), 
-	    slitPosL, slitPosW, lD[7].c_str(), lD[8].c_str(), lD[9].c_str(), lD[10].c_str(),
-	    lD[11].c_str(), lD[12].c_str(), lD[13].c_str(), lD[14].c_str(), lD[15].c_str(),
-	    lD[16].c_str(), lD[17].c_str());
+  // No slit longer than maxLength, so earlier slits cannot reach 'Start'
+  i    = lower_bound(this->start.begin(), this->start.end(), 
+		     Start - this->reach - this->maxLength) - this->start.begin();
+  last = upper_bound(this->start.begin(), this->start.end(), 
+		     End + this->reach) - this->start.begin();
+
+  for (; i < last; i++) {
+    if (this->end[i] >= Start - this->reach) {
+      found.push_back(this->keys[i]);
+    }
   }
+}
 
-  this->line = lineChar;
+// The columns of the table from row 'first' on
+_columns_ SlitTable::columns(int first) const {
+  _columns_ c;
+
+  c.id        = &this->keys[first];
+  c.priority  = &this->priority[first];
+  c.start     = &this->start[first];
+  c.end       = &this->end[first];
+  c.top       = &this->top[first];
+  c.bottom    = &this->bottom[first];
+  c.specStart = &this->specStart[first];
+  c.specEnd   = &this->specEnd[first];
+  return c;
+}
 
-  return 0;
+int SlitTable::size() const {
+  return this->keys.size();
 }
 
-bool Slit::stringToFloat(const string &s, float &i) {
-  istringstream myStream(s);
+// The number of pairs the sweep of mapConflicts() tests for these slits:
+// those close enough along the slit length axis.
+long SlitTable::pairs() const {
+  long n = 0;
+  int i;
 
-  if (myStream >> i)
-    return true;
-  else
-    return false;
+  for (i = 0; i < this->size(); i++) {
+    n += upper_bound(this->start.begin() + i + 1, this->start.end(), 
+		     this->end[i] + this->reach) - this->start.begin() - i - 1;
+  }
+  return n;
 }
 
-vector<string> Slit::stringSplit(string str, string delim) {
-  vector < string > results;
+/*
+************************************************************************
+*+
+* CLASS: SlitBlock
+*
+* DESCRIPTION: Up to BLOCK_SLITS slits gathered into columns for 
+* conflictMask(), for the callers that test a slit against slits that are
+* not next to each other in a SlitTable. conflictMask() ignores the 
+* entries past 'size'.
+*
+*-
+************************************************************************
+*/
 
-  int cutAt;
-  while (int((cutAt = str.find_first_of(delim))) != int(str.npos)) {
-    if (cutAt > 0) {
-      results.push_back(str.substr(0, cutAt));
-    }
-    str = str.substr(cutAt + 1);
-  }
+SlitBlock::SlitBlock() {
+  memset(this->id, 0, sizeof(this->id));
+  memset(this->priority, 0, sizeof(this->priority));
+  memset(this->start, 0, sizeof(this->start));
+  memset(this->end, 0, sizeof(this->end));
+  memset(this->top, 0, sizeof(this->top));
+  memset(this->bottom, 0, sizeof(this->bottom));
+  memset(this->specStart, 0, sizeof(this->specStart));
+  memset(this->specEnd, 0, sizeof(this->specEnd));
+  this->size = 0;
+}
 
-  if (str.length() > 0) {
-    results.push_back(str);
+// Appends a slit. The block must not be full.
+void SlitBlock::add(const Slit &slit) {
+  this->id[this->size]        = slit.id;
+  this->priority[this->size]  = slit.priority;
+  this->start[this->size]     = slit.slitStart;
+  this->end[this->size]       = slit.slitEnd;
+  this->top[this->size]       = slit.slitTop;
+  this->bottom[this->size]    = slit.slitBottom;
+  this->specStart[this->size] = slit.specStart;
+  this->specEnd[this->size]   = slit.specEnd;
+  this->size++;
+}
+
+// Appends the first 'count' slits of the given columns
+void SlitBlock::add(const _columns_ &cols, int count) {
+  int k;
+
+  for (k = 0; k < count && this->size < BLOCK_SLITS; k++) {
+    this->id[this->size]        = cols.id[k];
+    this->priority[this->size]  = cols.priority[k];
+    this->start[this->size]     = cols.start[k];
+    this->end[this->size]       = cols.end[k];
+    this->top[this->size]       = cols.top[k];
+    this->bottom[this->size]    = cols.bottom[k];
+    this->specStart[this->size] = cols.specStart[k];
+    this->specEnd[this->size]   = cols.specEnd[k];
+    this->size++;
   }
+}
 
-  return results;
+bool SlitBlock::full() const {
+  return this->size == BLOCK_SLITS;
+}
+
+_columns_ SlitBlock::columns() const {
+  _columns_ c;
+
+  c.id        = this->id;
+  c.priority  = this->priority;
+  c.start     = this->start;
+  c.end       = this->end;
+  c.top       = this->top;
+  c.bottom    = this->bottom;
+  c.specStart = this->specStart;
+  c.specEnd   = this->specEnd;
+  return c;
 }
 
 /*
 ************************************************************************
 *+
-* CLASS: GraphNode
+* CLASS: Graph
 *
-* DESCRIPTION: Element class for following Graph class.
+* DESCRIPTION: A conflict graph with dense node ids and contiguous
+* (compressed sparse row) adjacency. Nodes are removed by flagging them
+* dead and updating the degrees of their neighbours, O(degree).
 *
 *-
 ************************************************************************
 */
 
-GraphNode::GraphNode() {
-  this->id = -1;
+Graph::Graph() {
+  this->numAlive = 0;
+  this->matrixWords = 0;
 }
 
-GraphNode::GraphNode(int Id) {
-  this->id = Id;
+// Builds the graph from the (sorted) slit ids and the list of conflicting
+// slit id pairs.
+void Graph::build(const vector<int> &Ids, const vector< pair<int, int> > &edges) {
+  vector< pair<int, int> >::const_iterator edge;
+  vector<int> fill;
+  int n, u, v, i;
+
+  this->ids = Ids;
+  n = this->ids.size();
+
+  // Count the degrees, then distribute the neighbours.
+  this->degree.assign(n, 0);
+  for (edge = edges.begin(); edge != edges.end(); edge++) {
+    this->degree[this->index((*edge).first)]++;
+    this->degree[this->index((*edge).second)]++;
+  }
+
+  this->adjStart.assign(n + 1, 0);
+  for (i = 0; i < n; i++) {
+    this->adjStart[i+1] = this->adjStart[i] + this->degree[i];
+  }
+
+  this->adj.resize(this->adjStart[n]);
+  fill.assign(this->adjStart.begin(), this->adjStart.end() - 1);
+  for (edge = edges.begin(); edge != edges.end(); edge++) {
+    u = this->index((*edge).first);
+    v = this->index((*edge).second);
+    this->adj[fill[u]++] = v;
+    this->adj[fill[v]++] = u;
+  }
+
+  // Neighbours in order of increasing slit id
+  for (i = 0; i < n; i++) {
+    sort(this->adj.begin() + this->adjStart[i], this->adj.begin() + this->adjStart[i+1]);
+  }
+
+  this->alive.assign(n, 1);
+  this->numAlive = n;
+
+  this->matrix.clear();
+  this->matrixWords = 0;
+  if (n <= BITSET_MAX_NODES) {
+    this->matrixWords = (n + 63) / 64;
+    this->matrix.assign((size_t) n * this->matrixWords, 0);
+    for (u = 0; u < n; u++) {
+      for (i = this->adjStart[u]; i < this->adjStart[u+1]; i++) {
+	v = this->adj[i];
+	this->matrix[(size_t) u * this->matrixWords + v / 64] |= 1ULL << (v % 64);
+      }
+    }
+  }
 }
 
-// Add an item to this GraphNode's adjList.
-void GraphNode::addAdj(int addID) {
-  this->adjList.push_back(addID);
+// Clears the graph.
+void Graph::clear() {
+  this->ids.clear();
+  this->adjStart.clear();
+  this->adj.clear();
+  this->alive.clear();
+  this->degree.clear();
+  this->matrix.clear();
+  this->matrixWords = 0;
+  this->numAlive = 0;
 }
 
-// Remove an id from this GraphNode's adjList.
-void GraphNode::removeAdj(int targetID) {
-  vector<int>::iterator it;
+// Returns the node of a slit id, or -1 if the slit is not in the graph.
+int Graph::index(int sid) const {
+  vector<int>::const_iterator it = lower_bound(this->ids.begin(), this->ids.end(), sid);
 
-  // search for target item and remove:
-  for (it = this->adjList.begin(); it != this->adjList.end(); it++) {
-    if (*it == targetID) {
-      this->adjList.erase(it);
-      break;
-    }
+  if (it == this->ids.end() || *it != sid) return -1;
+  return it - this->ids.begin();
+}
+
+// Removes a node (and thereby its edges) from the Graph.
+void Graph::removeNode(int node) {
+  const int *nb;
+
+  if (node < 0 || !this->alive[node]) return;
+
+  this->alive[node] = 0;
+  this->numAlive--;
+
+  for (nb = this->neighboursBegin(node); nb != this->neighboursEnd(node); nb++) {
+    this->degree[*nb]--;
+  }
+}
+
+// The neighbours of a node, dead or alive. No neighbours for node -1.
+const int * Graph::neighboursBegin(int node) const {
+  if (node < 0) return 0;
+  return this->adj.data() + this->adjStart[node];
+}
+
+const int * Graph::neighboursEnd(int node) const {
+  if (node < 0) return 0;
+  return this->adj.data() + this->adjStart[node+1];
+}
+
+// Returns true if two nodes are connected (dead or alive).
+bool Graph::adjacent(int u, int v) const {
+  if (this->matrixWords > 0) {
+    return (this->matrix[(size_t) u * this->matrixWords + v / 64] >> (v % 64)) & 1ULL;
   }
+
+  return binary_search(this->adj.begin() + this->adjStart[u], 
+		       this->adj.begin() + this->adjStart[u+1], v);
 }
 
-vector<int> GraphNode::getList() {
-  return this->adjList;
+// Returns true if the Graph has no alive nodes.
+bool Graph::empty() const {
+  return this->numAlive == 0;
 }
 
-int GraphNode::getDegree() {
-  return this->adjList.size();
+// The number of alive nodes.
+int Graph::size() const {
+  return this->numAlive;
+}
+
+// The number of nodes, dead or alive.
+int Graph::nodes() const {
+  return this->ids.size();
 }
 
 /*
 ************************************************************************
 *+
-* CLASS: Graph
+* CLASS: DegreeQueue
+*
+* DESCRIPTION: Bucket priority queue over the alive nodes of a Graph,
+* keyed on (degree, distance key, node). Degrees only ever decrease while
+* slits are placed, so the lowest non-empty bucket is found in amortized
+* constant time; moving a node between buckets is O(log n).
 *
-* DESCRIPTION: An adjacency-list type graph data structure.
+*-
+************************************************************************
+*/
+
+DegreeQueue::DegreeQueue(const Graph &graph, const vector<int> &Key) {
+  int i, maxDegree = 0;
+
+  this->key = Key;
+
+  for (i = 0; i < graph.nodes(); i++) {
+    if (graph.alive[i] && graph.degree[i] > maxDegree) maxDegree = graph.degree[i];
+  }
+
+  this->buckets.resize(maxDegree + 1);
+  for (i = 0; i < graph.nodes(); i++) {
+    if (graph.alive[i]) {
+      this->buckets[graph.degree[i]].insert(pair<int, int>(this->key[i], i));
+    }
+  }
+
+  this->minDegree = 0;
+}
+
+// Returns the alive node with the lowest degree, the smallest key and the
+// smallest id, in that order. -1 if the queue is empty.
+int DegreeQueue::top() {
+  int n = this->buckets.size();
+
+  while (this->minDegree < n && this->buckets[this->minDegree].empty()) {
+    this->minDegree++;
+  }
+
+  if (this->minDegree == n) return -1;
+
+  return (*this->buckets[this->minDegree].begin()).second;
+}
+
+// Removes a node from the graph, and moves its alive neighbours into the
+// bucket of their new degree.
+void DegreeQueue::removeNode(Graph &graph, int node) {
+  const int *nb;
+  int d;
+
+  if (node < 0 || !graph.alive[node]) return;
+
+  this->buckets[graph.degree[node]].erase(pair<int, int>(this->key[node], node));
+
+  for (nb = graph.neighboursBegin(node); nb != graph.neighboursEnd(node); nb++) {
+    if (!graph.alive[*nb]) continue;
+    d = graph.degree[*nb];
+    this->buckets[d].erase(pair<int, int>(this->key[*nb], *nb));
+    this->buckets[d-1].insert(pair<int, int>(this->key[*nb], *nb));
+    if (d - 1 < this->minDegree) this->minDegree = d - 1;
+  }
+
+  graph.removeNode(node);
+}
+
+/*
+************************************************************************
+*+
+* CLASS: UnionFind
 *
+* DESCRIPTION: Disjoint sets over the nodes 0..n-1, with path compression
+* and union by rank.
 *
 *-
 ************************************************************************
 */
 
-// Adds a GraphNode to the Graph
-void Graph::addNode(int targetID) {
-  elements[targetID] = GraphNode(targetID);
+UnionFind::UnionFind(int n) {
+  int i;
+
+  this->parent.resize(n);
+  this->rank.assign(n, 0);
+  for (i = 0; i < n; i++) this->parent[i] = i;
 }
 
-// Removes a GraphNode from the Graph
-void Graph::removeNode(int nid) {
-  vector<GraphNode>::iterator it;
+// Returns the representative of the set holding node i.
+int UnionFind::find(int i) {
+  int root = i, next;
+
+  while (this->parent[root] != root) root = this->parent[root];
 
-  // Remove all edges connected to this node.
-  this->clearEdges(&elements[nid]);
+  while (this->parent[i] != root) {
+    next = this->parent[i];
+    this->parent[i] = root;
+    i = next;
+  }
 
-  // Remove element.
-  elements.erase(nid);
+  return root;
 }
 
-// Clears the graph.
-void Graph::clear() {
-  map<int, GraphNode>::iterator it;
+// Merges the sets holding nodes i and j.
+void UnionFind::unite(int i, int j) {
+  i = this->find(i);
+  j = this->find(j);
+  if (i == j) return;
+
+  if (this->rank[i] < this->rank[j]) swap(i, j);
+  this->parent[j] = i;
+  if (this->rank[i] == this->rank[j]) this->rank[i]++;
+}
+
+/*
+************************************************************************
+*+
+* CLASS: IndependentSet
+*
+* DESCRIPTION: Largest set of mutually non-conflicting slits in a small
+* conflict graph, by branch and bound over 64 bit node sets. Nodes with at
+* most one conflict left are always taken, otherwise the search branches on
+* the node with the most conflicts. Branches are bounded by a greedy clique
+* cover of the remaining nodes: no two slits of a clique can be placed.
+*
+*-
+************************************************************************
+*/
+
+// Copies the sub-graph of a Graph spanned by 'members' (nodes of the
+// Graph, sorted). key[] holds the distance keys of all Graph nodes.
+IndependentSet::IndependentSet(const Graph &graph, const vector<int> &members,
+			       const vector<int> &Key) {
+  vector<int>::const_iterator found;
+  const int *nb;
+  int i;
 
-  for (it = elements.begin(); it != elements.end(); it++) {
-    removeNode((*it).first);
+  this->n = members.size();
+  this->key.resize(this->n);
+  this->best = 0;
+  this->bestSize = 0;
+  this->branches = 0;
+
+  for (i = 0; i < this->n; i++) {
+    this->key[i] = Key[members[i]];
+    this->adj[i] = 0;
+    for (nb = graph.neighboursBegin(members[i]); nb != graph.neighboursEnd(members[i]); nb++) {
+      if (!graph.alive[*nb]) continue;
+      found = lower_bound(members.begin(), members.end(), *nb);
+      this->adj[i] |= 1ULL << (found - members.begin());
+    }
   }
 }
 
-// Adds an edge between two GraphNodes.
-void Graph::addEdge(GraphNode * node1, GraphNode * node2) {
-  node1->addAdj(node2->id);
-  node2->addAdj(node1->id);
+// The selection of placeSlits(): repeatedly take the node with the fewest
+// conflicts (then the smallest key, then the lowest node) and drop its
+// neighbours.
+unsigned long long IndependentSet::greedy() const {
+  unsigned long long left, chosen = 0;
+  int i, v, d, minDegree;
+
+  left = this->n == 64 ? ~0ULL : (1ULL << this->n) - 1;
+
+  while (left) {
+    v = -1;
+    minDegree = 0;
+    for (i = 0; i < this->n; i++) {
+      if (!((left >> i) & 1ULL)) continue;
+      d = __builtin_popcountll(this->adj[i] & left);
+      if (v < 0 || d < minDegree || (d == minDegree && this->key[i] < this->key[v])) {
+	v = i;
+	minDegree = d;
+      }
+    }
+    chosen |= 1ULL << v;
+    left &= ~(this->adj[v] | (1ULL << v));
+  }
+
+  return chosen;
 }
 
-// Removes an edge between two GraphNodes.
-void Graph::removeEdge(GraphNode * node1, GraphNode * node2) {
-  node1->removeAdj(node2->id);
-  node2->removeAdj(node1->id);
+// Finds the largest independent set, starting from the greedy selection,
+// which is kept unless a strictly larger set is found.
+unsigned long long IndependentSet::exact() {
+  this->best = this->greedy();
+  this->bestSize = __builtin_popcountll(this->best);
+  this->branches = 0;
+
+  this->expand(0, 0, this->n == 64 ? ~0ULL : (1ULL << this->n) - 1);
+
+  return this->best;
 }
 
-// Fetches a reference to a GraphNode.
-GraphNode * Graph::getNode(int nid) {
-  return &elements[nid];
+// Extends the set 'chosen' of 'size' nodes with nodes from 'left'.
+void IndependentSet::expand(unsigned long long chosen, int size, unsigned long long left) {
+  unsigned long long rest;
+  int i, v, d, minNode, minDegree, maxNode, maxDegree;
+
+  // A node with at most one conflict is part of some largest set.
+  while (left) {
+    minNode = maxNode = -1;
+    minDegree = maxDegree = 0;
+    for (rest = left; rest; rest &= rest - 1) {
+      i = __builtin_ctzll(rest);
+      d = __builtin_popcountll(this->adj[i] & left);
+      if (minNode < 0 || d < minDegree) { minNode = i; minDegree = d; }
+      if (maxNode < 0 || d > maxDegree) { maxNode = i; maxDegree = d; }
+    }
+    if (minDegree > 1) break;
+    chosen |= 1ULL << minNode;
+    size++;
+    left &= ~(this->adj[minNode] | (1ULL << minNode));
+  }
+
+  if (!left) {
+    if (size > this->bestSize) {
+      this->best = chosen;
+      this->bestSize = size;
+    }
+    return;
+  }
+
+  if (size + this->coverBound(left) <= this->bestSize) return;
+  if (++this->branches > EXACT_MAX_BRANCHES) return;
+
+  v = maxNode;
+  this->expand(chosen | (1ULL << v), size + 1, left & ~(this->adj[v] | (1ULL << v)));
+  this->expand(chosen, size, left & ~(1ULL << v));
 }
 
-// Clears all edges connected to to given node.
-void Graph::clearEdges(GraphNode * node) {
-  vector<int>::iterator it;
-  vector<int> list = node->getList();
+// Upper bound on the independent set within 'left': the number of cliques
+// of a greedy clique cover.
+int IndependentSet::coverBound(unsigned long long left) const {
+  unsigned long long clique;
+  int i, cliques = 0;
+
+  while (left) {
+    i = __builtin_ctzll(left);
+    left &= ~(1ULL << i);
+    for (clique = left & this->adj[i]; clique; clique &= this->adj[i]) {
+      i = __builtin_ctzll(clique);
+      left &= ~(1ULL << i);
+      clique &= ~(1ULL << i);
+    }
+    cliques++;
+  }
+
+  return cliques;
+}
+
+/*
+************************************************************************
+*+
+* CLASS: LocalSearch
+*
+* DESCRIPTION: Improves a set of placed slits in a conflict graph by
+* local moves, keeping track of the number of placed neighbours of every
+* node ('tight'). A free node (no placed neighbours) is placed; a placed
+* slit is swapped for one or two of its neighbours that conflict with it
+* only, if they weigh more (see weight()). Only the neighbourhood of a
+* changed node is looked at again. Every change is logged, so that a 
+* perturbation that did not pay off can be undone.
+*
+*-
+************************************************************************
+*/
+
+LocalSearch::LocalSearch(const Graph *conflictGraph, const vector<int> &Priority,
+			 const vector<char> &placed) {
+  int v, p;
+
+  this->graph = conflictGraph;
+  this->priority = Priority;
+  this->in.assign(this->graph->nodes(), 0);
+  this->tight.assign(this->graph->nodes(), 0);
+  this->isPending.assign(this->graph->nodes(), 0);
+  for (p = 0; p < 4; p++) this->counts[p] = 0;
+  this->steps = 0;
+  this->swaps = 0;
+
+  for (v = 0; v < this->graph->nodes(); v++) {
+    if (placed[v]) this->flip(v);
+  }
+  this->changes.clear();
+}
+
+// A slit weighs as much as two slits of the next lower priority, so that
+// no move with a gain lowers the number of placed slits of a priority 
+// without placing more of a higher one. Acquisition slits are never 
+// given up (see swap() and perturb()).
+int LocalSearch::weight(int v) const {
+  return 1 << (3 - this->priority[v]);
+}
 
-  for (it = list.begin(); it != list.end(); it++) {
-    this->removeEdge(node, getNode((*it)));
+// Places or removes a node, and queues the nodes where this may have
+// opened up a move.
+void LocalSearch::flip(int v) {
+  const int *nb, *nb2;
+
+  this->in[v] = !this->in[v];
+  this->counts[this->priority[v]] += this->in[v] ? 1 : -1;
+  this->changes.push_back(v);
+
+  for (nb = this->graph->neighboursBegin(v); nb != this->graph->neighboursEnd(v); nb++) {
+    this->tight[*nb] += this->in[v] ? 1 : -1;
+    if (this->in[v]) continue;
+
+    // Neighbours of a removed slit may now be free, or conflict with 
+    // just one placed slit
+    this->push(*nb);
+    if (this->tight[*nb] == 1) {
+      for (nb2 = this->graph->neighboursBegin(*nb); nb2 != this->graph->neighboursEnd(*nb); nb2++) {
+	if (this->in[*nb2]) this->push(*nb2);
+      }
+    }
   }
+
+  if (this->in[v]) this->push(v);
 }
 
-// Returns true if the Graph is empty of GraphNodes.
-bool Graph::empty() {
-  return elements.size() == 0;
+// Queues a node to be looked at.
+void LocalSearch::push(int v) {
+  if (this->isPending[v]) return;
+  this->isPending[v] = 1;
+  this->pending.push_back(v);
 }
 
-int Graph::size() {
-  return elements.size();
+// Queues all nodes.
+void LocalSearch::pushAll() {
+  int v;
+
+  for (v = this->graph->nodes() - 1; v >= 0; v--) this->push(v);
 }
 
-// Returns a list of nodes that have the lowest degrees.
-vector<int> Graph::getMinDegree() {
-  // Map iterator.
-  map<int, GraphNode>::iterator it;
+// Applies moves to the queued nodes until there are none left. Returns
+// false if the deadline passed first.
+bool LocalSearch::improve() {
+  int v;
 
-  // Map container for nodes with min cardinality.
-  vector<int> minNodeIds;
-  int min = 32000;
-  int curID;
-  int curDegree;
+  while (!this->pending.empty()) {
+    if ((++this->steps & 63) == 0 && this->expired()) return false;
 
-  // Find minimum degree and populate min degree list.
-  for (it = elements.begin(); it != elements.end(); it++) {
-    curDegree = (*it).second.getDegree();
-    if (curDegree < min) {
-      // New lowest degree.
-      // Erase low degree list and add this item.
-      min = curDegree;
-      curID = (*it).first;
-      minNodeIds.clear();
-      minNodeIds.push_back(curID);
-    } 
-    else if (curDegree == min) {
-      // Another item with lowest degree. Add to map.
+    v = this->pending.back();
+    this->pending.pop_back();
+    this->isPending[v] = 0;
+
+    if (!this->in[v]) {
+      if (this->tight[v] == 0) this->flip(v);
+    }
+    else if (this->priority[v] > 0) {
+      this->swap(v);
+    }
+  }
+
+  return true;
+}
+
+// Swaps placed node v for the heaviest one or two (non-conflicting) 
+// neighbours that conflict with v only, if they weigh more than v.
+bool LocalSearch::swap(int v) {
+  vector<int> candidates;
+  const int *nb;
+  int i, j, a = -1, b = -1, gain = 0, w;
+
+  for (nb = this->graph->neighboursBegin(v); nb != this->graph->neighboursEnd(v); nb++) {
+    if (!this->in[*nb] && this->tight[*nb] == 1) candidates.push_back(*nb);
+  }
 
-      curID = (*it).first;
-      minNodeIds.push_back(curID);
+  for (i = 0; i < (int) candidates.size(); i++) {
+    w = this->weight(candidates[i]) - this->weight(v);
+    if (w > gain) {
+      gain = w; 
+      a = candidates[i]; 
+      b = -1;
+    }
+    for (j = i + 1; j < (int) candidates.size(); j++) {
+      if (this->graph->adjacent(candidates[i], candidates[j])) continue;
+      w = this->weight(candidates[i]) + this->weight(candidates[j]) - this->weight(v);
+      if (w > gain) {
+	gain = w; 
+	a = candidates[i]; 
+	b = candidates[j];
+      }
     }
   }
 
-  return minNodeIds;
+  if (a < 0) return false;
+
+  this->flip(v);
+  this->flip(a);
+  if (b >= 0) this->flip(b);
+  this->swaps++;
+
+  return true;
+}
+
+// Places node v, removing its placed neighbours. Returns false (and does
+// nothing) if v is placed or conflicts with a placed acquisition slit.
+bool LocalSearch::perturb(int v) {
+  const int *nb;
+
+  if (this->in[v]) return false;
+  for (nb = this->graph->neighboursBegin(v); nb != this->graph->neighboursEnd(v); nb++) {
+    if (this->in[*nb] && this->priority[*nb] == 0) return false;
+  }
+
+  for (nb = this->graph->neighboursBegin(v); nb != this->graph->neighboursEnd(v); nb++) {
+    if (this->in[*nb]) this->flip(*nb);
+  }
+  this->flip(v);
+
+  return true;
+}
+
+// Undoes all changes since the last call of accept(), newest first.
+// flip() records every change, so the list is taken out of 'changes'
+// before it is walked and the flips made here are dropped afterwards.
+void LocalSearch::undo() {
+  vector<int> undone;
+  int i;
+
+  undone.swap(this->changes);
+  for (i = undone.size() - 1; i >= 0; i--) this->flip(undone[i]);
+  this->changes.clear();
+
+  while (!this->pending.empty()) {
+    this->isPending[this->pending.back()] = 0;
+    this->pending.pop_back();
+  }
+}
+
+// Keeps the changes made so far.
+void LocalSearch::accept() {
+  this->changes.clear();
+}
+
+// Compares the placed slits per priority with 'other', acquisition first.
+// Returns 1 if there are more, -1 if less, 0 if the same.
+int LocalSearch::compare(const int *other) const {
+  int p;
+
+  for (p = 0; p < 4; p++) {
+    if (this->counts[p] != other[p]) return this->counts[p] > other[p] ? 1 : -1;
+  }
+
+  return 0;
+}
+
+// True once the deadline has passed.
+bool LocalSearch::expired() const {
+  return chrono::steady_clock::now() >= this->deadline || pastDeadline();
+}
+
+
+//****************************************************************
+// Writes the catalogue name of mask 'k' (counted from 1) into 'name',
+// for the parameter set 'sweep' of --sweep if not 0 (counted from 1).
+// Names that do not fit into 'size' characters are truncated.
+void maskFileName(char *name, size_t size, const char *root, int sweep, int k) {
+  if (sweep > 0) snprintf(name, size, "%s_sweep%d_%d.cat", root, sweep, k);
+  else snprintf(name, size, "%s%d.cat", root, k);
 }
 
 
@@ -2703,9 +7048,9 @@ float max(vector<float> const &data)
 //****************************************************************************
 // For debugging purposes, only
 //****************************************************************************
-void printSlit(map<int, Slit> slitData, int id, int label, float specLength) {
+void printSlit(const map<int, Slit> &slitData, int id, int label, float specLength) {
 
-  map<int, Slit>::iterator it; // Iterator object.
+  map<int, Slit>::const_iterator it; // Iterator object.
 
   // Loop through 'slit' container to find slits of the given prio.
   for (it = slitData.begin(); it != slitData.end(); it++) {
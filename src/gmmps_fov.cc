@@ -23,7 +23,7 @@ Extract the exact GMOS field of view, and rejects all objects outside.
 A modified catalog is written were all objects outside are omitted.
 
 SYNOPSIS
-gmmps_FoV <input> <output> <dataFile> <pixelScale>
+gmmps_FoV <input> <output> <dataFile> <pixelScale> <crpix1> <crpix2> [<dispdir> [<minFraction>]]
 
 The dataFile contains the x|y vertices of the FoV with respect to some fiducial center
 All co-ordinates are in arc seconds, and converted to pixels.
@@ -52,6 +52,13 @@ ID, RA, DEC, X, Y, posX, posY, dX, dY, tilt, mag, priority, type
 <pixelScale> 
 
 <data> full name of file containing the vertices
+
+<dispdir> horizontal (GMOS, default) or vertical (F2): the direction along
+which the ends of tilted slits are sheared
+
+<minFraction> the fraction of the slit area that must lie within the FoV
+(default 0.9). 0 keeps every object, e.g. for the pointing optimizer of 
+gmMakeMasks (--optimize-catalog)
 */
 
 
@@ -61,14 +68,39 @@ ID, RA, DEC, X, Y, posX, posY, dX, dY, tilt, mag, priority, type
 #include <cmath>
 #include <string>
 #include <cstring>
+#include <cctype>
 #include <vector>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+
+#include "fovslabs.h"
 
 using namespace std;
 
+// The input catalogue, one vector per column. X and Y are the slit 
+// positions (x_ccd+(slitpos_x/pixelScale)), RA and DEC in decimal degrees.
+typedef struct {
+  vector<int> num;
+  vector<double> ra, dec;
+  vector<float> X, Y, pX, pY, dX, dY, tilt, mag, redshift;
+  vector<char> priority, type;
+} _catalog_;
+
+// Catalogues with fewer slit corners are tested on one thread
+const int PARALLEL_MIN_CORNERS = 1 << 18;
+
+// Default fraction of the slit area that must lie within the FoV
+const float DEFAULT_MIN_FRACTION = 0.9;
+
 // Prototypes
-int pnpoly(vector<float>&, vector<float>&, float, float);
 void stringclean(string&);
 int readInData(char*, float, float, float, vector<float>&, vector<float>&);
+int readCatalog(char*, float, _catalog_&);
+bool parseObject(const char*, _catalog_&);
+void slitCorners(const _catalog_&, int, float, bool, double*, double*);
+void testCorners(const FovSlabs&, const vector<float>&, const vector<float>&, 
+		 vector<unsigned char>&);
 vector<string> stringSplit(string, string);
 
 
@@ -77,47 +109,61 @@ vector<string> stringSplit(string, string);
 // RETURNS: int, [short description]
 // ************************************************************************
 int main (int argc, char *argv[]) {
-  int num;
+  int i, k, n;
   int numDropped, numGuides;
   int numP1, numP2, numP3;  // Num objects dropped.
-  float X, Y;
-  float dX, dY;         // Slit dimensions in x and y.
-  float pX, pY;
-  double rah, ram, ras;
-  double decg, decm, decs;
-  double ra, dec;
-  float tilt;		// Slit tilt angle
-  float mag;		// Magnitude
-  float redshift;
-  char priority, type;	// Priority of object & slit type
+  double slitX[4], slitY[4];
+  double area, fraction;
+  float xmin, xmax, ymin, ymax;
+  float fovXmin, fovXmax, fovYmin, fovYmax;
+  float minFraction = DEFAULT_MIN_FRACTION;
+  bool horizontal = true;
+  bool positiontest;
+  char priority;
   char inputname[200], outputname[200], dataname[200];
-  int cntr;			// Num of variables read from file
   float	pixelScale;		// Pixel scale
   float crpix1, crpix2;         // fiducial center
-  string line;
+  _catalog_ cat;
 
   // Normally I'd use cerr instead of cout to print all the errors, 
   // but then they don't show up in the skycat message window. So cout it is...
 
 
   // COMMAND LINE INPUT 
-  if(argc==7) {
+  if(argc>=7 && argc<=9) {
     strcpy(inputname,argv[1]);
     strcpy(outputname,argv[2]);
     strcpy(dataname,argv[3]);
     pixelScale = atof(argv[4]);
     crpix1 = atof(argv[5]);
     crpix2 = atof(argv[6]);
+    if (argc >= 8) {
+      if (strcmp(argv[7], "horizontal") == 0) horizontal = true;
+      else if (strcmp(argv[7], "vertical") == 0) horizontal = false;
+      else {
+	cout << "ERROR: <dispdir> must be horizontal or vertical, not " << argv[7] << endl;
+	return -1;
+      }
+    }
+    if (argc == 9) {
+      minFraction = atof(argv[8]);
+      if (minFraction < 0. || minFraction > 1.) {
+	cout << "ERROR: <minFraction> must be >= 0 and <= 1, not " << argv[8] << endl;
+	return -1;
+      }
+    }
   }
   else {
     cout << "gmmps_FoV: WRONG INPUT COMMAND LINE: EXIT" << endl;
-    cout << "USAGE: gmmps_fov <inputFile> <output> <data> <pixelScale> <crpix1> <crpix2>." << endl;
+    cout << "USAGE: gmmps_fov <inputFile> <output> <data> <pixelScale> <crpix1> <crpix2> [<dispdir> [<minFraction>]]." << endl;
     cout << "       <inputFile> full input file name." << endl;
     cout << "       <output> full output file name." << endl;
     cout << "       <data> name of file containing cut-off coordinates." << endl;
     cout << "       <pixelScale> conv. factor to get pixels from arcs." << endl;
     cout << "       <crpix1> x-coord of the fiducial center" << endl;
     cout << "       <crpix2> y-coord of the fiducial center" << endl;
+    cout << "       <dispdir> horizontal (default) or vertical" << endl;
+    cout << "       <minFraction> min. fraction of the slit area within the FoV (default " << DEFAULT_MIN_FRACTION << ", 0: all)" << endl;
     return -1;
   }
   
@@ -127,13 +173,14 @@ int main (int argc, char *argv[]) {
     cout << "gmmps_FoV: Bad data file: " << dataname << endl;
     return -1;
   }
+  // The polygon cut into slabs along x, as in gmMakeMasks
+  FovSlabs fovSlabs(vertx, verty);
   
-  // Open input object file
-  ifstream inFile(inputname);
-  if (!inFile.is_open()) {
-    cout << "ERROR: Could not open " << inputname << " for reading!" << endl; 
+  // Read the input object file
+  if (readCatalog(inputname, pixelScale, cat) != 0) {
     return -1;
   }
+  n = cat.num.size();
 
   // Open output object file
   ofstream outFile(outputname);
@@ -142,82 +189,83 @@ int main (int argc, char *argv[]) {
     return -1;
   }
 
+  // Keep only slits with at least minFraction of their area within the 
+  // FoV. Most lie well inside: the corners of their bounding boxes are 
+  // tested in one batch, and only the slits that are not found inside 
+  // the FoV that way are clipped to it.
+  vector<float> cornerX(4*n), cornerY(4*n);
+  vector<unsigned char> inside(4*n);
+  for (i = 0; i < n; i++) {
+    slitCorners(cat, i, pixelScale, horizontal, slitX, slitY);
+    xmin = min(min(slitX[0], slitX[1]), min(slitX[2], slitX[3]));
+    xmax = max(max(slitX[0], slitX[1]), max(slitX[2], slitX[3]));
+    ymin = min(min(slitY[0], slitY[1]), min(slitY[2], slitY[3]));
+    ymax = max(max(slitY[0], slitY[1]), max(slitY[2], slitY[3]));
+    cornerX[4*i]   = xmin;  cornerY[4*i]   = ymin;
+    cornerX[4*i+1] = xmax;  cornerY[4*i+1] = ymin;
+    cornerX[4*i+2] = xmin;  cornerY[4*i+2] = ymax;
+    cornerX[4*i+3] = xmax;  cornerY[4*i+3] = ymax;
+  }
+  testCorners(fovSlabs, cornerX, cornerY, inside);
+
+  fovXmin = *min_element(vertx.begin(), vertx.end());
+  fovXmax = *max_element(vertx.begin(), vertx.end());
+  fovYmin = *min_element(verty.begin(), verty.end());
+  fovYmax = *max_element(verty.begin(), verty.end());
+
   // Initialise object counters
   numDropped = numGuides = numP1 = numP2 = numP3 = 0;
-  
-  // Read input file
-  while (getline(inFile, line)) {
-      // Read a line and "clean" its white spaces
-      stringclean(line);
-      if (line.compare(0,1,"#") == 0) continue;
-      if (line.length() < 2) continue;
-
-      // Read in while checking the format. If incorrect then don't continue
-      const char *cline = line.c_str();
-      if ( (cntr = sscanf(cline, "%d %lf:%lf:%lf %lf:%lf:%lf %f %f %f %f %f %f %f %f %c %c %f",
-			  &num, &rah, &ram, &ras, &decg, &decm, &decs, &X, &Y,
-			  &pX, &pY, &dX, &dY, &tilt, &mag, &priority, &type, &redshift)) == EOF || cntr != 18 ) {
-	cout << "ERROR: Bad inputline: " << line.c_str() << endl;
-	cout << "Exiting." << endl;
-	inFile.close();
-	outFile.close();
-	return (-1);
-      }
 
-      // Convert RA and DEC to decimal degrees
-      if ( rah != 0.0 ) ra = (rah/abs(rah)) * (abs(rah)*15+ram/4+ras/240);
-      else ra = (rah)*15+ram/4+ras/240;
-
-      // Dec needs special treatment as the first two digits might be negative zero (e.g. -00:12:34)
-      // Originally by @@cba
-      dec = copysign( (double)1.0, (double)decg) * (abs(decg)+decm/60+decs/3600);
-
-      //  Calculate the real slit position, x_ccd+(slitpos_x/pixelScale), 
-      //  and do the same for y.
-      X += ( pX / pixelScale ); 
-      Y += ( pY / pixelScale ); 
-
-      // Keep only slits that are at least 90% within the FoV.
-      // Eventually, this should become an input parameter in GMMPS
-      bool positiontest = true;
-      int polytest;
-
-      float fraction = 0.9;
-      float fdX = fraction*0.5*dX / pixelScale; // x0.5 is to get half the slit dimension
-      float fdY = fraction*0.5*dY / pixelScale;
-      // check the lower left corner of the slit
-      polytest = pnpoly(vertx, verty, X-fdX, Y-fdY);
-      if (polytest == 0) positiontest = false;
-      // check the lower right corner of the slit
-      polytest = pnpoly(vertx, verty, X+fdX, Y-fdY);
-      if (polytest == 0) positiontest = false;
-      // check the upper left corner of the slit
-      polytest = pnpoly(vertx, verty, X-fdX, Y+fdY);
-      if (polytest == 0) positiontest = false;
-      // check the upper right corner of the slit
-      polytest = pnpoly(vertx, verty, X+fdX, Y+fdY);
-      if (polytest == 0) positiontest = false;
-
-      // If inside, write it to output file
-      if (positiontest) {
-	outFile << " " << num << " ";
-	outFile.precision(10);
-	outFile << ra << " " << dec << " ";
-	outFile.precision(6);
-	outFile << (X-(pX/pixelScale)) << " " << (Y-(pY/pixelScale)) << " " <<
-	  pX << " " << pY << " " << dX << " " << dY << " " << tilt << " " << 
-	  mag << " " << priority << " " << type << " " << redshift << " " << endl;
+  for (i = 0; i < n; i++) {
+    xmin = cornerX[4*i];
+    xmax = cornerX[4*i+3];
+    ymin = cornerY[4*i];
+    ymax = cornerY[4*i+3];
+
+    // The FoV need not be convex: a bounding box with its corners inside
+    // is checked edge by edge
+    for (k = 0; k < 4 && inside[4*i+k]; k++);
+    if (minFraction == 0.) {
+      positiontest = true;
+    }
+    else if (k == 4 && fovSlabs.contains(xmin, xmax, ymin, ymax)) {
+      positiontest = true;
+    }
+    else if (xmax < fovXmin || xmin > fovXmax || ymax < fovYmin || ymin > fovYmax) {
+      positiontest = false;
+    }
+    else {
+      slitCorners(cat, i, pixelScale, horizontal, slitX, slitY);
+      area = (double) cat.dX[i] * cat.dY[i] / pixelScale / pixelScale;
+      if (area > 0.) {
+	fraction = fovSlabs.clippedArea(slitX, slitY, 4) / area;
+	positiontest = fraction >= minFraction;
       }
       else {
-	numDropped++;
-	if      ( priority == '0' ) numGuides++;
-	else if ( priority == '1' ) numP1++;
-	else if ( priority == '2' ) numP2++;
-	else if ( priority == '3' ) numP3++;
+	positiontest = fovSlabs.inside(cat.X[i], cat.Y[i]);
       }
+    }
+
+    // If inside, write it to output file
+    if (positiontest) {
+      outFile << " " << cat.num[i] << " ";
+      outFile.precision(10);
+      outFile << cat.ra[i] << " " << cat.dec[i] << " ";
+      outFile.precision(6);
+      outFile << (cat.X[i]-(cat.pX[i]/pixelScale)) << " " << (cat.Y[i]-(cat.pY[i]/pixelScale)) << " " <<
+	cat.pX[i] << " " << cat.pY[i] << " " << cat.dX[i] << " " << cat.dY[i] << " " << cat.tilt[i] << " " << 
+	cat.mag[i] << " " << cat.priority[i] << " " << cat.type[i] << " " << cat.redshift[i] << " " << "\n";
+    }
+    else {
+      numDropped++;
+      priority = cat.priority[i];
+      if      ( priority == '0' ) numGuides++;
+      else if ( priority == '1' ) numP1++;
+      else if ( priority == '2' ) numP2++;
+      else if ( priority == '3' ) numP3++;
+    }
   }
 
-  inFile.close();
   outFile.close();
 
   cout << "Objects outside mask area : " << numDropped << endl;
@@ -270,54 +318,257 @@ int readInData(char *fileName, float pixelScale, float crpix1, float crpix2,
 }
 
 
+/*
+************************************************************************
+*+
+* FUNCTION: readCatalog
+*
+* RETURNS: int, [0=success ]
+*
+* DESCRIPTION: Reads the input object file into 'cat'. Skips comments 
+*              (lines starting with '#') and lines of less than 2 
+*              characters. The slit positions are converted to pixels 
+*              with pixelScale.
+*
+* [NOTES:]: The file is read in one piece and each line parsed in place,
+*           in the format of parseObject().
+*-
+************************************************************************
+*/
+int readCatalog(char *fileName, float pixelScale, _catalog_ &cat) {
+
+  ifstream file(fileName);
+  ostringstream contents;
+  string buffer, line;
+  size_t start, end, first;
+  int chars;
+  char *cline;
+
+  if (!file.is_open()) {
+    cout << "ERROR: Could not open " << fileName << " for reading!" << endl; 
+    return -1;
+  }
+  contents << file.rdbuf();
+  file.close();
+  buffer = contents.str();
+
+  for (start = 0; start < buffer.length(); start = end + 1) {
+    end = buffer.find('\n', start);
+    if (end == string::npos) end = buffer.length();
+    buffer[end] = '\0';
+    cline = &buffer[start];
+
+    // Comments, and lines with less than 2 characters once their white 
+    // space is "cleaned" (see stringclean())
+    first = strspn(cline, " \t");
+    if (cline[first] == '#') continue;
+    for (chars = 0; *cline != '\0' && chars < 2; cline++) {
+      if (*cline != ' ' && *cline != '\t') chars++;
+    }
+    if (chars < 2) continue;
+
+    // Read in while checking the format. If incorrect then don't continue
+    if (!parseObject(&buffer[start], cat)) {
+      line = &buffer[start];
+      stringclean(line);
+      cout << "ERROR: Bad inputline: " << line.c_str() << endl;
+      cout << "Exiting." << endl;
+      return (-1);
+    }
+
+    //  Calculate the real slit position, x_ccd+(slitpos_x/pixelScale), 
+    //  and do the same for y.
+    cat.X.back() += ( cat.pX.back() / pixelScale ); 
+    cat.Y.back() += ( cat.pY.back() / pixelScale ); 
+  }
+
+  return (0);
+}
+
+
+//****************************************************************
+// Helpers of parseObject(): read one field at p and move p past it, as
+// sscanf() does for %d, %lf, %f, " %c" and a literal character.
+// False if there is no such field.
+//****************************************************************
+static bool readField(const char *&p, int &value) {
+  char *end;
+  value = strtol(p, &end, 10);
+  if (end == p) return false;
+  p = end;
+  return true;
+}
+
+static bool readField(const char *&p, double &value) {
+  char *end;
+  value = strtod(p, &end);
+  if (end == p) return false;
+  p = end;
+  return true;
+}
+
+static bool readField(const char *&p, float &value) {
+  char *end;
+  value = strtof(p, &end);
+  if (end == p) return false;
+  p = end;
+  return true;
+}
+
+static bool readField(const char *&p, char &value) {
+  while (isspace((unsigned char) *p)) p++;
+  if (*p == '\0') return false;
+  value = *p++;
+  return true;
+}
+
+static bool readLiteral(const char *&p, char c) {
+  if (*p != c) return false;
+  p++;
+  return true;
+}
 
-//***************************************************************
-// Test if a point is inside a polygon
-//***************************************************************
 
 /*
-Polygon tester (pnpoly)
-
-Copyright (c) 1970-2003, Wm. Randolph Franklin
-
-Permission is hereby granted, free of charge, to any person obtaining a copy 
-of this software and associated documentation files (the "Software"), to deal 
-in the Software without restriction, including without limitation the rights 
-to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
-copies of the Software, and to permit persons to whom the Software is 
-furnished to do so, subject to the following conditions: 
-
-(1) Redistributions of source code must retain the above copyright notice, this 
-list of conditions and the following disclaimers.
-(2) Redistributions in binary form must reproduce the above copyright notice in 
-the documentation and/or other materials provided with the distribution.
-(3) The name of W. Randolph Franklin may not be used to endorse or promote 
-products derived from this Software without specific prior written permission. 
-
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
-FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
-AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
-LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
-SOFTWARE. 
+************************************************************************
+*+
+* FUNCTION: parseObject
+*
+* RETURNS: bool, false for a bad line
+*
+* DESCRIPTION: Parses one object of the input file, in the format 
+*              "%d %lf:%lf:%lf %lf:%lf:%lf %f %f %f %f %f %f %f %f %c %c %f"
+*              (ID, RA, DEC, X, Y, posX, posY, dX, dY, tilt, mag, 
+*              priority, type, redshift), and appends it to 'cat'. 
+*              Anything after the redshift is ignored.
+*-
+************************************************************************
 */
+bool parseObject(const char *p, _catalog_ &cat) {
+  int num;
+  double rah, ram, ras;
+  double decg, decm, decs;
+  double ra, dec;
+  float X, Y, pX, pY, dX, dY, tilt, mag, redshift;
+  char priority, type;
+
+  if (!(readField(p, num) && 
+	readField(p, rah) && readLiteral(p, ':') && readField(p, ram) && 
+	readLiteral(p, ':') && readField(p, ras) && 
+	readField(p, decg) && readLiteral(p, ':') && readField(p, decm) && 
+	readLiteral(p, ':') && readField(p, decs) && 
+	readField(p, X) && readField(p, Y) && readField(p, pX) && readField(p, pY) &&
+	readField(p, dX) && readField(p, dY) && readField(p, tilt) && readField(p, mag) &&
+	readField(p, priority) && readField(p, type) && readField(p, redshift))) {
+    return false;
+  }
+
+  // Convert RA and DEC to decimal degrees
+  if ( rah != 0.0 ) ra = (rah/abs(rah)) * (abs(rah)*15+ram/4+ras/240);
+  else ra = (rah)*15+ram/4+ras/240;
+
+  // Dec needs special treatment as the first two digits might be negative zero (e.g. -00:12:34)
+  // Originally by @@cba
+  dec = copysign( (double)1.0, (double)decg) * (abs(decg)+decm/60+decs/3600);
+
+  cat.num.push_back(num);
+  cat.ra.push_back(ra);
+  cat.dec.push_back(dec);
+  cat.X.push_back(X);
+  cat.Y.push_back(Y);
+  cat.pX.push_back(pX);
+  cat.pY.push_back(pY);
+  cat.dX.push_back(dX);
+  cat.dY.push_back(dY);
+  cat.tilt.push_back(tilt);
+  cat.mag.push_back(mag);
+  cat.priority.push_back(priority);
+  cat.type.push_back(type);
+  cat.redshift.push_back(redshift);
+
+  return true;
+}
 
-int pnpoly(vector<float> &vertx, vector<float> &verty, float testx, float testy)
-{
-  long i, j, c = 0;
-  long nvert = vertx.size();
 
-  for (i=0, j=nvert-1; i<nvert; j=i++) {
-    if ( ((verty[i]>testy) != (verty[j]>testy)) &&
-	 (testx < (vertx[j]-vertx[i]) * (testy-verty[i]) / (verty[j]-verty[i]) + vertx[i]) )
-      c = !c;
+/*
+************************************************************************
+*+
+* FUNCTION: slitCorners
+*
+* RETURNS: none.
+*
+* DESCRIPTION: The corners of slit i in pixels, in order around it. 
+*              Tilted slits are parallelograms, with their ends sheared 
+*              along the dispersion direction by tan(tilt), as 
+*              vmAstroCat.tcl draws them.
+*-
+************************************************************************
+*/
+void slitCorners(const _catalog_ &cat, int i, float pixelScale, bool horizontal,
+		 double *x, double *y) {
+  double dx, dy, dtilt;
+  double rad = M_PI / 180.;
+
+  // half slit dimensions
+  dx = 0.5 * cat.dX[i] / pixelScale;
+  dy = 0.5 * cat.dY[i] / pixelScale;
+
+  if (horizontal) {
+    dtilt = dy * tan(cat.tilt[i] * rad);
+    x[0] = cat.X[i] - dtilt - dx;  y[0] = cat.Y[i] + dy;
+    x[1] = cat.X[i] - dtilt + dx;  y[1] = cat.Y[i] + dy;
+    x[2] = cat.X[i] + dtilt + dx;  y[2] = cat.Y[i] - dy;
+    x[3] = cat.X[i] + dtilt - dx;  y[3] = cat.Y[i] - dy;
+  }
+  else {
+    dtilt = dx * tan(cat.tilt[i] * rad);
+    x[0] = cat.X[i] - dx;  y[0] = cat.Y[i] - dtilt + dy;
+    x[1] = cat.X[i] + dx;  y[1] = cat.Y[i] + dtilt + dy;
+    x[2] = cat.X[i] + dx;  y[2] = cat.Y[i] + dtilt - dy;
+    x[3] = cat.X[i] - dx;  y[3] = cat.Y[i] - dtilt - dy;
+  }
+}
+
+
+// Tests 'count' corners on one of the threads of testCorners()
+static void testCornerRange(const FovSlabs *fov, const float *u, const float *v, 
+			    int count, unsigned char *in) {
+  fov->inside(u, v, count, in);
+}
+
+/*
+************************************************************************
+*+
+* FUNCTION: testCorners
+*
+* RETURNS: none.
+*
+* DESCRIPTION: inside[k] is set to 1 if (u[k], v[k]) lies within the FoV,
+*              to 0 if not. Large catalogues are split across the cores.
+*-
+************************************************************************
+*/
+void testCorners(const FovSlabs &fov, const vector<float> &u, const vector<float> &v,
+		 vector<unsigned char> &inside) {
+  vector<thread> workers;
+  int i, n, threads, chunk, first;
+
+  n = u.size();
+  threads = thread::hardware_concurrency();
+  if (n < PARALLEL_MIN_CORNERS || threads <= 1) {
+    fov.inside(u.data(), v.data(), n, inside.data());
+    return;
   }
-  // Returns 1 if the object is inside the polygon and 0 if it is outside.
-  // If the object is EXACTLY on the bundary line the output is undetermined (either 0 or 1),
-  // determined by rounding errors.
 
-  return c;
+  // Whole SIMD blocks per thread
+  chunk = ((n + threads - 1) / threads + 7) / 8 * 8;
+  for (i = 0, first = 0; first < n; i++, first += chunk) {
+    workers.push_back(thread(testCornerRange, &fov, u.data() + first, v.data() + first,
+			     min(chunk, n - first), inside.data() + first));
+  }
+  for (i = 0; i < int(workers.size()); i++) {
+    workers[i].join();
+  }
 }
 
 
@@ -205,6 +205,7 @@ itcl::class cat::gmmps_spoc {
 	set prev_expansion   [$catClass_ gmmps_config_ [list "$instType-expand_slits" ]]
 	set prev_wiggle      [$catClass_ gmmps_config_ [list "$instType-length_offset_%" ]]
 	set prev_minSpecDist [$catClass_ gmmps_config_ [list "$instType-minSpecDist" ]]
+	set prev_timeLimit   [$catClass_ gmmps_config_ [list "$instType-time_limit" ]]
 
 	# Determine previous expansion setting, if it exists.
 	if {$prev_expansion != 0 && $prev_expansion != 1} {
@@ -220,6 +221,11 @@ itcl::class cat::gmmps_spoc {
 	if {$prev_minSpecDist == ""} {
 	    set prev_minSpecDist 4
 	}
+
+	# No time limit unless one was given
+	if {$prev_timeLimit == ""} {
+	    set prev_timeLimit 0
+	}
 		
 	#############################################################
 	#    The main frame containing the two setup frames
@@ -364,6 +370,10 @@ itcl::class cat::gmmps_spoc {
 		 -text "Min. separation \[pix\]:" \
 		 -value $prev_minSpecDist \
 		 -valuewidth 5 ] \
+	    [LabelEntry $w_.instSetup.timeLimit \
+		 -text "Time limit \[s\]:" \
+		 -value $prev_timeLimit \
+		 -valuewidth 5 ] \
 	    -side top -anchor w -padx 5 -ipadx 5 -ipady 5 -fill x
 
 	# Slit expansion and number of masks are spin boxes with labels
@@ -420,6 +430,8 @@ itcl::class cat::gmmps_spoc {
 	add_short_help $w_.instSetup.maskSpinBox {The number of ODF files (masks) to be generated}
 	add_short_help $w_.instSetup.minSpecDist \
 	    {The minimum separation of spectra for the auto-expansion mode.}
+	add_short_help $w_.instSetup.timeLimit \
+	    {Stop searching for better placements after this many seconds (0: no limit)}
 	add_short_help $w_.instSetup.wiggleSpinBox \
 	    {Allow movement of slits during placement (percentage of slit length)}
 	add_short_help $w_.instSetup.bias \
@@ -442,6 +454,8 @@ itcl::class cat::gmmps_spoc {
 	    -command [list $w_.masterBottomFrame.gmMM.03 xview] -orient horiz
 	scrollbar $w_.masterBottomFrame.gmMM.02 \
 	    -command [list $w_.masterBottomFrame.gmMM.03 yview] -orient vert
+	label $w_.masterBottomFrame.gmMM.04 -anchor w -text ""
+	pack $w_.masterBottomFrame.gmMM.04 -side bottom -fill x
 	pack $w_.masterBottomFrame.gmMM.01 -side bottom -fill x
 	pack $w_.masterBottomFrame.gmMM.02 -side right -fill y
 	pack $w_.masterBottomFrame.gmMM.03 -side left -fill both -expand true
@@ -457,6 +471,10 @@ itcl::class cat::gmmps_spoc {
 		 -activebackground "#dfd" -activeforeground black  -anchor n\
 		 -text "Make Masks" \
 		 -command [code $this spoc $mycatname $instType]] \
+	    [button $w_.masterButtonFrame.stop -foreground black  -anchor n\
+		 -activeforeground black \
+		 -text "Stop" -state disabled \
+		 -command [code $this stop_gmMakeMasks]] \
 	    [button $w_.masterButtonFrame.close -foreground black  -anchor n\
 		 -activeforeground black \
 		 -text "Close" \
@@ -468,6 +486,8 @@ itcl::class cat::gmmps_spoc {
 	add_short_help $w_.masterBottomFrame.gmMM \
 	    {Output of the Slit Positioning Optimization Code}	    
 	add_short_help $w_.buttons.spoc  {Generate the mask (ODF)}
+	add_short_help $w_.masterButtonFrame.stop \
+	    {Stop searching and keep the best masks found so far}
 	add_short_help $w_.buttons.close {Close this window}
 
 	# Lastly, create the throughput plot for the initially displayed
@@ -590,7 +610,9 @@ itcl::class cat::gmmps_spoc {
     #   Bias, SpecLen, BiasType based on items set in this window.
     #   Rename mycatname.dat to mycatname.dat_temp
     #   Extract the exact field of view, and drop objects that aren't in it.
-    #   This is written to mycatname.dat.  Delete the mycatname.dat_temp
+    #   This is written to mycatname.dat, and all objects to
+    #   mycatname.dat_all (the input of the pointing optimizer).
+    #   Delete the mycatname.dat_temp
     #   Execute the SPOC algorithm., writes to mycatnameQ
     #   Get all fits header info out of the catalog.
     #   Save all that info to catalog.cfg
@@ -620,6 +642,13 @@ itcl::class cat::gmmps_spoc {
 	set MaskNum [$w_.instSetup.maskSpinBox get]
 	set minSpecDist [$w_.instSetup.minSpecDist get]
 	$catClass_ gmmps_config_ [list "$instType-minSpecDist" ] [list $minSpecDist ]
+	set timeLimit [$w_.instSetup.timeLimit get]
+	if {![string is double -strict $timeLimit] || $timeLimit < 0} {
+	    ::cat::vmAstroCat::warn_dialog "The time limit must be a number of seconds, 0 for none. Will use no limit."
+	    set timeLimit 0
+	    $w_.instSetup.timeLimit configure -value 0
+	}
+	$catClass_ gmmps_config_ [list "$instType-time_limit" ] [list $timeLimit ]
 	set wiggleVal [$w_.instSetup.wiggleSpinBox get]
 	if {$wiggleVal > 50} {
 	    ::cat::vmAstroCat::warn_dialog "The wiggle amount cannot be larger than 50%. Will reduce to 50%."
@@ -855,7 +884,7 @@ itcl::class cat::gmmps_spoc {
 				$maximumSlitsizeX $maximumSlitsizeY]
 	
 	#  Extract the field of view, and drop objects that are outside. Saves to mycatname.dat.
-	#  Remove mycatname.dat_temp
+	#  All objects are saved to mycatname.dat_all. Remove mycatname.dat_temp
 	# Print out to frame the results
 	set out1 ""
 	
@@ -865,7 +894,13 @@ itcl::class cat::gmmps_spoc {
 	    set out1 [exec gmmps_fov \
 			  [file rootname $mycatname].dat_temp \
 			  [file rootname $mycatname].dat \
-			  $fovfilename $PIXSCALE $CRPIX1 $CRPIX2]
+			  $fovfilename $PIXSCALE $CRPIX1 $CRPIX2 $DISPDIR]
+	    # All objects, for the pointing optimizer (gmMakeMasks 
+	    # --optimize-catalog), which moves them into and out of the FoV
+	    exec gmmps_fov \
+		[file rootname $mycatname].dat_temp \
+		[file rootname $mycatname].dat_all \
+		$fovfilename $PIXSCALE $CRPIX1 $CRPIX2 $DISPDIR 0
 	} msg ]} {
 	    ::cat::vmAstroCat::error_dialog "ERROR while getting field of view: $msg"
 	    return
@@ -873,8 +908,11 @@ itcl::class cat::gmmps_spoc {
 
 	file delete [file rootname $mycatname].dat_temp
 
-	# Add the spec dimensions to the output file
+	# Add the spec dimensions to the output file, and to all objects
 	set msg [append_specdims [file rootname $mycatname].dat $Spec_lmin $Spec_lmax $instType $Grating $Filter $cwl_user]
+	if {$msg != "ERROR"} {
+	    set msg [append_specdims [file rootname $mycatname].dat_all $Spec_lmin $Spec_lmax $instType $Grating $Filter $cwl_user]
+	}
 	if {$msg == "ERROR"} {
 	    ::cat::vmAstroCat::error_dialog "Some of the targets could not have their spectra dimensions calculated.\nThis is most likely a bug in GMMPS.\n Please submit a helpdesk ticket at https://www.gemini.edu/sciops/helpdesk."
 	    return
@@ -987,13 +1025,14 @@ itcl::class cat::gmmps_spoc {
 
 	if {[catch {
 	    set output \
-		[exec gmMakeMasks \
+		[run_gmMakeMasks \
 		     [file rootname $mycatname].dat \
 		     ${newname}ODF $instType \
 		     $fovfilename $PIXSCALE $MaskNum \
 		     $BiasType $DISPDIR $DET_IMG_ $DET_SPEC_ \
 		     $RA $DEC $CRPIX1 $CRPIX2 $minSpecDist \
-		     $wiggleVal $pack_spectra $gmmargs]
+		     $wiggleVal $pack_spectra $gmmargs \
+		     --deadline-ms [expr {int($timeLimit * 1000)}] --progress 1]
 	} msg]} {
 	    ::cat::vmAstroCat::error_dialog "ERROR creating mask file(s) : $msg"
 	    return
@@ -1109,6 +1148,154 @@ itcl::class cat::gmmps_spoc {
 
 
 
+    #########################################################################
+    #  Name: run_gmMakeMasks
+    #
+    #  Description:
+    #  Runs gmMakeMasks with the given arguments in a resident process
+    #  (gmMakeMasks --serve), started at the first call and kept for the
+    #  session. It keeps the field of view, the slits and their conflicts
+    #  between calls, so re-designing masks of the same catalogue is fast.
+    #  The reply is read as it comes (see read_gmMakeMasks), so the window
+    #  shows the progress and the "Stop" button works meanwhile.
+    #  Returns the text output, and raises an error on failure, like exec.
+    #
+    #########################################################################
+    #########################################################################    
+    protected method run_gmMakeMasks {args} {
+
+	if {$gmmServer_ == ""} {
+	    set gmmServer_ [open "|gmMakeMasks --serve" r+]
+	    fconfigure $gmmServer_ -buffering line -blocking 0
+	}
+
+	# One request per line, every argument in double quotes, with its
+	# quotes and backslashes escaped by a backslash
+	set request ""
+	foreach arg $args {
+	    append request "\"[string map {\\ \\\\ \" \\\"} $arg]\" "
+	}
+	if {[catch {puts $gmmServer_ $request}]} {
+	    catch {::close $gmmServer_}
+	    set gmmServer_ ""
+	    error "gmMakeMasks service not running"
+	}
+
+	# Wait for the reply, keeping the window alive
+	set gmmOutput_ ""
+	set gmmSkip_ 0
+	set gmmStatus_ ""
+	$w_.masterButtonFrame.spoc configure -state disabled
+	$w_.masterButtonFrame.stop configure -state normal
+	fileevent $gmmServer_ readable [code $this read_gmMakeMasks]
+	vwait [scope gmmStatus_]
+	$w_.masterButtonFrame.spoc configure -state normal
+	$w_.masterButtonFrame.stop configure -state disabled
+	$w_.masterBottomFrame.gmMM.04 configure -text ""
+
+	if {$gmmStatus_ == -1} {
+	    catch {::close $gmmServer_}
+	    set gmmServer_ ""
+	} else {
+	    fileevent $gmmServer_ readable {}
+	}
+	set output [string trimright $gmmOutput_ "\n"]
+	if {$gmmStatus_ != 0} {
+	    error $output
+	}
+	return $output
+    }
+
+
+    #########################################################################
+    #  Name: read_gmMakeMasks
+    #
+    #  Description:
+    #  Reads the lines of the gmMakeMasks reply available so far: the
+    #  output, the progress lines (shown below the output), the ODF files
+    #  (skipped, they are read from disk), and last the exit status, or
+    #  -1 if gmMakeMasks ended.
+    #
+    #########################################################################
+    #########################################################################    
+    protected method read_gmMakeMasks {} {
+
+	while {[gets $gmmServer_ line] >= 0} {
+	    if {$gmmSkip_ > 0} {
+		incr gmmSkip_ -1
+	    } elseif {[string match "@ODF *" $line]} {
+		# The file name may hold blanks or braces: count from the end
+		set gmmSkip_ [lindex [split $line] end]
+	    } elseif {[string match "@PROGRESS *" $line]} {
+		show_progress $line
+	    } elseif {[string match "@DONE *" $line]} {
+		set gmmStatus_ [lindex $line 1]
+		return
+	    } else {
+		append gmmOutput_ "$line\n"
+	    }
+	}
+
+	if {[eof $gmmServer_]} {
+	    set gmmStatus_ -1
+	}
+    }
+
+
+    #########################################################################
+    #  Name: show_progress
+    #
+    #  Description:
+    #  Shows a progress line of gmMakeMasks
+    #  ('@PROGRESS <phase> key=value ...') below the output.
+    #
+    #########################################################################
+    #########################################################################    
+    protected method show_progress {line} {
+
+	foreach field [lrange $line 2 end] {
+	    set value([lindex [split $field =] 0]) [lindex [split $field =] 1]
+	}
+	if {![info exists value(ms)]} {
+	    return
+	}
+	set elapsed [format "%.1f s" [expr {$value(ms) / 1000.}]]
+
+	switch -- [lindex $line 1] {
+	    conflicts {
+		set text "$value(slits) objects, $value(conflicts) conflicts"
+	    }
+	    pass {
+		set text "Mask $value(mask): pass $value(passes), best score $value(score)"
+	    }
+	    mask {
+		set text "Mask $value(mask) done, score $value(score)"
+	    }
+	    default {
+		set text "Writing masks"
+	    }
+	}
+	$w_.masterBottomFrame.gmMM.04 configure -text "$text ($elapsed)"
+    }
+
+
+    #########################################################################
+    #  Name: stop_gmMakeMasks
+    #
+    #  Description:
+    #  Asks the running gmMakeMasks to stop searching; it writes the best
+    #  masks found so far.
+    #
+    #########################################################################
+    #########################################################################    
+    protected method stop_gmMakeMasks {} {
+
+	if {$gmmServer_ != ""} {
+	    catch {exec kill -USR1 [pid $gmmServer_]}
+	}
+    }
+
+
     #########################################################################
     #  Name: append_specdims
     #
@@ -1597,6 +1784,14 @@ itcl::class cat::gmmps_spoc {
     protected variable DET_IMG_ ""
     protected variable DET_SPEC_ ""
 
+    # Channel to the resident gmMakeMasks (see run_gmMakeMasks)
+    protected common gmmServer_ ""
+
+    # The reply of the running request (see read_gmMakeMasks)
+    protected variable gmmOutput_ ""
+    protected variable gmmSkip_ 0
+    protected variable gmmStatus_ ""
+
     protected common nfilter
     protected common ngrate
     protected common ngtilt